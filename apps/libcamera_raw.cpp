@@ -57,6 +57,7 @@ static void event_loop(LibcameraRaw &app)
 		{
 			app.StopCamera();
 			app.StopEncoder();
+			output->Finish();
 			return;
 		}
 
@@ -100,6 +100,7 @@ static void event_loop(LibcameraEncoder &app)
 				std::cerr << "Halting: reached timeout of " << options->timeout << " milliseconds.\n";
 			app.StopCamera(); // stop complains if encoder very slow to close
 			app.StopEncoder();
+			output->Finish();
 			return;
 		}
 
@@ -12,6 +12,7 @@
 #include <libcamera/controls.h>
 #include <libcamera/request.h>
 
+#include "core/derived_images.hpp"
 #include "core/metadata.hpp"
 
 struct CompletedRequest
@@ -31,6 +32,7 @@ struct CompletedRequest
 	Request *request;
 	float framerate;
 	Metadata post_process_metadata;
+	DerivedImages derived_images;
 };
 
 using CompletedRequestPtr = std::shared_ptr<CompletedRequest>;
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * derived_images.hpp - images made from a request's buffers, shared between stages.
+ */
+#pragma once
+
+// Post-processing stages often want the same thing made from a frame: a copy of the lores
+// image in cached memory, a smaller greyscale version, an RGB crop for a neural network. The
+// request keeps whatever has been made from it, so that each is made only once however many
+// stages ask for it. Images are made from the buffer as it is when first asked for, so a
+// stage that changes a buffer shouldn't expect later stages to see its changes here.
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+namespace libcamera
+{
+class Stream;
+}
+
+struct DerivedImage
+{
+	unsigned int width = 0;
+	unsigned int height = 0;
+	unsigned int stride = 0;
+	std::vector<uint8_t> data;
+};
+
+using DerivedImagePtr = std::shared_ptr<DerivedImage const>;
+
+class DerivedImages
+{
+public:
+	enum Format
+	{
+		YUV420, // a copy of the whole buffer
+		GREY, // just the Y values (at full size, this is the YUV420 image itself)
+		RGB, // interleaved RGB888
+	};
+
+	// Return the image of this format and size made from the stream, calling make to produce
+	// it if nobody has asked for it yet. It's safe to call from different threads; if two ask
+	// for the same image at once, one makes it while the other waits.
+	DerivedImagePtr Get(libcamera::Stream const *stream, Format format, unsigned int width, unsigned int height,
+						std::function<void(DerivedImage &)> const &make)
+	{
+		std::shared_ptr<Entry> entry;
+		{
+			std::scoped_lock lock(mutex_);
+			std::shared_ptr<Entry> &slot = entries_[Key(stream, format, width, height)];
+			if (!slot)
+				slot = std::make_shared<Entry>();
+			entry = slot;
+		}
+
+		// Don't hold the lock while making the image, so that other images can be got meanwhile.
+		std::call_once(entry->once, [&entry, &make] {
+			auto image = std::make_shared<DerivedImage>();
+			if (entry->make)
+				entry->make(*image);
+			else
+				make(*image);
+			entry->image = std::move(image);
+			entry->make = nullptr;
+		});
+		return entry->image;
+	}
+
+	// Say how to make an image, which will then be made only if somebody asks for it. This is
+	// how images for streams without buffers of their own (see software_stream.hpp) are made.
+	// The function is kept by the request, so mustn't hold on to the request itself.
+	void Defer(libcamera::Stream const *stream, Format format, unsigned int width, unsigned int height,
+			   std::function<void(DerivedImage &)> make)
+	{
+		std::scoped_lock lock(mutex_);
+		std::shared_ptr<Entry> &slot = entries_[Key(stream, format, width, height)];
+		if (!slot)
+			slot = std::make_shared<Entry>();
+		slot->make = std::move(make);
+	}
+
+private:
+	using Key = std::tuple<libcamera::Stream const *, Format, unsigned int, unsigned int>;
+	struct Entry
+	{
+		std::once_flag once;
+		std::function<void(DerivedImage &)> make; // if given, used instead of the caller's
+		DerivedImagePtr image;
+	};
+
+	std::mutex mutex_;
+	std::map<Key, std::shared_ptr<Entry>> entries_;
+};
@@ -115,8 +115,9 @@ void LibcameraApp::OpenCamera()
 	if (options_->verbose)
 		std::cerr << "Acquired camera " << cam_id << std::endl;
 
-	if (!options_->post_process_file.empty())
-		post_processor_.Read(options_->post_process_file);
+	// The post-processor outlives the camera, so re-opening it leaves the stages as they were
+	// unless the file has changed.
+	post_processor_.Read(options_->post_process_file);
 	// The queue takes over ownership from the post-processor.
 	post_processor_.SetCallback(
 		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
@@ -150,7 +151,7 @@ void LibcameraApp::ConfigureViewfinder()
 		std::cerr << "Configuring viewfinder..." << std::endl;
 
 	int lores_stream_num = 0, raw_stream_num = 0;
-	bool have_lores_stream = options_->lores_width && options_->lores_height;
+	bool have_lores_stream = options_->lores_width && options_->lores_height && !options_->software_lores;
 	bool have_raw_stream = options_->viewfinder_mode.bit_depth;
 
 	StreamRoles stream_roles = { StreamRole::Viewfinder };
@@ -226,6 +227,7 @@ void LibcameraApp::ConfigureViewfinder()
 		streams_["lores"] = configuration_->at(lores_stream_num).stream();
 	if (have_raw_stream)
 		streams_["raw"] = configuration_->at(raw_stream_num).stream();
+	setupSoftwareLores();
 
 	post_processor_.Configure();
 
@@ -277,6 +279,7 @@ void LibcameraApp::ConfigureStill(unsigned int flags)
 
 	streams_["still"] = configuration_->at(0).stream();
 	streams_["raw"] = configuration_->at(1).stream();
+	setupSoftwareLores();
 
 	post_processor_.Configure();
 
@@ -290,7 +293,7 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 		std::cerr << "Configuring video..." << std::endl;
 
 	bool have_raw_stream = (flags & FLAG_VIDEO_RAW) || options_->mode.bit_depth;
-	bool have_lores_stream = options_->lores_width && options_->lores_height;
+	bool have_lores_stream = options_->lores_width && options_->lores_height && !options_->software_lores;
 	StreamRoles stream_roles = { StreamRole::VideoRecording };
 	int lores_index = 1;
 	if (have_raw_stream)
@@ -354,6 +357,7 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 		streams_["raw"] = configuration_->at(1).stream();
 	if (have_lores_stream)
 		streams_["lores"] = configuration_->at(lores_index).stream();
+	setupSoftwareLores();
 
 	post_processor_.Configure();
 
@@ -387,6 +391,7 @@ void LibcameraApp::Teardown()
 	frame_buffers_.clear();
 
 	streams_.clear();
+	software_lores_.reset();
 }
 
 void LibcameraApp::StartCamera()
@@ -631,6 +636,41 @@ StreamInfo LibcameraApp::GetStreamInfo(Stream const *stream) const
 	return info;
 }
 
+// If low resolution frames were asked for but the camera isn't supplying them, we make them
+// from the main stream instead (the PostProcessor does this for each request).
+
+void LibcameraApp::setupSoftwareLores()
+{
+	if (!options_->lores_width || !options_->lores_height || streams_.count("lores"))
+		return;
+
+	StreamInfo info = GetStreamInfo(GetMainStream());
+	if (info.pixel_format != libcamera::formats::YUV420)
+	{
+		if (options_->verbose)
+			std::cerr << "No low resolution stream, as the main stream isn't YUV420" << std::endl;
+		return;
+	}
+
+	Size lores_size(options_->lores_width, options_->lores_height);
+	lores_size.alignDownTo(2, 2);
+	if (lores_size.width > info.width || lores_size.height > info.height)
+		throw std::runtime_error("Low res image larger than main image");
+
+	StreamConfiguration config;
+	config.pixelFormat = libcamera::formats::YUV420;
+	config.size = lores_size;
+	config.stride = (lores_size.width + 63) & ~63;
+	config.frameSize = config.stride * lores_size.height * 3 / 2;
+	config.bufferCount = 0;
+	config.colorSpace = info.colour_space;
+	software_lores_ = std::make_unique<SoftwareStream>(config);
+	streams_["lores"] = software_lores_.get();
+
+	if (options_->verbose)
+		std::cerr << "Low resolution stream " << lores_size.toString() << " made in software" << std::endl;
+}
+
 void LibcameraApp::setupCapture()
 {
 	// First finish setting up the configuration.
@@ -30,6 +30,7 @@
 
 #include "core/completed_request.hpp"
 #include "core/post_processor.hpp"
+#include "core/software_stream.hpp"
 #include "core/stream_info.hpp"
 
 struct Options;
@@ -113,6 +114,8 @@ public:
 	Stream *VideoStream(StreamInfo *info = nullptr) const;
 	Stream *LoresStream(StreamInfo *info = nullptr) const;
 	Stream *GetMainStream() const;
+	// The lores stream, if we're making it in software rather than the camera is.
+	Stream *SoftwareLoresStream() const { return software_lores_.get(); }
 
 	std::vector<libcamera::Span<uint8_t>> Mmap(FrameBuffer *buffer) const;
 
@@ -181,6 +184,7 @@ private:
 	void stopPreview();
 	void previewThread();
 	void configureDenoise(const std::string &denoise_mode);
+	void setupSoftwareLores();
 
 	std::unique_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
@@ -188,6 +192,7 @@ private:
 	std::unique_ptr<CameraConfiguration> configuration_;
 	std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
 	std::map<std::string, Stream *> streams_;
+	std::unique_ptr<SoftwareStream> software_lores_;
 	FrameBufferAllocator *allocator_ = nullptr;
 	std::map<Stream *, std::queue<FrameBuffer *>> frame_buffers_;
 	std::vector<std::unique_ptr<Request>> requests_;
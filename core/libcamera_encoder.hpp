@@ -5,6 +5,10 @@
  * libcamera_encoder.cpp - libcamera video encoding class.
  */
 
+#include <algorithm>
+#include <deque>
+#include <utility>
+
 #include "core/libcamera_app.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
@@ -41,7 +45,7 @@ public:
 		int64_t timestamp_ns = buffer->metadata().timestamp;
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			encode_buffer_queue_.emplace_back(mem, completed_request); // creates a new reference
 		}
 		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 	}
@@ -62,20 +66,25 @@ protected:
 private:
 	void encodeBufferDone(void *mem)
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
+		// A NULL mem means the oldest buffer has been completed, as encoders
+		// normally finish everything in order. Otherwise mem identifies the buffer,
+		// which happens when the encoder drops a frame rather than encoding it.
+		std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+		if (encode_buffer_queue_.empty())
+			throw std::runtime_error("no buffer available to return");
+		if (mem == nullptr)
+			encode_buffer_queue_.pop_front(); // drop shared_ptr reference
+		else
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
-				throw std::runtime_error("no buffer available to return");
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			auto it = std::find_if(encode_buffer_queue_.begin(), encode_buffer_queue_.end(),
+								   [mem](auto const &item) { return item.first == mem; });
+			if (it == encode_buffer_queue_.end())
+				throw std::runtime_error("no such buffer to return");
+			encode_buffer_queue_.erase(it);
 		}
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
+	std::deque<std::pair<void *, CompletedRequestPtr>> encode_buffer_queue_;
 	std::mutex encode_buffer_queue_mutex_;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
 };
@@ -204,6 +204,8 @@ void Options::Print() const
 	std::cerr << "    height: " << height << std::endl;
 	std::cerr << "    output: " << output << std::endl;
 	std::cerr << "    post_process_file: " << post_process_file << std::endl;
+	if (post_process_pipeline)
+		std::cerr << "    post_process_pipeline: " << post_process_pipeline << std::endl;
 	std::cerr << "    rawfull: " << rawfull << std::endl;
 	if (nopreview)
 		std::cerr << "    preview: none" << std::endl;
@@ -232,6 +234,10 @@ void Options::Print() const
 		std::cerr << "    awb gains: red " << awb_gain_r << " blue " << awb_gain_b << std::endl;
 	std::cerr << "    flush: " << (flush ? "true" : "false") << std::endl;
 	std::cerr << "    wrap: " << wrap << std::endl;
+	std::cerr << "    preallocate: " << preallocate << std::endl;
+	std::cerr << "    sync-interval: " << sync_interval << std::endl;
+	std::cerr << "    fadvise: " << fadvise << std::endl;
+	std::cerr << "    fsync: " << fsync << std::endl;
 	std::cerr << "    brightness: " << brightness << std::endl;
 	std::cerr << "    contrast: " << contrast << std::endl;
 	std::cerr << "    saturation: " << saturation << std::endl;
@@ -243,6 +249,7 @@ void Options::Print() const
 	std::cerr << "    tuning-file: " << (tuning_file == "-" ? "(libcamera)" : tuning_file) << std::endl;
 	std::cerr << "    lores-width: " << lores_width << std::endl;
 	std::cerr << "    lores-height: " << lores_height << std::endl;
+	std::cerr << "    software-lores: " << software_lores << std::endl;
 
 	std::cerr << "    mode: " << mode.ToString() << std::endl;
 	std::cerr << "    viewfinder-mode: " << viewfinder_mode.ToString() << std::endl;
@@ -69,6 +69,9 @@ struct Options
 			 "Set the output file name")
 			("post-process-file", value<std::string>(&post_process_file),
 			 "Set the file name for configuring the post-processing")
+			("post-process-pipeline", value<unsigned int>(&post_process_pipeline)->default_value(0)->implicit_value(4),
+			 "Run each post-processing stage on its own thread, with up to this many frames waiting for each "
+			 "one, dropping frames when the first stage falls behind (0 = run all the stages for a frame together)")
 			("rawfull", value<bool>(&rawfull)->default_value(false)->implicit_value(true),
 			 "Force use of full resolution raw frames")
 			("nopreview,n", value<bool>(&nopreview)->default_value(false)->implicit_value(true),
@@ -103,6 +106,14 @@ struct Options
 			 "Flush output data as soon as possible")
 			("wrap", value<unsigned int>(&wrap)->default_value(0),
 			 "When writing multiple output files, reset the counter when it reaches this number")
+			("preallocate", value<unsigned int>(&preallocate)->default_value(0),
+			 "Preallocate space for output files (or each segment) in chunks of this many MB")
+			("sync-interval", value<unsigned int>(&sync_interval)->default_value(0),
+			 "Write output data back to storage every time this many MB have been written (0 = leave it to the kernel)")
+			("fadvise", value<bool>(&fadvise)->default_value(false)->implicit_value(true),
+			 "Drop output data from the page cache once it has been written back (best with --sync-interval)")
+			("fsync", value<bool>(&fsync)->default_value(false)->implicit_value(true),
+			 "Sync each output file (or segment) to storage when it is closed")
 			("brightness", value<float>(&brightness)->default_value(0),
 			 "Adjust the brightness of the output images, in the range -1.0 to 1.0")
 			("contrast", value<float>(&contrast)->default_value(1.0),
@@ -125,6 +136,9 @@ struct Options
 			 "Width of low resolution frames (use 0 to omit low resolution stream")
 			("lores-height", value<unsigned int>(&lores_height)->default_value(0),
 			 "Height of low resolution frames (use 0 to omit low resolution stream")
+			("software-lores", value<bool>(&software_lores)->default_value(false)->implicit_value(true),
+			 "Make the low resolution frames from the main ones in software, rather than asking the camera "
+			 "for them (this happens anyway when the camera can't supply them, as for stills)")
 			("mode", value<std::string>(&mode_string),
 			 "Camera mode as W:H:bit-depth:packing, where packing is P (packed) or U (unpacked)")
 			("viewfinder-mode", value<std::string>(&viewfinder_mode_string),
@@ -143,6 +157,7 @@ struct Options
 	std::string config_file;
 	std::string output;
 	std::string post_process_file;
+	unsigned int post_process_pipeline;
 	unsigned int width;
 	unsigned int height;
 	bool rawfull;
@@ -167,6 +182,10 @@ struct Options
 	float awb_gain_b;
 	bool flush;
 	unsigned int wrap;
+	unsigned int preallocate;
+	unsigned int sync_interval;
+	bool fadvise;
+	bool fsync;
 	float brightness;
 	float contrast;
 	float saturation;
@@ -180,6 +199,7 @@ struct Options
 	bool qt_preview;
 	unsigned int lores_width;
 	unsigned int lores_height;
+	bool software_lores;
 	unsigned int camera;
 	std::string mode_string;
 	Mode mode;
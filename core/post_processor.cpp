@@ -5,17 +5,309 @@
  * post_processor.cpp - Post processor implementation.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <sstream>
+
+#include <libcamera/formats.h>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 #include "core/libcamera_app.hpp"
+#include "core/options.hpp"
 #include "core/post_processor.hpp"
 
+#include "image/image_kernels.hpp"
+
+#include "post_processing_stages/parallel_for.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
-PostProcessor::PostProcessor(LibcameraApp *app) : app_(app)
+// When pipelining, every stage has a worker thread that takes frames from a queue, runs the
+// stage on them and hands them on to the next stage's queue. Each queue has only the one
+// thread putting frames in and the one taking them out, and is bounded so that a slow stage
+// holds back the ones before it rather than letting frames pile up. The first queue is fed
+// from the camera's thread, which mustn't wait, so when that's full the frame is dropped
+// instead. The last stage (or one that drops the frame) completes the frame's promise for
+// the output thread.
+
+class PostProcessor::Pipeline
+{
+public:
+	Pipeline(std::vector<StagePtr> const &stages, unsigned int depth, bool verbose, std::condition_variable &cv)
+		: stages_(stages), verbose_(verbose), cv_(cv), stats_(stages.size()), last_report_(clock::now())
+	{
+		for (unsigned int i = 0; i < stages_.size(); i++)
+			links_.emplace_back(std::make_unique<Link>(depth));
+		for (unsigned int i = 0; i < stages_.size(); i++)
+			workers_.emplace_back(&Pipeline::worker, this, i);
+	}
+
+	// Let the frames already queued run through, then wind the workers down.
+	~Pipeline()
+	{
+		links_[0]->Close();
+		for (auto &worker : workers_)
+			worker.join();
+		report("Post processing pipeline finished");
+	}
+
+	// Returns false, leaving the promise alone, if the first stage already has as many frames
+	// waiting as it's allowed.
+	bool TryPush(CompletedRequestPtr &request, std::promise<bool> &promise)
+	{
+		Item item { &request, {} };
+		if (!links_[0]->TryPush(item, promise))
+		{
+			dropped_++;
+			return false;
+		}
+		return true;
+	}
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	struct Item
+	{
+		CompletedRequestPtr *request;
+		std::promise<bool> promise;
+	};
+
+	class Link
+	{
+	public:
+		Link(unsigned int capacity) : items_(std::max(capacity, 1u)), head_(0), count_(0), closed_(false) {}
+
+		void Push(Item &&item)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			not_full_.wait(lock, [this] { return count_ < items_.size(); });
+			items_[(head_ + count_++) % items_.size()] = std::move(item);
+			not_empty_.notify_one();
+		}
+
+		bool TryPush(Item &item, std::promise<bool> &promise)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (count_ == items_.size())
+				return false;
+			item.promise = std::move(promise);
+			items_[(head_ + count_++) % items_.size()] = std::move(item);
+			not_empty_.notify_one();
+			return true;
+		}
+
+		// Returns false once the link has been closed and everything in it taken.
+		bool Pop(Item &item)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			not_empty_.wait(lock, [this] { return count_ || closed_; });
+			if (!count_)
+				return false;
+			item = std::move(items_[head_]);
+			head_ = (head_ + 1) % items_.size();
+			count_--;
+			not_full_.notify_one();
+			return true;
+		}
+
+		void Close()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			closed_ = true;
+			not_empty_.notify_one();
+		}
+
+	private:
+		std::vector<Item> items_;
+		size_t head_;
+		size_t count_;
+		bool closed_;
+		std::mutex mutex_;
+		std::condition_variable not_full_;
+		std::condition_variable not_empty_;
+	};
+
+	struct Stats
+	{
+		std::atomic<unsigned int> frames { 0 };
+		std::atomic<int64_t> busy_us { 0 };
+	};
+
+	void worker(unsigned int i)
+	{
+		Item item;
+		while (links_[i]->Pop(item))
+		{
+			auto start_time = clock::now();
+			bool drop_request = stages_[i]->Process(*item.request);
+			stats_[i].busy_us +=
+				std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start_time).count();
+			stats_[i].frames++;
+
+			if (!drop_request && i + 1 < stages_.size())
+			{
+				links_[i + 1]->Push(std::move(item));
+				continue;
+			}
+
+			item.promise.set_value(drop_request);
+			cv_.notify_one();
+
+			if (verbose_ && i + 1 == stages_.size() && clock::now() - last_report_ > 5s)
+			{
+				report("Post processing pipeline");
+				last_report_ = clock::now();
+			}
+		}
+
+		if (i + 1 < stages_.size())
+			links_[i + 1]->Close();
+	}
+
+	// The stage with the longest time per frame limits the frame rate of the whole pipeline.
+	void report(char const *title)
+	{
+		std::vector<double> frame_ms(stages_.size());
+		for (unsigned int i = 0; i < stages_.size(); i++)
+			frame_ms[i] = stats_[i].frames ? stats_[i].busy_us / 1000.0 / stats_[i].frames : 0;
+		unsigned int slowest = std::max_element(frame_ms.begin(), frame_ms.end()) - frame_ms.begin();
+		if (!stats_[0].frames)
+			return;
+
+		std::cerr << title << ":" << std::endl;
+		if (dropped_)
+			std::cerr << "    " << dropped_ << " frames dropped with the first stage behind" << std::endl;
+		for (unsigned int i = 0; i < stages_.size(); i++)
+		{
+			std::cerr << "    " << stages_[i]->Name() << ": " << stats_[i].frames << " frames, " << frame_ms[i]
+					  << "ms per frame";
+			if (frame_ms[i])
+				std::cerr << " (up to " << 1000 / frame_ms[i] << " fps)";
+			if (i == slowest && stages_.size() > 1)
+				std::cerr << " <- slowest";
+			std::cerr << std::endl;
+		}
+	}
+
+	std::vector<StagePtr> stages_;
+	bool verbose_;
+	std::condition_variable &cv_;
+	std::vector<std::unique_ptr<Link>> links_;
+	std::vector<Stats> stats_;
+	std::vector<std::thread> workers_;
+	std::atomic<unsigned int> dropped_ { 0 };
+	clock::time_point last_report_;
+};
+
+// Consecutive stages that only change each pixel of the main image on its own are run as one
+// of these. It goes over the image once, a row at a time, taking each row into a copy (as
+// the buffers are uncached), running all the stages' row kernels on it, and writing it back.
+// The rows are shared between the cores. The stages themselves are still configured, started
+// and so on by the PostProcessor as normal.
+
+class FusedStage : public PostProcessingStage
+{
+public:
+	FusedStage(LibcameraApp *app, std::vector<StagePtr> const &stages) : PostProcessingStage(app), stages_(stages)
+	{
+		for (auto &stage : stages_)
+			name_ += (name_.empty() ? "" : "+") + std::string(stage->Name());
+		stream_ = app_->GetMainStream();
+		info_ = app_->GetStreamInfo(stream_);
+	}
+
+	char const *Name() const override { return name_.c_str(); }
+
+	bool Process(CompletedRequestPtr &completed_request) override
+	{
+		std::vector<RowKernel> kernels;
+		for (auto &stage : stages_)
+		{
+			RowKernel kernel = stage->GetRowKernel(completed_request);
+			if (kernel)
+				kernels.push_back(std::move(kernel));
+		}
+		if (kernels.empty())
+			return false;
+
+		uint8_t *Y = app_->Mmap(completed_request->buffers[stream_])[0].data();
+		unsigned int width = info_.width, height = info_.height, stride = info_.stride;
+		uint8_t *U = Y + stride * height, *V = U + (stride / 2) * (height / 2);
+
+		// Each thread takes pairs of rows, so that every row of chroma goes with one of them.
+		parallel_for((height + 1) / 2, [&](int begin, int end) {
+			std::vector<uint8_t> row_buffer(stride * 2);
+			ImageRow row { 0, width, row_buffer.data(), nullptr, nullptr };
+			for (unsigned int y = begin * 2; y < std::min<unsigned int>(end * 2, height); y++)
+			{
+				uint8_t *Y_row = Y + y * stride;
+				uint8_t *U_row = U + (y / 2) * (stride / 2), *V_row = V + (y / 2) * (stride / 2);
+				bool chroma = !(y & 1) && y / 2 < height / 2;
+				row.y = y;
+				row.U = chroma ? row.Y + stride : nullptr;
+				row.V = chroma ? row.U + stride / 2 : nullptr;
+				memcpy(row.Y, Y_row, width);
+				if (chroma)
+				{
+					memcpy(row.U, U_row, width / 2);
+					memcpy(row.V, V_row, width / 2);
+				}
+				for (auto &kernel : kernels)
+					kernel(row);
+				memcpy(Y_row, row.Y, width);
+				if (chroma)
+				{
+					memcpy(U_row, row.U, width / 2);
+					memcpy(V_row, row.V, width / 2);
+				}
+			}
+		});
+
+		return false;
+	}
+
+private:
+	std::vector<StagePtr> stages_;
+	std::string name_;
+	libcamera::Stream *stream_;
+	StreamInfo info_;
+};
+
+// Replace each run of two or more stages that have row kernels with a FusedStage. This needs
+// to happen after the stages are configured, as that's when they know if they can do it.
+
+std::vector<StagePtr> PostProcessor::fuseStages(std::vector<StagePtr> const &stages)
+{
+	std::vector<StagePtr> steps;
+	for (unsigned int i = 0; i < stages.size();)
+	{
+		unsigned int j = i;
+		while (j < stages.size() && stages[j]->HasRowKernel())
+			j++;
+		if (j - i >= 2)
+		{
+			std::vector<StagePtr> fused(stages.begin() + i, stages.begin() + j);
+			steps.push_back(std::make_shared<FusedStage>(app_, fused));
+			i = j;
+		}
+		else
+			steps.push_back(stages[i++]);
+	}
+	return steps;
+}
+
+PostProcessor::PostProcessor(LibcameraApp *app)
+	: app_(app), read_time_(0), watch_abort_(false), reload_requested_(false), software_lores_(nullptr),
+	  main_stream_(nullptr), requests_queued_(0), requests_done_(0)
 {
 }
 
@@ -25,8 +317,35 @@ PostProcessor::~PostProcessor()
 
 void PostProcessor::Read(std::string const &filename)
 {
+	// We get called every time the camera is opened, which some applications do repeatedly.
+	// Creating the stages can be slow (think of loading neural network models), so keep the
+	// ones we have unless the file has actually changed.
+	std::string contents;
+	if (!filename.empty())
+	{
+		std::ifstream file(filename);
+		if (!file)
+			throw std::runtime_error("PostProcessor: failed to open " + filename);
+		contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+	if (filename == filename_ && contents == contents_)
+	{
+		if (!stages_.empty())
+			std::cerr << "Post processing stages unchanged, re-using them (saved "
+					  << std::chrono::duration_cast<std::chrono::milliseconds>(read_time_).count() << "ms)"
+					  << std::endl;
+		return;
+	}
+
+	stages_.clear();
+	filename_.clear();
+	if (filename.empty())
+		return;
+
+	auto start_time = std::chrono::steady_clock::now();
 	boost::property_tree::ptree root;
-	boost::property_tree::read_json(filename, root);
+	std::istringstream stream(contents);
+	boost::property_tree::read_json(stream, root);
 	for (auto const &key_and_value : root)
 	{
 		PostProcessingStage *stage = createPostProcessingStage(key_and_value.first.c_str());
@@ -39,6 +358,10 @@ void PostProcessor::Read(std::string const &filename)
 		else
 			std::cerr << "No post processing stage found for \"" << key_and_value.first << "\"" << std::endl;
 	}
+
+	filename_ = filename;
+	contents_ = std::move(contents);
+	read_time_ = std::chrono::steady_clock::now() - start_time;
 }
 
 PostProcessingStage *PostProcessor::createPostProcessingStage(char const *name)
@@ -54,6 +377,7 @@ void PostProcessor::SetCallback(PostProcessorCallback callback)
 
 void PostProcessor::AdjustConfig(std::string const &use_case, StreamConfiguration *config)
 {
+	use_case_ = use_case;
 	for (auto &stage : stages_)
 	{
 		stage->AdjustConfig(use_case, config);
@@ -62,6 +386,14 @@ void PostProcessor::AdjustConfig(std::string const &use_case, StreamConfiguratio
 
 void PostProcessor::Configure()
 {
+	software_lores_ = app_->SoftwareLoresStream();
+	if (software_lores_)
+	{
+		software_lores_info_ = app_->GetStreamInfo(software_lores_);
+		main_stream_ = app_->GetMainStream();
+		main_stream_info_ = app_->GetStreamInfo(main_stream_);
+	}
+
 	for (auto &stage : stages_)
 	{
 		stage->Configure();
@@ -77,23 +409,56 @@ void PostProcessor::Start()
 	{
 		stage->Start();
 	}
+
+	steps_ = fuseStages(stages_);
+	pipeline_ = createPipeline(steps_);
+
+	if (!filename_.empty())
+	{
+		watch_abort_ = false;
+		watch_thread_ = std::thread(&PostProcessor::watchThread, this);
+	}
 }
 
 void PostProcessor::Process(CompletedRequestPtr &request)
 {
-	if (stages_.empty())
+	std::unique_lock<std::mutex> l(mutex_);
+	if (stages_.empty() && futures_.empty())
 	{
+		l.unlock();
 		callback_(request);
 		return;
 	}
 
-	std::unique_lock<std::mutex> l(mutex_);
+	if (software_lores_)
+		deferSoftwareLores(request);
+
 	requests_.push(std::move(request)); // caller has given us ownership of this reference
 
+	if (pipeline_)
+	{
+		// Don't hold up the output thread while handing the frame over. The pipeline can't be
+		// swapped for another while we hold its lock.
+		std::promise<bool> promise;
+		futures_.push(promise.get_future());
+		requests_queued_++;
+		CompletedRequestPtr &queued = requests_.back();
+		std::lock_guard<std::mutex> pipeline_lock(pipeline_mutex_);
+		l.unlock();
+		if (!pipeline_->TryPush(queued, promise))
+		{
+			promise.set_value(true);
+			cv_.notify_one();
+		}
+		return;
+	}
+
+	// The stages may be swapped for new ones while this request is in flight, so it keeps hold
+	// of the ones it started with.
 	std::promise<bool> promise;
-	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
+	auto process_fn = [this, stages = steps_](CompletedRequestPtr &request, std::promise<bool> promise) {
 		bool drop_request = false;
-		for (auto &stage : stages_)
+		for (auto &stage : stages)
 		{
 			if (stage->Process(request))
 			{
@@ -108,9 +473,36 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
 	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
 	futures_.push(promise.get_future());
+	requests_queued_++;
 	std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
 }
 
+// The lores image is made by averaging the pixels of the main image under each of its pixels,
+// which reads the main buffer only once. It's only done for requests where a stage asks for it.
+
+void PostProcessor::deferSoftwareLores(CompletedRequestPtr &request)
+{
+	StreamInfo const &in = main_stream_info_, &out = software_lores_info_;
+	request->derived_images.Defer(
+		software_lores_, DerivedImages::YUV420, out.width, out.height,
+		[this, request = request.get(), main_stream = main_stream_, in, out](DerivedImage &image) {
+			uint8_t const *src = app_->Mmap(request->buffers[main_stream])[0].data();
+			image.width = out.width;
+			image.height = out.height;
+			image.stride = out.stride;
+			image.data.resize(out.stride * out.height * 3 / 2);
+			uint8_t *dst = image.data.data();
+			resize_plane_box(src, in.stride, in.width, in.height, dst, out.stride, out.width, out.height);
+			for (unsigned int plane = 0; plane < 2; plane++)
+			{
+				uint8_t const *src_uv = src + in.stride * in.height + plane * (in.stride / 2) * (in.height / 2);
+				uint8_t *dst_uv = dst + out.stride * out.height + plane * (out.stride / 2) * (out.height / 2);
+				resize_plane_box(src_uv, in.stride / 2, in.width / 2, in.height / 2, dst_uv, out.stride / 2,
+								 out.width / 2, out.height / 2);
+			}
+		});
+}
+
 void PostProcessor::outputThread()
 {
 	while (true)
@@ -134,6 +526,8 @@ void PostProcessor::outputThread()
 			futures_.pop();
 			request = std::move(requests_.front()); // reuse as it's being dropped from the queue
 			requests_.pop();
+			requests_done_++;
+			done_cv_.notify_all();
 		}
 
 		if (!drop_request)
@@ -143,6 +537,21 @@ void PostProcessor::outputThread()
 
 void PostProcessor::Stop()
 {
+	if (watch_thread_.joinable())
+	{
+		watch_abort_ = true;
+		watch_thread_.join();
+	}
+
+	// Wait for the frames still in the pipeline before stopping the stages under them.
+	std::unique_ptr<Pipeline> pipeline;
+	{
+		std::unique_lock<std::mutex> l(mutex_);
+		std::lock_guard<std::mutex> pipeline_lock(pipeline_mutex_);
+		std::swap(pipeline, pipeline_);
+	}
+	pipeline.reset();
+
 	for (auto &stage : stages_)
 	{
 		stage->Stop();
@@ -157,10 +566,194 @@ void PostProcessor::Stop()
 	output_thread_.join();
 }
 
+std::unique_ptr<PostProcessor::Pipeline> PostProcessor::createPipeline(std::vector<StagePtr> const &stages)
+{
+	Options const *options = app_->GetOptions();
+	if (!options->post_process_pipeline || stages.empty())
+		return nullptr;
+	return std::make_unique<Pipeline>(stages, options->post_process_pipeline, options->verbose, cv_);
+}
+
 void PostProcessor::Teardown()
 {
+	steps_.clear();
 	for (auto &stage : stages_)
 	{
 		stage->Teardown();
 	}
 }
+
+void PostProcessor::Reload()
+{
+	reload_requested_ = true;
+}
+
+// Watch the directory rather than the file itself, because many editors save a file by
+// writing a new one and renaming it over the old.
+
+void PostProcessor::watchThread()
+{
+	size_t slash = filename_.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : filename_.substr(0, slash + 1);
+	std::string name = slash == std::string::npos ? filename_ : filename_.substr(slash + 1);
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		std::cerr << "PostProcessor: unable to watch " << filename_ << " for changes" << std::endl;
+
+	while (!watch_abort_)
+	{
+		bool changed = false;
+		pollfd pfd = { fd, POLLIN, 0 };
+		if (fd >= 0 && poll(&pfd, 1, 100) > 0)
+		{
+			alignas(inotify_event) char buf[4096];
+			ssize_t len;
+			while ((len = read(fd, buf, sizeof(buf))) > 0)
+			{
+				for (char *p = buf; p < buf + len; p += sizeof(inotify_event) + ((inotify_event *)p)->len)
+				{
+					inotify_event const *event = (inotify_event *)p;
+					if (event->len && name == event->name)
+						changed = true;
+				}
+			}
+		}
+		else if (fd < 0)
+			std::this_thread::sleep_for(100ms);
+
+		if (reload_requested_.exchange(false) || changed)
+			reloadStages();
+	}
+
+	if (fd >= 0)
+		close(fd);
+}
+
+// Build the new list of stages off to the side, and swap it in between frames. A stage that
+// is the same type, in the same place, as before gets the chance to take its new parameters
+// without losing its state. Anything else is created afresh. Nothing changes for the stages
+// already running until everything has been read successfully, and then it all changes at
+// once. New stages can't change the camera configuration, so any that would need to (by
+// asking for more buffers, say) are refused, and the application must be restarted for them.
+
+void PostProcessor::reloadStages()
+{
+	std::ifstream file(filename_);
+	std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (!file || contents == contents_)
+		return;
+
+	auto start_time = std::chrono::steady_clock::now();
+	std::vector<StagePtr> old_stages, new_stages;
+	{
+		std::unique_lock<std::mutex> l(mutex_);
+		old_stages = stages_;
+	}
+	std::vector<ReloadFn> reloads;
+
+	try
+	{
+		boost::property_tree::ptree root;
+		std::istringstream stream(contents);
+		boost::property_tree::read_json(stream, root);
+
+		for (auto const &key_and_value : root)
+		{
+			unsigned int i = new_stages.size();
+			if (i < old_stages.size() && key_and_value.first == old_stages[i]->Name())
+			{
+				ReloadFn reload = old_stages[i]->Reload(key_and_value.second);
+				if (reload)
+				{
+					new_stages.push_back(old_stages[i]);
+					reloads.push_back(std::move(reload));
+					continue;
+				}
+			}
+
+			PostProcessingStage *stage = createPostProcessingStage(key_and_value.first.c_str());
+			if (!stage)
+			{
+				std::cerr << "No post processing stage found for \"" << key_and_value.first << "\"" << std::endl;
+				continue;
+			}
+			std::cerr << "Reading post processing stage \"" << key_and_value.first << "\"" << std::endl;
+			new_stages.push_back(StagePtr(stage));
+			stage->Read(key_and_value.second);
+			checkConfig(stage);
+			stage->Configure();
+			stage->Start();
+		}
+	}
+	catch (std::exception const &e)
+	{
+		// Stay exactly as we were.
+		std::cerr << "PostProcessor: failed to reload " << filename_ << ": " << e.what() << std::endl;
+		for (auto &stage : new_stages)
+		{
+			if (std::find(old_stages.begin(), old_stages.end(), stage) == old_stages.end())
+			{
+				stage->Stop();
+				stage->Teardown();
+			}
+		}
+		contents_ = std::move(contents); // don't keep trying until the file changes again
+		return;
+	}
+
+	std::vector<StagePtr> new_steps = fuseStages(new_stages), old_steps;
+	std::unique_ptr<Pipeline> new_pipeline = createPipeline(new_steps), old_pipeline;
+	uint64_t last_old_request;
+	{
+		std::unique_lock<std::mutex> l(mutex_);
+		for (auto &reload : reloads)
+			reload();
+		stages_ = new_stages;
+		old_steps = std::move(steps_);
+		steps_ = std::move(new_steps);
+		std::lock_guard<std::mutex> pipeline_lock(pipeline_mutex_);
+		old_pipeline = std::move(pipeline_);
+		pipeline_ = std::move(new_pipeline);
+		last_old_request = requests_queued_;
+	}
+	contents_ = std::move(contents);
+	std::cerr << "Reloaded post processing stages from " << filename_ << " (" << reloads.size() << " kept, "
+			  << new_stages.size() - reloads.size() << " new) in "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time)
+					 .count()
+			  << "ms" << std::endl;
+
+	// Stages no longer wanted can be stopped once the last request that might be using them
+	// has been through the output thread.
+	old_pipeline.reset();
+	old_steps.clear();
+	{
+		std::unique_lock<std::mutex> l(mutex_);
+		done_cv_.wait(l, [&] { return requests_done_ >= last_old_request; });
+	}
+	for (auto &stage : old_stages)
+	{
+		if (std::find(new_stages.begin(), new_stages.end(), stage) != new_stages.end())
+			continue;
+		stage->Stop();
+		stage->Teardown();
+	}
+}
+
+// Refuse a stage that would have changed the camera configuration, had it been there when the
+// camera was configured.
+
+void PostProcessor::checkConfig(PostProcessingStage *stage)
+{
+	libcamera::Stream *stream = app_->GetMainStream();
+	if (!stream)
+		return;
+	StreamConfiguration config = stream->configuration();
+	stage->AdjustConfig(use_case_, &config);
+	StreamConfiguration const &current = stream->configuration();
+	if (config.size != current.size || config.pixelFormat != current.pixelFormat ||
+		config.bufferCount != current.bufferCount)
+		throw std::runtime_error(std::string("stage \"") + stage->Name() +
+								 "\" needs the camera configuring again, restart the application to add it");
+}
@@ -7,16 +7,20 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <future>
+#include <memory>
 #include <mutex>
 #include <queue>
 
 #include "core/completed_request.hpp"
+#include "core/stream_info.hpp"
 
 namespace libcamera
 {
+class Stream;
 struct StreamConfiguration;
 }
 
@@ -26,7 +30,7 @@ using namespace std::chrono_literals;
 class PostProcessingStage;
 using PostProcessorCallback = std::function<void(CompletedRequestPtr &)>;
 using StreamConfiguration = libcamera::StreamConfiguration;
-typedef std::unique_ptr<PostProcessingStage> StagePtr;
+typedef std::shared_ptr<PostProcessingStage> StagePtr;
 
 class PostProcessor
 {
@@ -35,6 +39,8 @@ public:
 
 	~PostProcessor();
 
+	// Create the stages listed in the file. If they were already created from the same file,
+	// and it hasn't changed, they are kept. An empty filename removes all the stages.
 	void Read(std::string const &filename);
 
 	void SetCallback(PostProcessorCallback callback);
@@ -51,15 +57,51 @@ public:
 
 	void Teardown();
 
+	// Re-read the post-processing file while running. This happens anyway whenever the file
+	// is written, but applications may also want to trigger it, for example from a signal.
+	void Reload();
+
 private:
 	PostProcessingStage *createPostProcessingStage(char const *name);
+	void watchThread();
+	void reloadStages();
+	void checkConfig(PostProcessingStage *stage);
+	class Pipeline;
+	std::unique_ptr<Pipeline> createPipeline(std::vector<StagePtr> const &stages);
+	std::vector<StagePtr> fuseStages(std::vector<StagePtr> const &stages);
+	void deferSoftwareLores(CompletedRequestPtr &request);
 
 	LibcameraApp *app_;
 	std::vector<StagePtr> stages_;
+	// What actually gets run on each request: the stages, with some of them fused together.
+	std::vector<StagePtr> steps_;
+	std::string use_case_; // what the camera was last configured for
+	std::string filename_; // the file the stages were read from, and its contents
+	std::string contents_;
+	std::chrono::steady_clock::duration read_time_; // how long it took
+	std::thread watch_thread_;
+	std::atomic<bool> watch_abort_;
+	std::atomic<bool> reload_requested_;
 	void outputThread();
 
+	// Optionally, each stage runs on its own thread, with frames passed along from one to the next.
+	// Swapping it needs both mutex_ and pipeline_mutex_ (in that order); pushing frames needs
+	// only pipeline_mutex_.
+	std::unique_ptr<Pipeline> pipeline_;
+	std::mutex pipeline_mutex_;
+
+	// Without a lores stream from the camera, we make the lores images from the main ones.
+	libcamera::Stream *software_lores_;
+	StreamInfo software_lores_info_;
+	libcamera::Stream *main_stream_;
+	StreamInfo main_stream_info_;
+
 	std::queue<CompletedRequestPtr> requests_;
 	std::queue<std::future<bool>> futures_;
+	// Counts of requests given to the stages, and of those finished with.
+	uint64_t requests_queued_;
+	uint64_t requests_done_;
+	std::condition_variable done_cv_;
 	std::thread output_thread_;
 	bool quit_;
 	PostProcessorCallback callback_;
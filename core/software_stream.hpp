@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * software_stream.hpp - a stream whose images we make ourselves.
+ */
+#pragma once
+
+#include <libcamera/stream.h>
+
+// A stream that the camera doesn't produce, but which we make from another of its streams.
+// It has a configuration, so GetStreamInfo and the like work as usual, but it has no buffers.
+// Its images are made for each request by the PostProcessor, and stages get them as derived
+// images (see derived_images.hpp), which they should do for any stream they only read.
+
+class SoftwareStream : public libcamera::Stream
+{
+public:
+	SoftwareStream(libcamera::StreamConfiguration const &config) { configuration_ = config; }
+};
@@ -54,6 +54,27 @@ struct VideoOptions : public Options
 			 "Write output to a circular buffer of the given size (in MB) which is saved on exit")
 			("frames", value<unsigned int>(&frames)->default_value(0),
 			 "Run for the exact number of frames specified. This will override any timeout set.")
+			("encoder-backpressure", value<std::string>(&encoder_backpressure)->default_value("block"),
+			 "What to do when the encoder has no free input buffer: block (wait for --encoder-timeout, then drop), "
+			 "drop (drop the frame at once) or drop-idr (drop it and force an IDR frame next) (h264 only)")
+			("encoder-timeout", value<unsigned int>(&encoder_timeout)->default_value(100),
+			 "Time (in ms) to wait for a free encoder input buffer before dropping the frame (h264 only)")
+			("encoder-output-buffers", value<unsigned int>(&encoder_output_buffers)->default_value(6),
+			 "Number of encoder input buffers, which must be at least the camera queue depth (h264 only)")
+			("encoder-capture-buffers", value<unsigned int>(&encoder_capture_buffers)->default_value(12),
+			 "Number of encoded bitstream buffers, which absorb delays in writing the output (h264 only)")
+			("writer-buffer", value<unsigned int>(&writer_buffer)->default_value(16),
+			 "Size (in MB) of the buffer between the encoder and the thread writing output files")
+			("writer-block", value<unsigned int>(&writer_block)->default_value(1024),
+			 "Size (in KB) of the blocks in which output files are written")
+			("writer-direct", value<bool>(&writer_direct)->default_value(false)->implicit_value(true),
+			 "Write output files with O_DIRECT, bypassing the page cache")
+			("udp-payload", value<unsigned int>(&udp_payload)->default_value(65507),
+			 "Maximum size (in bytes) of each UDP packet's payload, e.g. 1472 to avoid IP fragmentation")
+			("udp-pacing", value<bool>(&udp_pacing)->default_value(false)->implicit_value(true),
+			 "Spread the UDP packets of each frame over the frame interval, rather than sending them in one burst")
+			("udp-gso", value<bool>(&udp_gso)->default_value(true)->implicit_value(true),
+			 "Let the kernel split frames into UDP packets (UDP_SEGMENT) where it can, rather than using sendmmsg")
 			;
 		// clang-format on
 	}
@@ -75,6 +96,16 @@ struct VideoOptions : public Options
 	uint32_t segment;
 	size_t circular;
 	uint32_t frames;
+	std::string encoder_backpressure;
+	unsigned int encoder_timeout;
+	unsigned int encoder_output_buffers;
+	unsigned int encoder_capture_buffers;
+	unsigned int writer_buffer;
+	unsigned int writer_block;
+	bool writer_direct;
+	unsigned int udp_payload;
+	bool udp_pacing;
+	bool udp_gso;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -93,6 +124,18 @@ struct VideoOptions : public Options
 			codec = "mjpeg";
 		else
 			throw std::runtime_error("unrecognised codec " + codec);
+		if (strcasecmp(encoder_backpressure.c_str(), "block") == 0)
+			encoder_backpressure = "block";
+		else if (strcasecmp(encoder_backpressure.c_str(), "drop") == 0)
+			encoder_backpressure = "drop";
+		else if (strcasecmp(encoder_backpressure.c_str(), "drop-idr") == 0)
+			encoder_backpressure = "drop-idr";
+		else
+			throw std::runtime_error("unrecognised encoder backpressure policy " + encoder_backpressure);
+		if (encoder_output_buffers == 0 || encoder_capture_buffers == 0)
+			throw std::runtime_error("encoder buffer counts must be non-zero");
+		if (udp_payload == 0 || udp_payload > 65507)
+			throw std::runtime_error("udp-payload must be between 1 and 65507");
 		if (strcasecmp(initial.c_str(), "pause") == 0)
 			pause = true;
 		else if (strcasecmp(initial.c_str(), "record") == 0)
@@ -123,5 +166,15 @@ struct VideoOptions : public Options
 		std::cerr << "    split: " << split << std::endl;
 		std::cerr << "    segment: " << segment << std::endl;
 		std::cerr << "    circular: " << circular << std::endl;
+		std::cerr << "    encoder-backpressure: " << encoder_backpressure << std::endl;
+		std::cerr << "    encoder-timeout: " << encoder_timeout << std::endl;
+		std::cerr << "    encoder-output-buffers: " << encoder_output_buffers << std::endl;
+		std::cerr << "    encoder-capture-buffers: " << encoder_capture_buffers << std::endl;
+		std::cerr << "    writer-buffer: " << writer_buffer << std::endl;
+		std::cerr << "    writer-block: " << writer_block << std::endl;
+		std::cerr << "    writer-direct: " << writer_direct << std::endl;
+		std::cerr << "    udp-payload: " << udp_payload << std::endl;
+		std::cerr << "    udp-pacing: " << udp_pacing << std::endl;
+		std::cerr << "    udp-gso: " << udp_gso << std::endl;
 	}
 };
@@ -39,8 +39,16 @@ static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
 }
 
 H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
-	: Encoder(options), abortPoll_(false), abortOutput_(false)
+	: Encoder(options), abortPoll_(false), abortOutput_(false), force_key_frame_(false), frames_dropped_(0),
+	  frames_timed_out_(0)
 {
+	if (options->encoder_backpressure == "drop")
+		backpressure_ = Backpressure::Drop;
+	else if (options->encoder_backpressure == "drop-idr")
+		backpressure_ = Backpressure::DropIdr;
+	else
+		backpressure_ = Backpressure::Block;
+
 	// First open the encoder device. Maybe we should double-check its "caps".
 
 	const char device_name[] = "/dev/video11";
@@ -138,7 +146,7 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 	// m-mapped.
 
 	v4l2_requestbuffers reqbufs = {};
-	reqbufs.count = NUM_OUTPUT_BUFFERS;
+	reqbufs.count = options->encoder_output_buffers;
 	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 	reqbufs.memory = V4L2_MEMORY_DMABUF;
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
@@ -150,16 +158,17 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 	// us another frame to encode.
 	for (unsigned int i = 0; i < reqbufs.count; i++)
 		input_buffers_available_.push(i);
+	num_output_buffers_ = reqbufs.count;
 
 	reqbufs = {};
-	reqbufs.count = NUM_CAPTURE_BUFFERS;
+	reqbufs.count = options->encoder_capture_buffers;
 	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	reqbufs.memory = V4L2_MEMORY_MMAP;
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		throw std::runtime_error("request for capture buffers failed");
 	if (options->verbose)
 		std::cerr << "Got " << reqbufs.count << " capture buffers" << std::endl;
-	num_capture_buffers_ = reqbufs.count;
+	buffers_.resize(reqbufs.count);
 
 	for (unsigned int i = 0; i < reqbufs.count; i++)
 	{
@@ -222,8 +231,8 @@ H264Encoder::~H264Encoder()
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		std::cerr << "Request to free output buffers failed" << std::endl;
 
-	for (int i = 0; i < num_capture_buffers_; i++)
-		if (munmap(buffers_[i].mem, buffers_[i].size) < 0)
+	for (auto &buffer : buffers_)
+		if (munmap(buffer.mem, buffer.size) < 0)
 			std::cerr << "Failed to unmap buffer" << std::endl;
 	reqbufs = {};
 	reqbufs.count = 0;
@@ -233,21 +242,57 @@ H264Encoder::~H264Encoder()
 		std::cerr << "Request to free capture buffers failed" << std::endl;
 
 	close(fd_);
+	if (frames_dropped_)
+		std::cerr << "H264Encoder dropped " << frames_dropped_ << " frames (" << frames_timed_out_
+				  << " after waiting for a buffer)" << std::endl;
 	if (options_->verbose)
 		std::cerr << "H264Encoder closed" << std::endl;
 }
 
+int H264Encoder::getInputBuffer()
+{
+	using namespace std::chrono_literals;
+	std::unique_lock<std::mutex> lock(input_buffers_available_mutex_);
+	if (input_buffers_available_.empty() && backpressure_ == Backpressure::Block)
+	{
+		if (!input_buffers_available_cond_var_.wait_for(lock, options_->encoder_timeout * 1ms,
+														 [this] { return !input_buffers_available_.empty(); }))
+			frames_timed_out_++;
+	}
+	if (input_buffers_available_.empty())
+	{
+		if (options_->verbose)
+			std::cerr << "H264Encoder: no buffers available to queue codec input, dropping frame" << std::endl;
+		frames_dropped_++;
+		// A dropped frame leaves a hole in the reference chain, so get the
+		// encoder to start again from a clean IDR frame.
+		if (backpressure_ == Backpressure::DropIdr)
+			force_key_frame_ = true;
+		return -1;
+	}
+	int index = input_buffers_available_.front();
+	input_buffers_available_.pop();
+	return index;
+}
+
 void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
-	int index;
+	// We need to find an available output buffer (input to the codec) to
+	// "wrap" the DMABUF. If there isn't one, hand the frame straight back.
+	int index = getInputBuffer();
+	if (index < 0)
+	{
+		input_done_callback_(mem);
+		return;
+	}
+	if (force_key_frame_)
 	{
-		// We need to find an available output buffer (input to the codec) to
-		// "wrap" the DMABUF.
-		std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
-		if (input_buffers_available_.empty())
-			throw std::runtime_error("no buffers available to queue codec input");
-		index = input_buffers_available_.front();
-		input_buffers_available_.pop();
+		v4l2_control ctrl = {};
+		ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+		ctrl.value = 1;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			std::cerr << "H264Encoder: failed to force key frame" << std::endl;
+		force_key_frame_ = false;
 	}
 	v4l2_buffer buf = {};
 	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
@@ -274,7 +319,7 @@ void H264Encoder::pollThread()
 		int ret = poll(&p, 1, 200);
 		{
 			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
-			if (abortPoll_ && input_buffers_available_.size() == NUM_OUTPUT_BUFFERS)
+			if (abortPoll_ && input_buffers_available_.size() == num_output_buffers_)
 				break;
 		}
 		if (ret == -1)
@@ -299,6 +344,7 @@ void H264Encoder::pollThread()
 				{
 					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
 					input_buffers_available_.push(buf.index);
+					input_buffers_available_cond_var_.notify_one();
 				}
 				input_done_callback_(nullptr);
 			}
@@ -11,6 +11,7 @@
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 #include "encoder.hpp"
 
@@ -23,12 +24,17 @@ public:
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
 
 private:
-	// We want at least as many output buffers as there are in the camera queue
-	// (we always want to be able to queue them when they arrive). Make loads
-	// of capture buffers, as this is our buffering mechanism in case of delays
-	// dealing with the output bitstream.
-	static constexpr int NUM_OUTPUT_BUFFERS = 6;
-	static constexpr int NUM_CAPTURE_BUFFERS = 12;
+	// What to do when a frame arrives and all the codec input buffers are in use.
+	enum class Backpressure
+	{
+		Block, // wait (up to a timeout) for a buffer, dropping the frame if none comes
+		Drop, // drop the frame straight away
+		DropIdr // drop the frame, and force an IDR frame next so that the stream resyncs
+	};
+
+	// Wait for a free codec input buffer according to the backpressure policy,
+	// returning -1 if the frame must be dropped.
+	int getInputBuffer();
 
 	// This thread just sits waiting for the encoder to finish stuff. It will either:
 	// * receive "output" buffers (codec inputs), which we must return to the caller
@@ -43,16 +49,25 @@ private:
 	bool abortPoll_;
 	bool abortOutput_;
 	int fd_;
+	Backpressure backpressure_;
+	// We want at least as many output buffers as there are in the camera queue
+	// (we always want to be able to queue them when they arrive). Make loads
+	// of capture buffers, as this is our buffering mechanism in case of delays
+	// dealing with the output bitstream.
+	unsigned int num_output_buffers_;
 	struct BufferDescription
 	{
 		void *mem;
 		size_t size;
 	};
-	BufferDescription buffers_[NUM_CAPTURE_BUFFERS];
-	int num_capture_buffers_;
+	std::vector<BufferDescription> buffers_;
 	std::thread poll_thread_;
 	std::mutex input_buffers_available_mutex_;
+	std::condition_variable input_buffers_available_cond_var_;
 	std::queue<int> input_buffers_available_;
+	bool force_key_frame_;
+	unsigned int frames_dropped_;
+	unsigned int frames_timed_out_;
 	struct OutputItem
 	{
 		void *mem;
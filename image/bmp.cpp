@@ -13,6 +13,8 @@
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "image.hpp"
+
 struct ImageHeader
 {
 	uint32_t size = sizeof(ImageHeader);
@@ -80,6 +82,7 @@ void bmp_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		if (options->verbose)
 			std::cerr << "Wrote " << file_header.filesize << " bytes to BMP file" << std::endl;
 
+		sync_file(fp, options);
 		if (fp != stdout)
 			fclose(fp);
 	}
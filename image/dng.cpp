@@ -15,6 +15,8 @@
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "image.hpp"
+
 using namespace libcamera;
 
 static char TIFF_RGGB[4] = { 0, 1, 1, 2 };
@@ -317,6 +319,9 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		TIFFSetField(tif, TIFFTAG_EXIFIFD, offset_exififd);
 		TIFFWriteDirectory(tif);
 
+		if (TIFFFlush(tif) != 1)
+			throw std::runtime_error("failed to flush DNG file");
+		sync_file(TIFFFileno(tif), options);
 		TIFFClose(tif);
 	}
 	catch (std::exception const &e)
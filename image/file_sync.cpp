@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * file_sync.cpp - write back and release image files once they are written
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "core/options.hpp"
+#include "image.hpp"
+
+void sync_file(int fd, Options const *options)
+{
+	if (options->fsync && fsync(fd) < 0)
+		std::cerr << "failed to sync output file" << std::endl;
+	// Pages can only be dropped from the page cache once they are clean, so we
+	// must wait for them to be written back (if fsync hasn't done that already).
+	if (options->fadvise)
+	{
+		unsigned int flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+		if (!options->fsync && sync_file_range(fd, 0, 0, flags) < 0)
+			std::cerr << "failed to write back output file" << std::endl;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+}
+
+void sync_file(FILE *fp, Options const *options)
+{
+	if (fp == stdout || !(options->fsync || options->fadvise))
+		return;
+	if (fflush(fp))
+		throw std::runtime_error("failed to flush output file");
+	sync_file(fileno(fp), options);
+}
@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <cstdio>
 #include <string>
 
 #include <libcamera/base/span.h>
@@ -15,6 +16,7 @@
 
 #include "core/stream_info.hpp"
 
+struct Options;
 struct StillOptions;
 
 // In jpeg.cpp:
@@ -43,3 +45,7 @@ void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 // In bmp.cpp:
 void bmp_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			  std::string const &filename, StillOptions const *options);
+
+// In file_sync.cpp (this does nothing unless the fsync or fadvise options are set):
+void sync_file(int fd, Options const *options);
+void sync_file(FILE *fp, Options const *options);
@@ -0,0 +1,296 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * image_kernels.cpp - basic image operations shared by the image writers, previews and
+ * post-processing stages.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "image_kernels.hpp"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// With 6 fractional bits every product fits in 16 bits, so SIMD code can use 16-bit lanes.
+// Only the sum for the brightest blues can overflow, and saturating there gives the same 255.
+const YuvToRgbMatrix YUV_TO_RGB_JPEG = { 0, 64, 90, 22, 46, 113 };
+const YuvToRgbMatrix YUV_TO_RGB_SMPTE170M = { 16, 74, 102, 25, 52, 129 };
+const YuvToRgbMatrix YUV_TO_RGB_REC709 = { 16, 74, 115, 14, 34, 135 };
+
+void copy_plane(uint8_t const *src, unsigned int src_stride, uint8_t *dst, unsigned int dst_stride,
+				unsigned int width, unsigned int height)
+{
+	if (src_stride == width && dst_stride == width)
+	{
+		memcpy(dst, src, width * height);
+		return;
+	}
+	for (unsigned int y = 0; y < height; y++)
+		memcpy(dst + y * dst_stride, src + y * src_stride, width);
+}
+
+void resize_plane_nearest(uint8_t const *src, unsigned int src_stride, unsigned int src_w, unsigned int src_h,
+						  uint8_t *dst, unsigned int dst_stride, unsigned int w, unsigned int h)
+{
+	// Each output pixel takes the source pixel under its centre.
+	std::vector<unsigned int> xs(w);
+	for (unsigned int x = 0; x < w; x++)
+		xs[x] = ((2 * x + 1) * src_w) / (2 * w);
+
+	for (unsigned int y = 0; y < h; y++)
+	{
+		uint8_t const *row = src + (((2 * y + 1) * src_h) / (2 * h)) * src_stride;
+		uint8_t *out = dst + y * dst_stride;
+		for (unsigned int x = 0; x < w; x++)
+			out[x] = row[xs[x]];
+	}
+}
+
+void resize_plane_bilinear(uint8_t const *src, unsigned int src_stride, unsigned int src_w, unsigned int src_h,
+						   double x0, double y0, double region_w, double region_h, uint8_t *dst,
+						   unsigned int dst_stride, unsigned int w, unsigned int h)
+{
+	// Interpolation weights have 8 fractional bits.
+	std::vector<unsigned int> xs(w), fxs(w);
+	for (unsigned int x = 0; x < w; x++)
+	{
+		double sx = std::clamp(x0 + (x + 0.5) * region_w / w - 0.5, 0.0, src_w - 1.0);
+		xs[x] = std::min<unsigned int>(sx, std::max(src_w, 2u) - 2);
+		fxs[x] = std::lround((sx - xs[x]) * 256);
+	}
+	for (unsigned int y = 0; y < h; y++)
+	{
+		double sy = std::clamp(y0 + (y + 0.5) * region_h / h - 0.5, 0.0, src_h - 1.0);
+		unsigned int iy = std::min<unsigned int>(sy, std::max(src_h, 2u) - 2), fy = std::lround((sy - iy) * 256);
+		uint8_t const *row0 = src + iy * src_stride, *row1 = row0 + src_stride;
+		uint8_t *out = dst + y * dst_stride;
+		for (unsigned int x = 0; x < w; x++)
+		{
+			unsigned int i = xs[x], fx = fxs[x];
+			unsigned int top = row0[i] * (256 - fx) + row0[i + 1] * fx;
+			unsigned int bottom = row1[i] * (256 - fx) + row1[i + 1] * fx;
+			out[x] = (top * (256 - fy) + bottom * fy + 32768) >> 16;
+		}
+	}
+}
+
+// Add a row of pixels into 16-bit sums.
+
+static void accumulate_row(uint16_t *sums, uint8_t const *row, unsigned int n)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 16 <= n; x += 16)
+	{
+		uint8x16_t pixels = vld1q_u8(row + x);
+		vst1q_u16(sums + x, vaddw_u8(vld1q_u16(sums + x), vget_low_u8(pixels)));
+		vst1q_u16(sums + x + 8, vaddw_u8(vld1q_u16(sums + x + 8), vget_high_u8(pixels)));
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	for (; x + 16 <= n; x += 16)
+	{
+		__m128i pixels = _mm_loadu_si128((__m128i const *)(row + x));
+		__m128i *s = (__m128i *)(sums + x);
+		_mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s), _mm_unpacklo_epi8(pixels, zero)));
+		_mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1), _mm_unpackhi_epi8(pixels, zero)));
+	}
+#endif
+	for (; x < n; x++)
+		sums[x] += row[x];
+}
+
+void resize_plane_box(uint8_t const *src, unsigned int src_stride, unsigned int src_w, unsigned int src_h,
+					  uint8_t *dst, unsigned int dst_stride, unsigned int w, unsigned int h)
+{
+	std::vector<unsigned int> x0(w + 1);
+	for (unsigned int x = 0; x <= w; x++)
+		x0[x] = x * src_w / w;
+	std::vector<uint16_t> column_sums(src_w);
+	std::vector<uint32_t> sums(w);
+
+	// Most of the work is adding up the rows under each output row, which goes in order through
+	// the source (so reads it only once) and vectorises easily. 16-bit sums hold 257 rows.
+	for (unsigned int y = 0; y < h; y++)
+	{
+		unsigned int y0 = y * src_h / h, y1 = (y + 1) * src_h / h;
+		std::fill(sums.begin(), sums.end(), 0);
+		for (unsigned int sy = y0; sy < y1;)
+		{
+			std::fill(column_sums.begin(), column_sums.end(), 0);
+			for (unsigned int end = std::min(sy + 257, y1); sy < end; sy++)
+				accumulate_row(column_sums.data(), src + sy * src_stride, src_w);
+			for (unsigned int x = 0; x < w; x++)
+			{
+				for (unsigned int sx = x0[x]; sx < x0[x + 1]; sx++)
+					sums[x] += column_sums[sx];
+			}
+		}
+		uint8_t *out = dst + y * dst_stride;
+		for (unsigned int x = 0; x < w; x++)
+		{
+			unsigned int count = (y1 - y0) * (x0[x + 1] - x0[x]);
+			out[x] = (sums[x] + count / 2) / count;
+		}
+	}
+}
+
+// Convert a row to three bytes per pixel, with red at offset red and blue at offset 2 - red.
+
+static void yuv420_to_interleaved_row(uint8_t const *Y, uint8_t const *U, uint8_t const *V, uint8_t *dst,
+									  unsigned int width, YuvToRgbMatrix const &m, unsigned int red)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	int16x8_t y_offset = vdupq_n_s16(m.y_offset);
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16_t y = vld1q_u8(Y + x);
+		int16x8_t u = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(U + x / 2), vdup_n_u8(128)));
+		int16x8_t v = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(V + x / 2), vdup_n_u8(128)));
+		// Work out the chroma contributions and then give one to each pair of pixels.
+		int16x8_t r_uv = vmulq_n_s16(v, m.rv);
+		int16x8_t g_uv = vmlaq_n_s16(vmulq_n_s16(u, m.gu), v, m.gv);
+		int16x8_t b_uv = vmulq_n_s16(u, m.bu);
+		int16x8x2_t r = vzipq_s16(r_uv, r_uv), g = vzipq_s16(g_uv, g_uv), b = vzipq_s16(b_uv, b_uv);
+		int16x8_t y_lo = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y))), y_offset), m.y_scale);
+		int16x8_t y_hi = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y))), y_offset), m.y_scale);
+		uint8x16x3_t rgb;
+		rgb.val[red] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(y_lo, r.val[0]), 6),
+								   vqrshrun_n_s16(vqaddq_s16(y_hi, r.val[1]), 6));
+		rgb.val[1] = vcombine_u8(vqrshrun_n_s16(vqsubq_s16(y_lo, g.val[0]), 6),
+								 vqrshrun_n_s16(vqsubq_s16(y_hi, g.val[1]), 6));
+		rgb.val[2 - red] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(y_lo, b.val[0]), 6),
+									   vqrshrun_n_s16(vqaddq_s16(y_hi, b.val[1]), 6));
+		vst3q_u8(dst + 3 * x, rgb);
+	}
+#elif defined(__SSE2__)
+	// There's no interleaving store, so the last step goes through a small buffer.
+	alignas(16) uint8_t planes[3][16];
+	__m128i zero = _mm_setzero_si128(), offset = _mm_set1_epi16(128), round = _mm_set1_epi16(32);
+	__m128i y_offset = _mm_set1_epi16(m.y_offset), y_scale = _mm_set1_epi16(m.y_scale);
+	__m128i rv = _mm_set1_epi16(m.rv), gu = _mm_set1_epi16(m.gu), gv = _mm_set1_epi16(m.gv),
+			bu = _mm_set1_epi16(m.bu);
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i y = _mm_loadu_si128((__m128i const *)(Y + x));
+		__m128i u = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *)(U + x / 2)), zero), offset);
+		__m128i v = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *)(V + x / 2)), zero), offset);
+		__m128i r = _mm_mullo_epi16(v, rv);
+		__m128i g = _mm_add_epi16(_mm_mullo_epi16(u, gu), _mm_mullo_epi16(v, gv));
+		__m128i b = _mm_mullo_epi16(u, bu);
+		__m128i y_lo = _mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(y, zero), y_offset), y_scale);
+		__m128i y_hi = _mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(y, zero), y_offset), y_scale);
+		y_lo = _mm_adds_epi16(y_lo, round);
+		y_hi = _mm_adds_epi16(y_hi, round);
+		_mm_store_si128((__m128i *)planes[red],
+						_mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(y_lo, _mm_unpacklo_epi16(r, r)), 6),
+										 _mm_srai_epi16(_mm_adds_epi16(y_hi, _mm_unpackhi_epi16(r, r)), 6)));
+		_mm_store_si128((__m128i *)planes[1],
+						_mm_packus_epi16(_mm_srai_epi16(_mm_subs_epi16(y_lo, _mm_unpacklo_epi16(g, g)), 6),
+										 _mm_srai_epi16(_mm_subs_epi16(y_hi, _mm_unpackhi_epi16(g, g)), 6)));
+		_mm_store_si128((__m128i *)planes[2 - red],
+						_mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(y_lo, _mm_unpacklo_epi16(b, b)), 6),
+										 _mm_srai_epi16(_mm_adds_epi16(y_hi, _mm_unpackhi_epi16(b, b)), 6)));
+		uint8_t *d = dst + 3 * x;
+		for (unsigned int i = 0; i < 16; i++, d += 3)
+			d[0] = planes[0][i], d[1] = planes[1][i], d[2] = planes[2][i];
+	}
+#endif
+	for (; x < width; x++)
+	{
+		int y = (Y[x] - m.y_offset) * m.y_scale + 32, u = U[x / 2] - 128, v = V[x / 2] - 128;
+		dst[3 * x + red] = std::clamp((y + m.rv * v) >> 6, 0, 255);
+		dst[3 * x + 1] = std::clamp((y - m.gu * u - m.gv * v) >> 6, 0, 255);
+		dst[3 * x + 2 - red] = std::clamp((y + m.bu * u) >> 6, 0, 255);
+	}
+}
+
+void yuv420_to_rgb_row(uint8_t const *Y, uint8_t const *U, uint8_t const *V, uint8_t *dst, unsigned int width,
+					   YuvToRgbMatrix const &matrix)
+{
+	yuv420_to_interleaved_row(Y, U, V, dst, width, matrix, 0);
+}
+
+void yuv420_to_bgr_row(uint8_t const *Y, uint8_t const *U, uint8_t const *V, uint8_t *dst, unsigned int width,
+					   YuvToRgbMatrix const &matrix)
+{
+	yuv420_to_interleaved_row(Y, U, V, dst, width, matrix, 2);
+}
+
+// Take a row of YUYV apart. Every row gives Y values, and the U and V rows have half as many.
+
+void yuyv_to_y_row(uint8_t const *src, uint8_t *Y, unsigned int width)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 16 <= width; x += 16)
+		vst1q_u8(Y + x, vld2q_u8(src + 2 * x).val[0]);
+#elif defined(__SSE2__)
+	__m128i mask = _mm_set1_epi16(0xff);
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i lo = _mm_and_si128(_mm_loadu_si128((__m128i const *)(src + 2 * x)), mask);
+		__m128i hi = _mm_and_si128(_mm_loadu_si128((__m128i const *)(src + 2 * x + 16)), mask);
+		_mm_storeu_si128((__m128i *)(Y + x), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; x < width; x++)
+		Y[x] = src[2 * x];
+}
+
+void yuyv_to_uv_row(uint8_t const *src, uint8_t *U, uint8_t *V, unsigned int width)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 32 <= width; x += 32)
+	{
+		uint8x16x4_t yuyv = vld4q_u8(src + 2 * x);
+		vst1q_u8(U + x / 2, yuyv.val[1]);
+		vst1q_u8(V + x / 2, yuyv.val[3]);
+	}
+#elif defined(__SSE2__)
+	__m128i mask = _mm_set1_epi16(0xff);
+	for (; x + 32 <= width; x += 32)
+	{
+		// First gather the UV pairs, then split those.
+		__m128i uv[2];
+		for (int i = 0; i < 2; i++)
+		{
+			__m128i lo = _mm_srli_epi16(_mm_loadu_si128((__m128i const *)(src + 2 * x + 32 * i)), 8);
+			__m128i hi = _mm_srli_epi16(_mm_loadu_si128((__m128i const *)(src + 2 * x + 32 * i + 16)), 8);
+			uv[i] = _mm_packus_epi16(lo, hi);
+		}
+		_mm_storeu_si128((__m128i *)(U + x / 2),
+						 _mm_packus_epi16(_mm_and_si128(uv[0], mask), _mm_and_si128(uv[1], mask)));
+		_mm_storeu_si128((__m128i *)(V + x / 2), _mm_packus_epi16(_mm_srli_epi16(uv[0], 8), _mm_srli_epi16(uv[1], 8)));
+	}
+#endif
+	for (; x + 2 <= width; x += 2)
+	{
+		U[x / 2] = src[2 * x + 1];
+		V[x / 2] = src[2 * x + 3];
+	}
+}
+
+void yuyv_to_yuv420(uint8_t const *src, unsigned int src_stride, unsigned int width, unsigned int height,
+					uint8_t *dst, unsigned int dst_stride)
+{
+	uint8_t *U = dst + dst_stride * height;
+	uint8_t *V = U + (dst_stride / 2) * (height / 2);
+	for (unsigned int y = 0; y < height; y++)
+	{
+		yuyv_to_y_row(src + y * src_stride, dst + y * dst_stride, width);
+		if (!(y & 1) && y / 2 < height / 2)
+			yuyv_to_uv_row(src + y * src_stride, U + (y / 2) * (dst_stride / 2), V + (y / 2) * (dst_stride / 2),
+						   width);
+	}
+}
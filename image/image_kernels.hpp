@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * image_kernels.hpp - basic image operations shared by the image writers, previews and
+ * post-processing stages.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// These work on 8-bit planes given by a pointer, stride and size. A YUV420 image is a Y plane
+// followed by U and V planes of half the width, height and stride, as everywhere else here.
+// The functions that touch every pixel in order have NEON or SSE2 versions, chosen when we're
+// compiled; the ones that have to gather pixels from all over are plain C++.
+
+// Copy a plane, width bytes per row.
+void copy_plane(uint8_t const *src, unsigned int src_stride, uint8_t *dst, unsigned int dst_stride,
+				unsigned int width, unsigned int height);
+
+// Resize a whole plane to w x h by picking the nearest pixel.
+void resize_plane_nearest(uint8_t const *src, unsigned int src_stride, unsigned int src_w, unsigned int src_h,
+						  uint8_t *dst, unsigned int dst_stride, unsigned int w, unsigned int h);
+
+// Resample a region of a plane to w x h, bilinearly. The region is given in fractional source
+// pixels, and may be larger or smaller than the output.
+void resize_plane_bilinear(uint8_t const *src, unsigned int src_stride, unsigned int src_w, unsigned int src_h,
+						   double x0, double y0, double region_w, double region_h, uint8_t *dst,
+						   unsigned int dst_stride, unsigned int w, unsigned int h);
+
+// Shrink a whole plane to w x h (no bigger than it is now), averaging the box of pixels that
+// each output pixel covers.
+void resize_plane_box(uint8_t const *src, unsigned int src_stride, unsigned int src_w, unsigned int src_h,
+					  uint8_t *dst, unsigned int dst_stride, unsigned int w, unsigned int h);
+
+// Fixed point YUV to RGB conversion, with 6 fractional bits:
+// R = y_scale * (Y - y_offset) + rv * (V - 128)
+// G = y_scale * (Y - y_offset) - gu * (U - 128) - gv * (V - 128)
+// B = y_scale * (Y - y_offset) + bu * (U - 128)
+struct YuvToRgbMatrix
+{
+	int y_offset;
+	int y_scale;
+	int rv, gu, gv, bu;
+};
+
+extern const YuvToRgbMatrix YUV_TO_RGB_JPEG; // full range BT.601
+extern const YuvToRgbMatrix YUV_TO_RGB_SMPTE170M; // limited range BT.601
+extern const YuvToRgbMatrix YUV_TO_RGB_REC709; // limited range BT.709
+
+// Convert a row of YUV420 to interleaved RGB888. The U and V rows have half as many pixels.
+void yuv420_to_rgb_row(uint8_t const *Y, uint8_t const *U, uint8_t const *V, uint8_t *dst, unsigned int width,
+					   YuvToRgbMatrix const &matrix);
+
+// The same, but with the bytes of each pixel in B, G, R order, as OpenCV likes.
+void yuv420_to_bgr_row(uint8_t const *Y, uint8_t const *U, uint8_t const *V, uint8_t *dst, unsigned int width,
+					   YuvToRgbMatrix const &matrix);
+
+// Take a row of YUYV apart, into its Y values or its U and V values, which have half as many.
+void yuyv_to_y_row(uint8_t const *src, uint8_t *Y, unsigned int width);
+void yuyv_to_uv_row(uint8_t const *src, uint8_t *U, uint8_t *V, unsigned int width);
+
+// Convert a YUYV image to YUV420, taking the chroma from the even rows.
+void yuyv_to_yuv420(uint8_t const *src, unsigned int src_stride, unsigned int width, unsigned int height,
+					uint8_t *dst, unsigned int dst_stride);
@@ -0,0 +1,376 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * image_kernels_test.cpp - check the image kernels against plain versions of the same
+ * arithmetic, and against the floating point conversions they replaced. With --bench, also
+ * time each of them on a 1920x1080 image.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "image_kernels.hpp"
+
+static unsigned int failures = 0;
+
+static void check(bool ok, std::string const &what)
+{
+	if (!ok)
+	{
+		std::cerr << "FAIL: " << what << std::endl;
+		failures++;
+	}
+}
+
+// A fixed seed, so every run sees the same "random" pictures.
+static std::mt19937 rng(2021);
+
+static std::vector<uint8_t> random_bytes(unsigned int n)
+{
+	std::vector<uint8_t> v(n);
+	for (auto &b : v)
+		b = rng() & 0xff;
+	return v;
+}
+
+static std::string size_str(unsigned int w, unsigned int h)
+{
+	return std::to_string(w) + "x" + std::to_string(h);
+}
+
+// Widths either side of the 16 and 32 pixel SIMD blocks, so that both the vector code and the
+// scalar tails get used.
+static const unsigned int widths[] = { 1, 2, 7, 15, 16, 17, 31, 32, 33, 34, 63, 64, 66, 100, 641, 1920 };
+
+static void test_copy_plane()
+{
+	for (unsigned int w : widths)
+	{
+		for (unsigned int pad : { 0u, 13u })
+		{
+			unsigned int h = 5, src_stride = w + pad, dst_stride = w + 2 * pad;
+			std::vector<uint8_t> src = random_bytes(src_stride * h), dst(dst_stride * h, 0);
+			copy_plane(src.data(), src_stride, dst.data(), dst_stride, w, h);
+			bool ok = true;
+			for (unsigned int y = 0; y < h; y++)
+				ok &= !memcmp(&src[y * src_stride], &dst[y * dst_stride], w);
+			check(ok, "copy_plane " + size_str(w, h) + " pad " + std::to_string(pad));
+		}
+	}
+}
+
+static void test_resize_nearest()
+{
+	static const unsigned int sizes[][4] = {
+		{ 64, 48, 64, 48 },		{ 64, 48, 32, 24 },		  { 100, 75, 33, 17 }, { 33, 17, 100, 75 },
+		{ 1920, 1080, 640, 480 }, { 2028, 1520, 320, 240 }, { 17, 3, 16, 1 },
+	};
+	for (auto const &s : sizes)
+	{
+		unsigned int src_w = s[0], src_h = s[1], w = s[2], h = s[3], src_stride = src_w + 3, dst_stride = w + 5;
+		std::vector<uint8_t> src = random_bytes(src_stride * src_h), dst(dst_stride * h);
+		resize_plane_nearest(src.data(), src_stride, src_w, src_h, dst.data(), dst_stride, w, h);
+		bool ok = true;
+		for (unsigned int y = 0; y < h; y++)
+		{
+			unsigned int sy = std::floor((y + 0.5) * src_h / h);
+			for (unsigned int x = 0; x < w; x++)
+				ok &= dst[y * dst_stride + x] == src[sy * src_stride + (unsigned int)std::floor((x + 0.5) * src_w / w)];
+		}
+		check(ok, "resize_plane_nearest " + size_str(src_w, src_h) + " to " + size_str(w, h));
+	}
+
+	// The JPEG encoder used to take the pixel at the left/top edge of each output pixel, where
+	// we now take the one under its centre. Say how much that moves things.
+	for (auto const &s : sizes)
+	{
+		unsigned int src_w = s[0], src_h = s[1], w = s[2], h = s[3], moved = 0, most = 0;
+		for (unsigned int x = 0; x < w; x++)
+		{
+			unsigned int old_x = x * src_w / w, new_x = ((2 * x + 1) * src_w) / (2 * w);
+			moved += old_x != new_x;
+			most = std::max(most, new_x - old_x);
+		}
+		for (unsigned int y = 0; y < h; y++)
+		{
+			unsigned int old_y = y * src_h / h, new_y = ((2 * y + 1) * src_h) / (2 * h);
+			moved += old_y != new_y;
+			most = std::max(most, new_y - old_y);
+		}
+		std::cout << "nearest " << size_str(src_w, src_h) << " to " << size_str(w, h) << ": " << moved << " of "
+				  << w + h << " rows and columns sample differently from before, by at most " << most
+				  << " pixels" << std::endl;
+	}
+}
+
+static void test_resize_bilinear()
+{
+	// src_w, src_h, x0, y0, region_w, region_h, w, h
+	static const double cases[][8] = {
+		{ 64, 48, 0, 0, 64, 48, 64, 48 },
+		{ 64, 48, 0, 0, 64, 48, 32, 24 },
+		{ 64, 48, 0, 0, 64, 48, 100, 75 },
+		{ 640, 480, 10.5, 7.25, 300, 200, 224, 224 },
+		{ 640, 480, 600, 400, 40, 80, 33, 65 },
+		{ 1920, 1080, 0, 0, 1920, 1080, 640, 480 },
+		{ 2, 2, 0, 0, 2, 2, 17, 9 },
+	};
+	for (auto const &c : cases)
+	{
+		unsigned int src_w = c[0], src_h = c[1], w = c[6], h = c[7], src_stride = src_w + 3, dst_stride = w + 5;
+		std::vector<uint8_t> src = random_bytes(src_stride * src_h), dst(dst_stride * h);
+		resize_plane_bilinear(src.data(), src_stride, src_w, src_h, c[2], c[3], c[4], c[5], dst.data(), dst_stride,
+							  w, h);
+		// The kernel has 8-bit weights, so allow it to be one out from a floating point version.
+		int worst = 0;
+		for (unsigned int y = 0; y < h; y++)
+		{
+			double sy = std::clamp(c[3] + (y + 0.5) * c[5] / h - 0.5, 0.0, src_h - 1.0);
+			unsigned int y0 = std::min<unsigned int>(sy, src_h - 2);
+			for (unsigned int x = 0; x < w; x++)
+			{
+				double sx = std::clamp(c[2] + (x + 0.5) * c[4] / w - 0.5, 0.0, src_w - 1.0);
+				unsigned int x0 = std::min<unsigned int>(sx, src_w - 2);
+				double fx = sx - x0, fy = sy - y0;
+				uint8_t const *p = &src[y0 * src_stride + x0];
+				double top = p[0] * (1 - fx) + p[1] * fx;
+				double bottom = p[src_stride] * (1 - fx) + p[src_stride + 1] * fx;
+				int expected = std::lround(top * (1 - fy) + bottom * fy);
+				worst = std::max(worst, std::abs(dst[y * dst_stride + x] - expected));
+			}
+		}
+		check(worst <= 1, "resize_plane_bilinear " + size_str(src_w, src_h) + " to " + size_str(w, h) +
+							  " is out by " + std::to_string(worst));
+	}
+}
+
+static void test_resize_box()
+{
+	// Include shrinks of more than 257 rows, where the 16-bit column sums get flushed part way.
+	static const unsigned int sizes[][4] = {
+		{ 64, 48, 64, 48 },		{ 64, 48, 32, 24 }, { 100, 75, 33, 17 },
+		{ 1920, 1080, 640, 360 }, { 641, 600, 17, 1 }, { 33, 1000, 1, 3 },
+	};
+	for (auto const &s : sizes)
+	{
+		unsigned int src_w = s[0], src_h = s[1], w = s[2], h = s[3], src_stride = src_w + 3, dst_stride = w + 5;
+		std::vector<uint8_t> src = random_bytes(src_stride * src_h), dst(dst_stride * h);
+		resize_plane_box(src.data(), src_stride, src_w, src_h, dst.data(), dst_stride, w, h);
+		bool ok = true;
+		for (unsigned int y = 0; y < h; y++)
+		{
+			for (unsigned int x = 0; x < w; x++)
+			{
+				unsigned int sum = 0, count = 0;
+				for (unsigned int sy = y * src_h / h; sy < (y + 1) * src_h / h; sy++)
+				{
+					for (unsigned int sx = x * src_w / w; sx < (x + 1) * src_w / w; sx++, count++)
+						sum += src[sy * src_stride + sx];
+				}
+				ok &= dst[y * dst_stride + x] == (sum + count / 2) / count;
+			}
+		}
+		check(ok, "resize_plane_box " + size_str(src_w, src_h) + " to " + size_str(w, h));
+	}
+}
+
+// The fixed point arithmetic the conversions are meant to do, one pixel at a time.
+
+static void yuv_to_rgb_pixel(int Y, int U, int V, YuvToRgbMatrix const &m, uint8_t *rgb)
+{
+	int y = (Y - m.y_offset) * m.y_scale + 32, u = U - 128, v = V - 128;
+	rgb[0] = std::clamp((y + m.rv * v) >> 6, 0, 255);
+	rgb[1] = std::clamp((y - m.gu * u - m.gv * v) >> 6, 0, 255);
+	rgb[2] = std::clamp((y + m.bu * u) >> 6, 0, 255);
+}
+
+struct Matrix
+{
+	char const *name;
+	YuvToRgbMatrix const &fixed;
+	// The floating point matrix the Qt preview used, as rows of Y, U and V coefficients for R, G
+	// and B. The preview didn't take 16 off limited range Y values; we do, in both versions.
+	double m[9];
+};
+
+static const Matrix matrices[] = {
+	{ "JPEG", YUV_TO_RGB_JPEG, { 1.0, 0.0, 1.402, 1.0, -0.344, -0.714, 1.0, 1.772, 0.0 } },
+	{ "SMPTE170M", YUV_TO_RGB_SMPTE170M, { 1.164, 0.0, 1.596, 1.164, -0.392, -0.813, 1.164, 2.017, 0.0 } },
+	{ "Rec709", YUV_TO_RGB_REC709, { 1.164, 0.0, 1.793, 1.164, -0.213, -0.533, 1.164, 2.112, 0.0 } },
+};
+
+static void test_yuv420_to_rgb()
+{
+	for (auto const &matrix : matrices)
+	{
+		for (bool bgr : { false, true })
+		{
+			auto convert = bgr ? yuv420_to_bgr_row : yuv420_to_rgb_row;
+			std::string name = std::string(bgr ? "yuv420_to_bgr_row " : "yuv420_to_rgb_row ") + matrix.name;
+			unsigned int r = bgr ? 2 : 0;
+
+			// Every combination of Y, U and V: a row with each Y value for every U, V pair.
+			std::vector<uint8_t> Y(256), U(128), V(128), out(3 * 256);
+			for (unsigned int i = 0; i < 256; i++)
+				Y[i] = i;
+			bool ok = true;
+			int worst = 0, worst_old = 0;
+			for (unsigned int u = 0; u < 256; u++)
+			{
+				for (unsigned int v = 0; v < 256; v++)
+				{
+					std::fill(U.begin(), U.end(), u);
+					std::fill(V.begin(), V.end(), v);
+					convert(Y.data(), U.data(), V.data(), out.data(), 256, matrix.fixed);
+					for (unsigned int i = 0; i < 256; i++)
+					{
+						uint8_t rgb[3];
+						yuv_to_rgb_pixel(i, u, v, matrix.fixed, rgb);
+						ok &= out[3 * i + r] == rgb[0] && out[3 * i + 1] == rgb[1] && out[3 * i + 2 - r] == rgb[2];
+
+						double yf = (double)i - matrix.fixed.y_offset, uf = u - 128.0, vf = v - 128.0;
+						for (unsigned int c = 0; c < 3; c++)
+						{
+							double f = matrix.m[3 * c] * yf + matrix.m[3 * c + 1] * uf + matrix.m[3 * c + 2] * vf;
+							int exact = std::clamp<long>(std::lround(f), 0, 255);
+							int old = std::clamp((int)f, 0, 255); // the old code truncated
+							worst = std::max(worst, std::abs(rgb[c] - exact));
+							worst_old = std::max(worst_old, std::abs(rgb[c] - old));
+						}
+					}
+				}
+			}
+			check(ok, name + " differs from the scalar arithmetic");
+			if (!bgr)
+			{
+				std::cout << "yuv420_to_rgb_row " << matrix.name << ": at most " << worst
+						  << " from the floating point matrix, " << worst_old << " from the old truncating code"
+						  << std::endl;
+				// This comes from the 6-bit coefficients. None get Rec709 closer than 3, on the brightest
+				// colours.
+				check(worst <= 3, name + " is " + std::to_string(worst) + " from the floating point matrix");
+			}
+
+			// Random rows, to cover the scalar tails and U and V varying along the row.
+			for (unsigned int w : widths)
+			{
+				std::vector<uint8_t> y = random_bytes(w), dst(3 * w);
+				std::vector<uint8_t> cu = random_bytes((w + 1) / 2), cv = random_bytes((w + 1) / 2);
+				convert(y.data(), cu.data(), cv.data(), dst.data(), w, matrix.fixed);
+				bool ok = true;
+				for (unsigned int x = 0; x < w; x++)
+				{
+					uint8_t rgb[3];
+					yuv_to_rgb_pixel(y[x], cu[x / 2], cv[x / 2], matrix.fixed, rgb);
+					ok &= dst[3 * x + r] == rgb[0] && dst[3 * x + 1] == rgb[1] && dst[3 * x + 2 - r] == rgb[2];
+				}
+				check(ok, name + " width " + std::to_string(w));
+			}
+		}
+	}
+}
+
+static void test_yuyv_to_yuv420()
+{
+	for (unsigned int w : widths)
+	{
+		if (w & 1)
+			continue;
+		for (unsigned int h : { 1u, 2u, 3u, 4u, 5u })
+		{
+			unsigned int src_stride = 2 * w + 6, dst_stride = w + 10;
+			std::vector<uint8_t> src = random_bytes(src_stride * h);
+			std::vector<uint8_t> dst(dst_stride * h + 2 * (dst_stride / 2) * (h / 2), 0);
+			yuyv_to_yuv420(src.data(), src_stride, w, h, dst.data(), dst_stride);
+			uint8_t const *U = &dst[dst_stride * h], *V = U + (dst_stride / 2) * (h / 2);
+			bool ok = true;
+			for (unsigned int y = 0; y < h; y++)
+			{
+				uint8_t const *row = &src[y * src_stride];
+				for (unsigned int x = 0; x < w; x++)
+					ok &= dst[y * dst_stride + x] == row[2 * x];
+				if (y & 1 || y / 2 >= h / 2)
+					continue;
+				for (unsigned int x = 0; x < w / 2; x++)
+					ok &= U[(y / 2) * (dst_stride / 2) + x] == row[4 * x + 1] &&
+						  V[(y / 2) * (dst_stride / 2) + x] == row[4 * x + 3];
+			}
+			check(ok, "yuyv_to_yuv420 " + size_str(w, h));
+		}
+	}
+}
+
+static void bench(char const *name, std::function<void()> fn)
+{
+	fn();
+	const unsigned int runs = 50;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (unsigned int i = 0; i < runs; i++)
+		fn();
+	std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - start;
+	std::cout << name << ": " << t.count() / runs << " ms" << std::endl;
+}
+
+static void run_benchmarks()
+{
+	const unsigned int w = 1920, h = 1080;
+	std::vector<uint8_t> yuv = random_bytes(w * h * 3 / 2), yuyv = random_bytes(w * h * 2);
+	std::vector<uint8_t> out(w * h * 3);
+	uint8_t const *Y = yuv.data(), *U = Y + w * h, *V = U + w * h / 4;
+
+	std::cout << "1920x1080, average of 50 runs:" << std::endl;
+	bench("copy_plane", [&]() { copy_plane(Y, w, out.data(), w, w, h); });
+	bench("resize_plane_nearest to 640x480",
+		  [&]() { resize_plane_nearest(Y, w, w, h, out.data(), 640, 640, 480); });
+	bench("resize_plane_bilinear to 640x480",
+		  [&]() { resize_plane_bilinear(Y, w, w, h, 0, 0, w, h, out.data(), 640, 640, 480); });
+	bench("resize_plane_box to 640x360", [&]() { resize_plane_box(Y, w, w, h, out.data(), 640, 640, 360); });
+	bench("yuv420_to_rgb_row", [&]() {
+		for (unsigned int y = 0; y < h; y++)
+			yuv420_to_rgb_row(Y + y * w, U + (y / 2) * (w / 2), V + (y / 2) * (w / 2), &out[y * 3 * w], w,
+							  YUV_TO_RGB_REC709);
+	});
+	bench("yuv420_to_bgr_row", [&]() {
+		for (unsigned int y = 0; y < h; y++)
+			yuv420_to_bgr_row(Y + y * w, U + (y / 2) * (w / 2), V + (y / 2) * (w / 2), &out[y * 3 * w], w,
+							  YUV_TO_RGB_REC709);
+	});
+	bench("yuyv_to_yuv420", [&]() { yuyv_to_yuv420(yuyv.data(), 2 * w, w, h, out.data(), w); });
+}
+
+int main(int argc, char *argv[])
+{
+#if defined(__ARM_NEON)
+	std::cout << "Testing the NEON kernels" << std::endl;
+#elif defined(__SSE2__)
+	std::cout << "Testing the SSE2 kernels" << std::endl;
+#else
+	std::cout << "Testing the plain C++ kernels" << std::endl;
+#endif
+
+	test_copy_plane();
+	test_resize_nearest();
+	test_resize_bilinear();
+	test_resize_box();
+	test_yuv420_to_rgb();
+	test_yuyv_to_yuv420();
+
+	if (argc > 1 && !strcmp(argv[1], "--bench"))
+		run_benchmarks();
+
+	if (failures)
+	{
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "All checks passed" << std::endl;
+	return 0;
+}
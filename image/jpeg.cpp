@@ -23,6 +23,9 @@
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "image.hpp"
+#include "image_kernels.hpp"
+
 #if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
 typedef size_t jpeg_mem_len_t;
 #else
@@ -250,63 +253,13 @@ void exif_read_tag(ExifData *exif, char const *str)
 	}
 }
 
-static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
-						 const unsigned int output_width, const unsigned int output_height,
-						 const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
-{
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-
-	cinfo.image_width = output_width;
-	cinfo.image_height = output_height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
-
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
-	jpeg_start_compress(&cinfo, TRUE);
-
-	const unsigned int output_width3 = 3 * output_width;
-	std::vector<uint8_t> tmp_row(output_width3);
-	JSAMPROW jrow[1];
-	jrow[0] = &tmp_row[0];
-
-	// Pre-calculate the horizontal offsets to speed up the main loop.
-	std::vector<unsigned int> h_offset(output_width3);
-	for (unsigned int i = 0, k = 0; i < output_width; i++)
-	{
-		unsigned int off = (i * info.width) / output_width * 2;
-		unsigned int off_align = off & ~3;
-		h_offset[k++] = off;
-		h_offset[k++] = off_align + 1;
-		h_offset[k++] = off_align + 3;
-	}
-	while (cinfo.next_scanline < output_height)
-	{
-		unsigned int offset = ((cinfo.next_scanline * info.height) / output_height) * info.stride;
-		for (unsigned int k = 0; k < output_width3; k += 3)
-		{
-			tmp_row[k] = input[offset + h_offset[k]];
-			tmp_row[k + 1] = input[offset + h_offset[k + 1]];
-			tmp_row[k + 2] = input[offset + h_offset[k + 2]];
-		}
-		jpeg_write_scanlines(&cinfo, jrow, 1);
-	}
-
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
-}
+// Encode a YUV420 image straight from its planes. The rows must have room for the encoder to
+// read on to a multiple of 16 (Y) or 8 (U and V) pixels.
 
-static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
-								const int quality, const unsigned int restart,
-								uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+static void YUV420_to_JPEG_raw(const uint8_t *Y, const uint8_t *U, const uint8_t *V, const unsigned int width,
+							   const unsigned int height, const unsigned int stride, const unsigned int stride2,
+							   const int quality, const unsigned int restart, uint8_t *&jpeg_buffer,
+							   jpeg_mem_len_t &jpeg_len)
 {
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
@@ -314,8 +267,8 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
 
-	cinfo.image_width = info.width;
-	cinfo.image_height = info.height;
+	cinfo.image_width = width;
+	cinfo.image_height = height;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
 	cinfo.restart_interval = restart;
@@ -328,24 +281,20 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
 	jpeg_start_compress(&cinfo, TRUE);
 
-	int stride2 = info.stride / 2;
-	uint8_t *Y = (uint8_t *)input;
-	uint8_t *U = (uint8_t *)Y + info.stride * info.height;
-	uint8_t *V = (uint8_t *)U + stride2 * (info.height / 2);
-	uint8_t *Y_max = U - info.stride;
-	uint8_t *U_max = V - stride2;
-	uint8_t *V_max = U_max + stride2 * (info.height / 2);
+	const uint8_t *Y_max = Y + (height - 1) * stride;
+	const uint8_t *U_max = U + ((height + 1) / 2 - 1) * stride2;
+	const uint8_t *V_max = V + ((height + 1) / 2 - 1) * stride2;
 
 	JSAMPROW y_rows[16];
 	JSAMPROW u_rows[8];
 	JSAMPROW v_rows[8];
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < info.height;)
+	for (const uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < height;)
 	{
-		for (int i = 0; i < 16; i++, Y_row += info.stride)
-			y_rows[i] = std::min(Y_row, Y_max);
+		for (int i = 0; i < 16; i++, Y_row += stride)
+			y_rows[i] = (JSAMPROW)std::min(Y_row, Y_max);
 		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
-			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
+			u_rows[i] = (JSAMPROW)std::min(U_row, U_max), v_rows[i] = (JSAMPROW)std::min(V_row, V_max);
 
 		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
 		jpeg_write_raw_data(&cinfo, rows, 16);
@@ -360,64 +309,45 @@ static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 						   const int quality, const unsigned int restart, uint8_t *&jpeg_buffer,
 						   jpeg_mem_len_t &jpeg_len)
 {
-	if (info.width == output_width && info.height == output_height)
-	{
-		YUV420_to_JPEG_fast(input, info, quality, restart, jpeg_buffer, jpeg_len);
-		return;
-	}
-
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-
-	cinfo.image_width = output_width;
-	cinfo.image_height = output_height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
-
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
-	jpeg_start_compress(&cinfo, TRUE);
-
-	const unsigned int output_width3 = 3 * output_width;
-	std::vector<uint8_t> tmp_row(output_width3);
-	JSAMPROW jrow[1];
-	jrow[0] = &tmp_row[0];
-
+	const unsigned int stride2 = info.stride / 2;
 	const uint8_t *Y = input;
 	const uint8_t *U = Y + info.stride * info.height;
-	const uint8_t *V = U + (info.stride / 2) * (info.height / 2);
+	const uint8_t *V = U + stride2 * (info.height / 2);
 
-	// Pre-calculate the horizontal offsets to speed up the main loop.
-	std::vector<unsigned int> h_offset(output_width3);
-	for (unsigned int i = 0, k = 0; i < output_width; i++)
-	{
-		unsigned int off = (i * info.width) / output_width;
-		h_offset[k++] = off;
-		h_offset[k++] = off / 2;
-		h_offset[k++] = off / 2;
-	}
-	while (cinfo.next_scanline < output_height)
+	if (info.width == output_width && info.height == output_height)
 	{
-		unsigned int offset = ((cinfo.next_scanline * info.height) / output_height) * info.stride;
-		unsigned int offset_uv = (((cinfo.next_scanline / 2) * info.height) / output_height) * (info.stride / 2);
-		for (unsigned int k = 0; k < output_width3; k += 3)
-		{
-			tmp_row[k] = Y[offset + h_offset[k]];
-			tmp_row[k + 1] = U[offset_uv + h_offset[k + 1]];
-			tmp_row[k + 2] = V[offset_uv + h_offset[k + 2]];
-		}
-		jpeg_write_scanlines(&cinfo, jrow, 1);
+		YUV420_to_JPEG_raw(Y, U, V, info.width, info.height, info.stride, stride2, quality, restart, jpeg_buffer,
+						   jpeg_len);
+		return;
 	}
 
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+	// Otherwise make a resized copy (nearest neighbour) with rows padded for the encoder.
+	const unsigned int out_stride = (output_width + 15) & ~15, out_stride2 = out_stride / 2;
+	const unsigned int out_width2 = (output_width + 1) / 2, out_height2 = (output_height + 1) / 2;
+	std::vector<uint8_t> output(out_stride * output_height + 2 * out_stride2 * out_height2);
+	uint8_t *out_Y = output.data();
+	uint8_t *out_U = out_Y + out_stride * output_height;
+	uint8_t *out_V = out_U + out_stride2 * out_height2;
+	resize_plane_nearest(Y, info.stride, info.width, info.height, out_Y, out_stride, output_width, output_height);
+	resize_plane_nearest(U, stride2, info.width / 2, info.height / 2, out_U, out_stride2, out_width2, out_height2);
+	resize_plane_nearest(V, stride2, info.width / 2, info.height / 2, out_V, out_stride2, out_width2, out_height2);
+
+	YUV420_to_JPEG_raw(out_Y, out_U, out_V, output_width, output_height, out_stride, out_stride2, quality, restart,
+					   jpeg_buffer, jpeg_len);
+}
+
+static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
+						 const unsigned int output_width, const unsigned int output_height,
+						 const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+{
+	// Turn it into YUV420 first, which the encoder can take without further conversion.
+	StreamInfo yuv420_info = info;
+	yuv420_info.stride = (info.width + 15) & ~15;
+	std::vector<uint8_t> yuv420(yuv420_info.stride * info.height * 3 / 2);
+	yuyv_to_yuv420(input, info.stride, info.width, info.height, yuv420.data(), yuv420_info.stride);
+
+	YUV420_to_JPEG(yuv420.data(), yuv420_info, output_width, output_height, quality, restart, jpeg_buffer,
+				   jpeg_len);
 }
 
 static void YUV_to_JPEG(const uint8_t *input, StreamInfo const &info,
@@ -612,6 +542,7 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 			fwrite(jpeg_buffer + exif_image_offset, jpeg_len - exif_image_offset, 1, fp) != 1)
 			throw std::runtime_error("failed to write file - output probably corrupt");
 
+		sync_file(fp, options);
 		if (fp != stdout)
 			fclose(fp);
 		fp = nullptr;
@@ -693,6 +624,7 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 			throw std::runtime_error("failed to write file - output probably corrupt");
 */
 
+		sync_file(fp, options);
 		if (fp != stdout)
 			fclose(fp);
 		fp = nullptr;
@@ -15,6 +15,8 @@
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "image.hpp"
+
 void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			  std::string const &filename, StillOptions const *options)
 {
@@ -68,6 +70,7 @@ void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		// Free and close everything and we're done.
 		png_free(png_ptr, row_ptrs);
 		png_destroy_write_struct(&png_ptr, &info_ptr);
+		sync_file(fp, options);
 		if (fp != stdout)
 			fclose(fp);
 	}
@@ -134,6 +137,7 @@ void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		// Free and close everything and we're done.
 		png_free(png_ptr, row_ptrs);
 		png_destroy_write_struct(&png_ptr, &info_ptr);
+		sync_file(fp, options);
 		if (fp != stdout)
 			fclose(fp);
 	}
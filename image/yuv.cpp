@@ -5,11 +5,41 @@
  * yuv.cpp - dummy stills encoder to save uncompressed data
  */
 
+#include <algorithm>
+
 #include <libcamera/formats.h>
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "image.hpp"
+#include "image_kernels.hpp"
+
+// Images are written out a few rows at a time, rather than being packed into a copy of the
+// whole frame first.
+static constexpr unsigned int SAVE_ROWS = 16;
+
+static void write_rows(FILE *fp, uint8_t const *data, size_t size, std::string const &filename)
+{
+	if (fwrite(data, size, 1, fp) != 1)
+		throw std::runtime_error("failed to write file " + filename);
+}
+
+// Write a plane without its row padding. If it hasn't any, it can go straight out.
+static void write_plane(FILE *fp, uint8_t const *src, unsigned int stride, unsigned int width, unsigned int height,
+						std::vector<uint8_t> &buf, std::string const &filename)
+{
+	if (stride == width)
+		return write_rows(fp, src, width * height, filename);
+	unsigned int rows = buf.size() / width;
+	for (unsigned int y = 0; y < height; y += rows)
+	{
+		unsigned int n = std::min(rows, height - y);
+		copy_plane(src + y * stride, stride, buf.data(), width, width, n);
+		write_rows(fp, buf.data(), width * n, filename);
+	}
+}
+
 static void yuv420_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 						std::string const &filename, StillOptions const *options)
 {
@@ -25,25 +55,15 @@ static void yuv420_save(std::vector<libcamera::Span<uint8_t>> const &mem, Stream
 			throw std::runtime_error("failed to open file " + filename);
 		try
 		{
-			uint8_t *Y = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(Y + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			uint8_t *U = Y + stride * h;
-			h /= 2, w /= 2, stride /= 2;
-			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(U + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			uint8_t *V = U + stride * h;
-			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(V + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
+			uint8_t const *Y = (uint8_t const *)mem[0].data();
+			uint8_t const *U = Y + stride * h;
+			uint8_t const *V = U + (stride / 2) * (h / 2);
+			std::vector<uint8_t> buf(stride == w ? 0 : SAVE_ROWS * w);
+			write_plane(fp, Y, stride, w, h, buf, filename);
+			write_plane(fp, U, stride / 2, w / 2, h / 2, buf, filename);
+			write_plane(fp, V, stride / 2, w / 2, h / 2, buf, filename);
+			sync_file(fp, options);
+			fclose(fp);
 		}
 		catch (std::exception const &e)
 		{
@@ -60,40 +80,40 @@ static void yuyv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamIn
 {
 	if (options->encoding == "yuv420")
 	{
-		if ((info.width & 1) || (info.height & 1))
+		unsigned w = info.width, h = info.height, stride = info.stride;
+		if ((w & 1) || (h & 1))
 			throw std::runtime_error("both width and height must be even");
 		FILE *fp = fopen(filename.c_str(), "w");
 		if (!fp)
 			throw std::runtime_error("failed to open file " + filename);
 		try
 		{
-			// We could doubtless do this much quicker. Though starting with
-			// YUV420 planar buffer would have been nice.
-			std::vector<uint8_t> row(info.width);
-			uint8_t *ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j++, ptr += info.stride)
-			{
-				for (unsigned int i = 0; i < info.width; i++)
-					row[i] = ptr[i << 1];
-				if (fwrite(&row[0], info.width, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j += 2, ptr += 2 * info.stride)
+			// All the Y values go first, then the U values and then the V values, which come from
+			// the even rows. Each chroma plane gets the other one's values thrown away.
+			uint8_t const *src = (uint8_t const *)mem[0].data();
+			std::vector<uint8_t> buf(SAVE_ROWS * w), discard(w / 2);
+			for (unsigned int y = 0; y < h; y += SAVE_ROWS)
 			{
-				for (unsigned int i = 0; i < info.width / 2; i++)
-					row[i] = ptr[(i << 2) + 1];
-				if (fwrite(&row[0], info.width / 2, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
+				unsigned int n = std::min(SAVE_ROWS, h - y);
+				for (unsigned int i = 0; i < n; i++)
+					yuyv_to_y_row(src + (y + i) * stride, buf.data() + i * w, w);
+				write_rows(fp, buf.data(), n * w, filename);
 			}
-			ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j += 2, ptr += 2 * info.stride)
+			for (bool is_v : { false, true })
 			{
-				for (unsigned int i = 0; i < info.width / 2; i++)
-					row[i] = ptr[(i << 2) + 3];
-				if (fwrite(&row[0], info.width / 2, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
+				for (unsigned int y = 0; y < h / 2; y += 2 * SAVE_ROWS)
+				{
+					unsigned int n = std::min(2 * SAVE_ROWS, h / 2 - y);
+					for (unsigned int i = 0; i < n; i++)
+					{
+						uint8_t *row = buf.data() + i * (w / 2);
+						yuyv_to_uv_row(src + 2 * (y + i) * stride, is_v ? discard.data() : row,
+									   is_v ? row : discard.data(), w);
+					}
+					write_rows(fp, buf.data(), n * (w / 2), filename);
+				}
 			}
+			sync_file(fp, options);
 			fclose(fp);
 		}
 		catch (std::exception const &e)
@@ -122,6 +142,7 @@ static void rgb_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInf
 			if (fwrite(ptr, 3 * info.width, 1, fp) != 1)
 				throw std::runtime_error("failed to write file " + filename);
 		}
+		sync_file(fp, options);
 		fclose(fp);
 	}
 	catch (std::exception const &e)
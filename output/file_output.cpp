@@ -8,7 +8,8 @@
 #include "file_output.hpp"
 
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), writer_(std::make_unique<FileWriter>(options)), file_open_(false), count_(0),
+	  file_start_time_ms_(0)
 {
 }
 
@@ -17,12 +18,19 @@ FileOutput::~FileOutput()
 	closeFile();
 }
 
+void FileOutput::Finish()
+{
+	// Errors from the writer thread would otherwise only be noticed by the next write.
+	closeFile();
+	writer_->Finish();
+}
+
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	if (!file_open_ ||
 		(options_->segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->segment) ||
 		(options_->split && (flags & FLAG_RESTART)))
@@ -33,19 +41,23 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 
 	if (options_->verbose)
 		std::cerr << "FileOutput: output buffer " << mem << " size " << size << "\n";
-	if (fp_ && size)
-	{
-		if (fwrite(mem, size, 1, fp_) != 1)
-			throw std::runtime_error("failed to write output bytes");
-		if (options_->flush)
-			fflush(fp_);
-	}
+	if (file_open_ && size)
+		writeFrame(mem, size, timestamp_us, flags);
+}
+
+void FileOutput::writeFrame(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// The writer thread takes care of actually writing (and flushing) the data.
+	writer_->Write(mem, size);
 }
 
 void FileOutput::openFile(int64_t timestamp_us)
 {
 	if (options_->output == "-")
-		fp_ = stdout;
+	{
+		writer_->Open("-");
+		file_open_ = true;
+	}
 	else if (!options_->output.empty())
 	{
 		// Generate the next output file name.
@@ -57,11 +69,11 @@ void FileOutput::openFile(int64_t timestamp_us)
 		if (n < 0)
 			throw std::runtime_error("failed to generate filename");
 
-		fp_ = fopen(filename, "w");
-		if (!fp_)
-			throw std::runtime_error("failed to open output file " + std::string(filename));
+		// The file is opened asynchronously; any failure is reported on a later call.
+		writer_->Open(filename);
+		file_open_ = true;
 		if (options_->verbose)
-			std::cerr << "FileOutput: opened output file " << filename << std::endl;
+			std::cerr << "FileOutput: opening output file " << filename << std::endl;
 
 		file_start_time_ms_ = timestamp_us / 1000;
 	}
@@ -69,7 +81,7 @@ void FileOutput::openFile(int64_t timestamp_us)
 
 void FileOutput::closeFile()
 {
-	if (fp_ && fp_ != stdout)
-		fclose(fp_);
-	fp_ = nullptr;
+	if (file_open_)
+		writer_->Close();
+	file_open_ = false;
 }
@@ -7,6 +7,9 @@
 
 #pragma once
 
+#include <memory>
+
+#include "file_writer.hpp"
 #include "output.hpp"
 
 class FileOutput : public Output
@@ -14,14 +17,20 @@ class FileOutput : public Output
 public:
 	FileOutput(VideoOptions const *options);
 	~FileOutput();
+	void Finish() override;
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	// Derived classes that write a container format can wrap each frame and
+	// add their own headers when files are opened and closed. Note that the
+	// FileOutput destructor can only call its own closeFile.
+	virtual void openFile(int64_t timestamp_us);
+	virtual void closeFile();
+	virtual void writeFrame(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
+	std::unique_ptr<FileWriter> writer_;
 
 private:
-	void openFile(int64_t timestamp_us);
-	void closeFile();
-	FILE *fp_;
+	bool file_open_;
 	unsigned int count_;
 	int64_t file_start_time_ms_;
 };
@@ -0,0 +1,432 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * file_writer.cpp - Write output files from a dedicated thread.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "file_writer.hpp"
+
+// Whether the output is stdout, a pipe, a socket or some such, rather than a regular file.
+// Whoever is reading those will want the data as soon as it's ready.
+
+static bool is_stream(std::string const &filename)
+{
+	struct stat st;
+	return filename == "-" || (stat(filename.c_str(), &st) == 0 && !S_ISREG(st.st_mode));
+}
+
+FileWriter::FileWriter(VideoOptions const *options)
+	: options_(options), rptr_(0), wptr_(0), used_(0), abort_(false), busy_(false), fd_(-1), fd_direct_(false),
+	  streaming_(false), file_offset_(0), allocated_(0), sync_started_(0), sync_done_(0), max_used_(0), stalls_(0),
+	  stall_time_(0), writes_(0), bytes_written_(0), max_write_time_(0), write_latency_()
+{
+	// Blocks must be a multiple of the O_DIRECT alignment, and the buffer a
+	// multiple of the block size so that a block never straddles the end.
+	block_size_ = std::max<size_t>((((size_t)options->writer_block << 10) + ALIGN - 1) & ~(ALIGN - 1), ALIGN);
+	buffer_size_ = std::max<size_t>(options->writer_buffer, 1) << 20;
+	// Streams are written as soon as there's anything to write, so don't need much buffer.
+	if (is_stream(options->output))
+		buffer_size_ = std::min<size_t>(buffer_size_, 2 * block_size_);
+	buffer_size_ = std::max((buffer_size_ + block_size_ - 1) / block_size_, (size_t)2) * block_size_;
+	direct_ = options->writer_direct;
+
+	void *buf;
+	if (posix_memalign(&buf, ALIGN, buffer_size_))
+		throw std::runtime_error("failed to allocate file writer buffer");
+	buf_ = static_cast<uint8_t *>(buf);
+
+	writer_thread_ = std::thread(&FileWriter::writerThread, this);
+}
+
+FileWriter::~FileWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		data_cond_var_.notify_one();
+	}
+	writer_thread_.join();
+	free(buf_);
+
+	// Nobody called Finish, or something failed after it, so this is our last chance to say.
+	if (error_)
+	{
+		try
+		{
+			std::rethrow_exception(error_);
+		}
+		catch (std::exception const &e)
+		{
+			std::cerr << "FileWriter: " << e.what() << ", output is incomplete" << std::endl;
+		}
+	}
+
+	if (options_->verbose)
+		std::cerr << "FileWriter: wrote " << bytes_written_ << " bytes in " << writes_ << " writes, longest write "
+				  << max_write_time_.count() * 1000 << "ms, max queue depth " << max_used_ << " of " << buffer_size_
+				  << " bytes" << std::endl;
+	if (options_->verbose && writes_)
+	{
+		static const char *bins[NUM_LATENCY_BINS] = { "<1ms", "<10ms", "<100ms", "<1s", ">=1s" };
+		std::cerr << "FileWriter: write latencies";
+		for (int i = 0; i < NUM_LATENCY_BINS; i++)
+			std::cerr << " " << bins[i] << ":" << write_latency_[i];
+		std::cerr << std::endl;
+	}
+	if (stalls_)
+		std::cerr << "FileWriter: output stalled " << stalls_ << " times, for " << stall_time_.count() * 1000
+				  << "ms in total" << std::endl;
+}
+
+void FileWriter::checkError()
+{
+	if (error_)
+		std::rethrow_exception(error_);
+}
+
+void FileWriter::Open(std::string const &filename)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	checkError();
+	// Start every file on an aligned boundary in the buffer, so that O_DIRECT
+	// writes from it are aligned too. The writer thread skips the padding.
+	size_t pad = direct_ ? (ALIGN - wptr_ % ALIGN) % ALIGN : 0;
+	space_cond_var_.wait(lock, [&] { return buffer_size_ - used_ >= pad || error_; });
+	checkError();
+	wptr_ = (wptr_ + pad) % buffer_size_;
+	used_ += pad;
+	commands_.push_back({ Command::OPEN, filename, pad, 0, {} });
+	data_cond_var_.notify_one();
+}
+
+void FileWriter::Write(void const *mem, size_t size)
+{
+	uint8_t const *src = static_cast<uint8_t const *>(mem);
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (size)
+	{
+		checkError();
+		if (used_ == buffer_size_)
+		{
+			auto start_time = std::chrono::high_resolution_clock::now();
+			space_cond_var_.wait(lock, [this] { return used_ < buffer_size_ || error_; });
+			stall_time_ += std::chrono::high_resolution_clock::now() - start_time;
+			stalls_++;
+			continue;
+		}
+
+		// Only we ever write into the free part of the buffer, so the copy can
+		// happen without holding the lock.
+		size_t n = std::min(size, buffer_size_ - used_);
+		size_t offset = wptr_;
+		lock.unlock();
+		size_t first = std::min(n, buffer_size_ - offset);
+		memcpy(buf_ + offset, src, first);
+		memcpy(buf_, src + first, n - first);
+		lock.lock();
+
+		wptr_ = (wptr_ + n) % buffer_size_;
+		used_ += n;
+		max_used_ = std::max(max_used_, used_);
+		if (!commands_.empty() && commands_.back().type == Command::DATA)
+			commands_.back().size += n;
+		else
+			commands_.push_back({ Command::DATA, "", n, 0, {} });
+		data_cond_var_.notify_one();
+		src += n;
+		size -= n;
+	}
+}
+
+void FileWriter::Patch(uint64_t offset, void const *mem, size_t size)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	checkError();
+	uint8_t const *src = static_cast<uint8_t const *>(mem);
+	commands_.push_back({ Command::PATCH, "", 0, offset, std::vector<uint8_t>(src, src + size) });
+	data_cond_var_.notify_one();
+}
+
+void FileWriter::Close()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	commands_.push_back({ Command::CLOSE, "", 0, 0, {} });
+	data_cond_var_.notify_one();
+}
+
+void FileWriter::Finish()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	commands_.push_back({ Command::CLOSE, "", 0, 0, {} });
+	data_cond_var_.notify_one();
+	idle_cond_var_.wait(lock, [this] { return commands_.empty() && !busy_; });
+	// The caller gets to deal with the error now, so don't report it again.
+	std::exception_ptr error = error_;
+	error_ = nullptr;
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void FileWriter::openFile(std::string const &filename)
+{
+	if (filename == "-")
+	{
+		fd_ = STDOUT_FILENO;
+		fd_direct_ = false;
+		streaming_ = true;
+		return;
+	}
+
+	// O_DIRECT would put a pipe into "packet mode", which isn't what we want at all.
+	streaming_ = is_stream(filename);
+	bool direct = direct_ && !streaming_;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	fd_ = open(filename.c_str(), flags | (direct ? O_DIRECT : 0), 0666);
+	fd_direct_ = direct;
+	if (fd_ < 0 && direct && errno == EINVAL)
+	{
+		// Not all filesystems (e.g. tmpfs) support O_DIRECT.
+		std::cerr << "FileWriter: O_DIRECT not supported for " << filename << std::endl;
+		fd_ = open(filename.c_str(), flags, 0666);
+		fd_direct_ = false;
+	}
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open output file " + filename);
+	if (options_->verbose)
+		std::cerr << "FileWriter: opened output file " << filename << std::endl;
+
+	file_offset_ = allocated_ = sync_started_ = sync_done_ = 0;
+	syncFile();
+}
+
+void FileWriter::closeFile()
+{
+	int fd = fd_;
+	fd_ = -1;
+	if (fd < 0 || fd == STDOUT_FILENO)
+		return;
+
+	if (options_->fsync && !streaming_ && ::fsync(fd) < 0)
+		std::cerr << "FileWriter: failed to sync output file" << std::endl;
+	// Whatever is still in the page cache is clean now if we synced it, or
+	// may well be by the time the kernel looks at it again.
+	if (options_->fadvise)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	// Any preallocated space beyond the end of the file (we use
+	// FALLOC_FL_KEEP_SIZE) is released when we close it. Some filesystems
+	// (NFS, for one) only report write errors here.
+	if (close(fd) < 0)
+		throw std::runtime_error("failed to close output file");
+}
+
+void FileWriter::syncFile()
+{
+	if (streaming_)
+		return;
+
+	// Preallocate the file in chunks, which keeps it contiguous on disk and
+	// avoids block allocation when writing.
+	uint64_t chunk = (uint64_t)options_->preallocate << 20;
+	if (chunk && file_offset_ + block_size_ > allocated_)
+	{
+		if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, allocated_, chunk) == 0)
+			allocated_ += chunk;
+		else
+		{
+			std::cerr << "FileWriter: failed to preallocate output file" << std::endl;
+			allocated_ = UINT64_MAX; // don't try again for this file
+		}
+	}
+
+	// Every sync_interval bytes, start writeback of the new data and wait for the
+	// previous lot to finish, then drop that from the page cache if requested.
+	// The amount of dirty data is therefore never much more than two intervals.
+	uint64_t interval = (uint64_t)options_->sync_interval << 20;
+	if (interval && file_offset_ - sync_started_ >= interval)
+	{
+		// (Beware that a zero length means "to the end of the file".)
+		unsigned int wait_flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+		if (sync_started_ > sync_done_ && sync_file_range(fd_, sync_done_, sync_started_ - sync_done_, wait_flags) < 0)
+			std::cerr << "FileWriter: failed to wait for writeback" << std::endl;
+		if (sync_file_range(fd_, sync_started_, file_offset_ - sync_started_, SYNC_FILE_RANGE_WRITE) < 0)
+			std::cerr << "FileWriter: failed to start writeback" << std::endl;
+		if (options_->fadvise && sync_started_ > sync_done_)
+			posix_fadvise(fd_, sync_done_, sync_started_ - sync_done_, POSIX_FADV_DONTNEED);
+		sync_done_ = sync_started_;
+		sync_started_ = file_offset_;
+	}
+}
+
+void FileWriter::writeData(size_t offset, size_t size, bool last)
+{
+	if (fd_ < 0)
+		return;
+	// O_DIRECT can't write the odd-sized tail of a file, so drop back to normal
+	// buffered writes for it.
+	if (last && fd_direct_ && size % ALIGN)
+	{
+		fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+		fd_direct_ = false;
+	}
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	while (size)
+	{
+		iovec iov[2];
+		iov[0].iov_base = buf_ + offset;
+		iov[0].iov_len = std::min(size, buffer_size_ - offset);
+		iov[1].iov_base = buf_;
+		iov[1].iov_len = size - iov[0].iov_len;
+		ssize_t ret = writev(fd_, iov, iov[1].iov_len ? 2 : 1);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("failed to write output bytes");
+		}
+		offset = (offset + ret) % buffer_size_;
+		size -= ret;
+		file_offset_ += ret;
+		bytes_written_ += ret;
+		writes_++;
+	}
+
+	std::chrono::duration<double> write_time = std::chrono::high_resolution_clock::now() - start_time;
+	max_write_time_ = std::max(max_write_time_, write_time);
+	int bin = 0;
+	for (double t = 0.001; bin < NUM_LATENCY_BINS - 1 && write_time.count() >= t; t *= 10)
+		bin++;
+	write_latency_[bin]++;
+
+	syncFile();
+}
+
+void FileWriter::patchFile(uint64_t offset, std::vector<uint8_t> const &patch)
+{
+	if (fd_ < 0 || streaming_)
+		return;
+	// Patches are small and unaligned, so they can't be written with O_DIRECT.
+	if (fd_direct_)
+	{
+		fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+		fd_direct_ = false;
+	}
+	if (pwrite(fd_, patch.data(), patch.size(), offset) != (ssize_t)patch.size())
+		throw std::runtime_error("failed to update output file");
+}
+
+void FileWriter::writerThread()
+{
+	using namespace std::chrono_literals;
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		busy_ = false;
+		idle_cond_var_.notify_all();
+		// Wait until there's a whole block to write or something else to do.
+		// With the flush option, or when writing to a pipe or socket, we write
+		// as soon as there is any data, and we don't let data hang around for
+		// ever when the encoder output is slow.
+		auto ready = [this](bool timed_out) {
+			if (commands_.empty())
+				return false;
+			Command const &cmd = commands_.front();
+			size_t min_size = fd_direct_ ? ALIGN : 1;
+			return cmd.type != Command::DATA || cmd.size >= block_size_ || commands_.size() > 1 || abort_ ||
+				   ((options_->flush || streaming_ || timed_out) && cmd.size >= min_size);
+		};
+		while (!ready(false) && !(abort_ && commands_.empty()))
+		{
+			if (data_cond_var_.wait_for(lock, 1s) == std::cv_status::timeout && ready(true))
+				break;
+		}
+		if (commands_.empty())
+			break; // abort_ must be set, and everything is written
+
+		Command &cmd = commands_.front();
+		bool ok = !error_;
+		busy_ = true;
+		try
+		{
+			if (cmd.type == Command::OPEN)
+			{
+				rptr_ = (rptr_ + cmd.size) % buffer_size_;
+				used_ -= cmd.size;
+				std::string filename = cmd.filename;
+				commands_.pop_front();
+				space_cond_var_.notify_one();
+				lock.unlock();
+				if (ok)
+					openFile(filename);
+			}
+			else if (cmd.type == Command::PATCH)
+			{
+				uint64_t offset = cmd.offset;
+				std::vector<uint8_t> patch = std::move(cmd.patch);
+				commands_.pop_front();
+				lock.unlock();
+				if (ok)
+					patchFile(offset, patch);
+			}
+			else if (cmd.type == Command::CLOSE)
+			{
+				commands_.pop_front();
+				lock.unlock();
+				closeFile();
+			}
+			else
+			{
+				size_t n = std::min(cmd.size, block_size_);
+				bool last = n == cmd.size && (commands_.size() > 1 || abort_);
+				if (fd_direct_ && !last)
+					n -= n % ALIGN;
+				size_t offset = rptr_;
+				lock.unlock();
+				if (ok)
+					writeData(offset, n, last);
+				lock.lock();
+				rptr_ = (rptr_ + n) % buffer_size_;
+				used_ -= n;
+				if ((commands_.front().size -= n) == 0)
+					commands_.pop_front();
+				space_cond_var_.notify_one();
+			}
+		}
+		catch (std::exception const &)
+		{
+			// Pass the error back to the caller, but keep draining the buffer
+			// so that it never waits for ever.
+			if (!lock)
+				lock.lock();
+			error_ = std::current_exception();
+			space_cond_var_.notify_one();
+			if (!commands_.empty() && commands_.front().type == Command::DATA)
+			{
+				size_t n = commands_.front().size;
+				rptr_ = (rptr_ + n) % buffer_size_;
+				used_ -= n;
+				commands_.pop_front();
+			}
+		}
+	}
+
+	try
+	{
+		closeFile();
+	}
+	catch (std::exception const &)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		error_ = std::current_exception();
+	}
+}
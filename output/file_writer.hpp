@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * file_writer.hpp - Write output files from a dedicated thread.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/video_options.hpp"
+
+// The FileWriter takes encoded data from the encoder output thread and writes
+// it to disk from a thread of its own, so that storage stalls don't hold up
+// the return of encoder buffers. Data is copied into a bounded ring buffer and
+// written out in large blocks. Opening and closing files is queued in order
+// with the data, so file rotation doesn't happen on the caller's thread either.
+// The writer thread can also preallocate space for each file, and start and wait
+// for writeback of the data at regular intervals (and drop it from the page
+// cache) so that the kernel never builds up huge amounts of dirty data.
+
+class FileWriter
+{
+public:
+	FileWriter(VideoOptions const *options);
+	~FileWriter();
+	// Queue opening the named file ("-" means stdout). Any previous file must
+	// have been closed first.
+	void Open(std::string const &filename);
+	// Copy the data into the ring buffer, waiting only if the buffer is full.
+	void Write(void const *mem, size_t size);
+	// Queue an overwrite of earlier bytes in the current file, for example to
+	// fill in a header once the file is complete. Has no effect on stdout or pipes.
+	void Patch(uint64_t offset, void const *mem, size_t size);
+	// Queue the close of the current file, once all its data is written.
+	void Close();
+	// Close any file still open, wait until everything queued has been written, and throw
+	// any error the writer thread encountered.
+	void Finish();
+
+private:
+	// O_DIRECT transfers must be aligned in memory, size and file offset.
+	static constexpr size_t ALIGN = 4096;
+
+	struct Command
+	{
+		enum Type
+		{
+			OPEN,
+			DATA,
+			PATCH,
+			CLOSE
+		};
+		Type type;
+		std::string filename; // for OPEN
+		size_t size; // bytes of data, or bytes of padding to skip for OPEN
+		uint64_t offset; // for PATCH
+		std::vector<uint8_t> patch; // for PATCH
+	};
+
+	void writerThread();
+	// Throw any error the writer thread encountered back to the caller.
+	void checkError();
+	void openFile(std::string const &filename);
+	void closeFile();
+	void writeData(size_t offset, size_t size, bool last);
+	void patchFile(uint64_t offset, std::vector<uint8_t> const &patch);
+	// Preallocation and writeback control after writing to the file.
+	void syncFile();
+
+	VideoOptions const *options_;
+	size_t buffer_size_;
+	size_t block_size_;
+	bool direct_;
+	uint8_t *buf_;
+	size_t rptr_, wptr_, used_;
+	std::deque<Command> commands_;
+	std::mutex mutex_;
+	std::condition_variable data_cond_var_;
+	std::condition_variable space_cond_var_;
+	std::condition_variable idle_cond_var_;
+	bool abort_;
+	bool busy_; // the writer thread is carrying out a command it took off the queue
+	std::exception_ptr error_;
+	int fd_;
+	bool fd_direct_;
+	bool streaming_; // writing to stdout, a pipe or the like, not a regular file
+	uint64_t file_offset_; // bytes written to the current file
+	uint64_t allocated_; // end of the space preallocated for it
+	uint64_t sync_started_; // end of the data we have asked to be written back
+	uint64_t sync_done_; // end of the data we know has been written back
+	std::thread writer_thread_;
+
+	// Statistics, reported when we finish.
+	size_t max_used_;
+	unsigned int stalls_;
+	std::chrono::duration<double> stall_time_;
+	unsigned int writes_;
+	uint64_t bytes_written_;
+	std::chrono::duration<double> max_write_time_;
+	// Histogram of write latencies, in decades from < 1ms up to >= 1s.
+	static constexpr int NUM_LATENCY_BINS = 5;
+	unsigned int write_latency_[NUM_LATENCY_BINS];
+};
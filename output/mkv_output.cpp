@@ -0,0 +1,406 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * mkv_output.cpp - Write output to Matroska files.
+ */
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "mkv_output.hpp"
+
+// Matroska element IDs.
+enum
+{
+	EBML = 0x1A45DFA3,
+	EBML_VERSION = 0x4286,
+	EBML_READ_VERSION = 0x42F7,
+	EBML_MAX_ID_LENGTH = 0x42F2,
+	EBML_MAX_SIZE_LENGTH = 0x42F3,
+	DOC_TYPE = 0x4282,
+	DOC_TYPE_VERSION = 0x4287,
+	DOC_TYPE_READ_VERSION = 0x4285,
+	SEGMENT = 0x18538067,
+	SEEK_HEAD = 0x114D9B74,
+	SEEK = 0x4DBB,
+	SEEK_ID = 0x53AB,
+	SEEK_POSITION = 0x53AC,
+	INFO = 0x1549A966,
+	TIMECODE_SCALE = 0x2AD7B1,
+	DURATION = 0x4489,
+	MUXING_APP = 0x4D80,
+	WRITING_APP = 0x5741,
+	TRACKS = 0x1654AE6B,
+	TRACK_ENTRY = 0xAE,
+	TRACK_NUMBER = 0xD7,
+	TRACK_UID = 0x73C5,
+	TRACK_TYPE = 0x83,
+	FLAG_LACING = 0x9C,
+	DEFAULT_DURATION = 0x23E383,
+	CODEC_ID = 0x86,
+	CODEC_PRIVATE = 0x63A2,
+	VIDEO = 0xE0,
+	PIXEL_WIDTH = 0xB0,
+	PIXEL_HEIGHT = 0xBA,
+	CLUSTER = 0x1F43B675,
+	TIMECODE = 0xE7,
+	SIMPLE_BLOCK = 0xA3,
+	CUES = 0x1C53BB6B,
+	CUE_POINT = 0xBB,
+	CUE_TIME = 0xB3,
+	CUE_TRACK_POSITIONS = 0xB7,
+	CUE_TRACK = 0xF7,
+	CUE_CLUSTER_POSITION = 0xF1,
+	VOID = 0xEC
+};
+
+// Space reserved at the front of the segment for the seek head, which we can
+// only fill in once we know where the cues are.
+static constexpr unsigned int SEEK_HEAD_SPACE = 96;
+// And space in the info for the duration element (2 + 1 + 8 bytes).
+static constexpr unsigned int DURATION_SPACE = 11;
+// Start a new cluster at the next keyframe once the current one is this long.
+static constexpr int64_t CLUSTER_MS = 1000;
+// Block timecodes are signed 16-bit offsets from the cluster timecode.
+static constexpr int64_t MAX_BLOCK_OFFSET_MS = 32767;
+static constexpr size_t MAX_CLUSTER_SIZE = 32 << 20;
+
+static void put_id(std::vector<uint8_t> &buf, uint32_t id)
+{
+	int bytes = id > 0xffffff ? 4 : id > 0xffff ? 3 : id > 0xff ? 2 : 1;
+	for (int i = bytes - 1; i >= 0; i--)
+		buf.push_back(id >> (8 * i));
+}
+
+// Sizes are variable length integers; len forces a particular length.
+static void put_size(std::vector<uint8_t> &buf, uint64_t size, int len = 0)
+{
+	if (!len)
+		for (len = 1; len < 8 && size >= (1ULL << (7 * len)) - 1; len++)
+			;
+	size |= 1ULL << (7 * len);
+	for (int i = len - 1; i >= 0; i--)
+		buf.push_back(size >> (8 * i));
+}
+
+static void put_uint(std::vector<uint8_t> &buf, uint32_t id, uint64_t value, int len = 0)
+{
+	if (!len)
+		for (len = 1; len < 8 && (value >> (8 * len)); len++)
+			;
+	put_id(buf, id);
+	put_size(buf, len);
+	for (int i = len - 1; i >= 0; i--)
+		buf.push_back(value >> (8 * i));
+}
+
+static void put_float(std::vector<uint8_t> &buf, uint32_t id, double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	put_id(buf, id);
+	put_size(buf, 8);
+	for (int i = 7; i >= 0; i--)
+		buf.push_back(bits >> (8 * i));
+}
+
+static void put_binary(std::vector<uint8_t> &buf, uint32_t id, void const *data, size_t size)
+{
+	put_id(buf, id);
+	put_size(buf, size);
+	buf.insert(buf.end(), (uint8_t const *)data, (uint8_t const *)data + size);
+}
+
+static void put_string(std::vector<uint8_t> &buf, uint32_t id, std::string const &str)
+{
+	put_binary(buf, id, str.data(), str.size());
+}
+
+static void put_master(std::vector<uint8_t> &buf, uint32_t id, std::vector<uint8_t> const &children)
+{
+	put_binary(buf, id, children.data(), children.size());
+}
+
+// A void element filling exactly size bytes (2 <= size <= 128).
+static void put_void(std::vector<uint8_t> &buf, unsigned int size)
+{
+	put_id(buf, VOID);
+	put_size(buf, size - 2, 1);
+	buf.insert(buf.end(), size - 2, 0);
+}
+
+// Find the NAL units in an Annex B byte stream.
+static std::vector<std::pair<uint8_t const *, size_t>> find_nals(uint8_t const *data, size_t size)
+{
+	std::vector<std::pair<uint8_t const *, size_t>> nals;
+	uint8_t const *nal = nullptr;
+	for (size_t i = 0; i + 2 < size; i++)
+	{
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+		{
+			if (nal)
+				nals.emplace_back(nal, data + i - nal);
+			nal = data + i + 3;
+			i += 2;
+		}
+	}
+	if (nal)
+		nals.emplace_back(nal, data + size - nal);
+	// Drop any zero bytes trailing each NAL (e.g. from 4-byte start codes).
+	for (auto &n : nals)
+		while (n.second && n.first[n.second - 1] == 0)
+			n.second--;
+	return nals;
+}
+
+MkvOutput::MkvOutput(VideoOptions const *options)
+	: FileOutput(options), in_file_(false), header_written_(false), file_pos_(0), file_start_us_(0),
+	  last_time_ms_(0), cluster_time_ms_(0), cluster_keyframe_(false)
+{
+	if (options->codec == "h264")
+		h264_ = true;
+	else if (options->codec == "mjpeg")
+		h264_ = false;
+	else
+		throw std::runtime_error("Matroska output supports only h264 and mjpeg codecs");
+}
+
+MkvOutput::~MkvOutput()
+{
+	// The FileOutput destructor can't call our version of this.
+	closeFile();
+}
+
+void MkvOutput::openFile(int64_t timestamp_us)
+{
+	FileOutput::openFile(timestamp_us);
+	in_file_ = true;
+	header_written_ = false;
+	file_pos_ = 0;
+	cluster_.clear();
+	cues_.clear();
+}
+
+void MkvOutput::closeFile()
+{
+	if (in_file_ && header_written_)
+		finishFile();
+	in_file_ = false;
+	FileOutput::closeFile();
+}
+
+void MkvOutput::write(std::vector<uint8_t> const &data)
+{
+	writer_->Write(data.data(), data.size());
+	file_pos_ += data.size();
+}
+
+void MkvOutput::writeHeader()
+{
+	std::vector<uint8_t> buf, children;
+
+	put_uint(children, EBML_VERSION, 1);
+	put_uint(children, EBML_READ_VERSION, 1);
+	put_uint(children, EBML_MAX_ID_LENGTH, 4);
+	put_uint(children, EBML_MAX_SIZE_LENGTH, 8);
+	put_string(children, DOC_TYPE, "matroska");
+	put_uint(children, DOC_TYPE_VERSION, 4);
+	put_uint(children, DOC_TYPE_READ_VERSION, 2);
+	put_master(buf, EBML, children);
+
+	// The segment size is "unknown" until we fill it in when closing the file.
+	put_id(buf, SEGMENT);
+	segment_size_pos_ = buf.size();
+	put_size(buf, (1ULL << 56) - 1, 8);
+	segment_start_ = buf.size();
+
+	seek_head_pos_ = buf.size();
+	put_void(buf, SEEK_HEAD_SPACE);
+
+	info_pos_ = buf.size();
+	children.clear();
+	put_uint(children, TIMECODE_SCALE, 1000000); // timecodes are in ms
+	put_string(children, MUXING_APP, "libcamera-apps");
+	put_string(children, WRITING_APP, "libcamera-apps");
+	duration_pos_ = buf.size() + 4 + 1 + children.size(); // after the 4 byte ID and 1 byte size
+	put_void(children, DURATION_SPACE);
+	put_master(buf, INFO, children);
+	if (duration_pos_ + DURATION_SPACE != buf.size())
+		throw std::runtime_error("Matroska info size error");
+
+	tracks_pos_ = buf.size();
+	std::vector<uint8_t> track, video;
+	put_uint(video, PIXEL_WIDTH, options_->width);
+	put_uint(video, PIXEL_HEIGHT, options_->height);
+	put_uint(track, TRACK_NUMBER, 1);
+	put_uint(track, TRACK_UID, 1);
+	put_uint(track, TRACK_TYPE, 1); // video
+	put_uint(track, FLAG_LACING, 0);
+	if (options_->framerate > 0)
+		put_uint(track, DEFAULT_DURATION, (uint64_t)(1e9 / options_->framerate));
+	put_string(track, CODEC_ID, h264_ ? "V_MPEG4/ISO/AVC" : "V_MJPEG");
+	if (h264_)
+		put_binary(track, CODEC_PRIVATE, codec_private_.data(), codec_private_.size());
+	put_master(track, VIDEO, video);
+	children.clear();
+	put_master(children, TRACK_ENTRY, track);
+	put_master(buf, TRACKS, children);
+
+	write(buf);
+	header_written_ = true;
+}
+
+void MkvOutput::flushCluster()
+{
+	if (cluster_.empty())
+		return;
+
+	// Only clusters that start with a keyframe are useful seek points.
+	if (cluster_keyframe_)
+		cues_.push_back({ cluster_time_ms_, file_pos_ - segment_start_ });
+
+	std::vector<uint8_t> header;
+	put_id(header, CLUSTER);
+	put_size(header, cluster_.size());
+	write(header);
+	write(cluster_);
+	cluster_.clear();
+}
+
+void MkvOutput::finishFile()
+{
+	flushCluster();
+
+	uint64_t cues_pos = file_pos_ - segment_start_;
+	std::vector<uint8_t> buf, children;
+	for (auto const &cue : cues_)
+	{
+		std::vector<uint8_t> point, position;
+		put_uint(position, CUE_TRACK, 1);
+		put_uint(position, CUE_CLUSTER_POSITION, cue.position);
+		put_uint(point, CUE_TIME, cue.time_ms);
+		put_master(point, CUE_TRACK_POSITIONS, position);
+		put_master(children, CUE_POINT, point);
+	}
+	if (!cues_.empty())
+	{
+		put_master(buf, CUES, children);
+		write(buf);
+	}
+
+	// Now go back and fill in the blanks in the header.
+	buf.clear();
+	put_size(buf, file_pos_ - segment_start_, 8);
+	writer_->Patch(segment_size_pos_, buf.data(), buf.size());
+
+	std::vector<std::pair<uint32_t, uint64_t>> entries = { { INFO, info_pos_ - segment_start_ },
+														   { TRACKS, tracks_pos_ - segment_start_ } };
+	if (!cues_.empty())
+		entries.emplace_back(CUES, cues_pos);
+	children.clear();
+	for (auto const &entry : entries)
+	{
+		std::vector<uint8_t> seek, id;
+		put_id(id, entry.first);
+		put_binary(seek, SEEK_ID, id.data(), id.size());
+		put_uint(seek, SEEK_POSITION, entry.second, 8);
+		put_master(children, SEEK, seek);
+	}
+	buf.clear();
+	put_master(buf, SEEK_HEAD, children);
+	put_void(buf, SEEK_HEAD_SPACE - buf.size());
+	writer_->Patch(seek_head_pos_, buf.data(), buf.size());
+
+	buf.clear();
+	double frame_ms = options_->framerate > 0 ? 1000.0 / options_->framerate : 0;
+	put_float(buf, DURATION, last_time_ms_ + frame_ms);
+	writer_->Patch(duration_pos_, buf.data(), buf.size());
+}
+
+void MkvOutput::writeFrame(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	uint8_t const *data = (uint8_t const *)mem;
+	std::vector<std::pair<uint8_t const *, size_t>> nals;
+	if (h264_)
+	{
+		nals = find_nals(data, size);
+		// Matroska wants the SPS and PPS in the track header, so we have to wait
+		// for them. We keep them for subsequent files in case they don't get
+		// repeated (when inline headers are off).
+		uint8_t const *sps = nullptr, *pps = nullptr;
+		size_t sps_len = 0, pps_len = 0;
+		for (auto const &nal : nals)
+		{
+			if (nal.second >= 4 && (nal.first[0] & 0x1f) == 7)
+				sps = nal.first, sps_len = nal.second;
+			else if (nal.second && (nal.first[0] & 0x1f) == 8)
+				pps = nal.first, pps_len = nal.second;
+		}
+		if (sps && pps && codec_private_.empty())
+		{
+			codec_private_ = { 1, sps[1], sps[2], sps[3], 0xff, 0xe1 };
+			codec_private_.push_back(sps_len >> 8);
+			codec_private_.push_back(sps_len);
+			codec_private_.insert(codec_private_.end(), sps, sps + sps_len);
+			codec_private_.push_back(1);
+			codec_private_.push_back(pps_len >> 8);
+			codec_private_.push_back(pps_len);
+			codec_private_.insert(codec_private_.end(), pps, pps + pps_len);
+			// High profiles need the chroma format and bit depths, which for us
+			// are always 4:2:0 and 8 bits.
+			if (sps[1] == 100 || sps[1] == 110 || sps[1] == 122 || sps[1] == 144)
+				codec_private_.insert(codec_private_.end(), { 0xfd, 0xf8, 0xf8, 0 });
+		}
+		if (codec_private_.empty())
+		{
+			if (options_->verbose)
+				std::cerr << "MkvOutput: dropping frame before SPS/PPS" << std::endl;
+			return;
+		}
+	}
+
+	if (!header_written_)
+	{
+		writeHeader();
+		file_start_us_ = timestamp_us;
+	}
+
+	bool keyframe = flags & FLAG_KEYFRAME;
+	int64_t time_ms = (timestamp_us - file_start_us_) / 1000;
+	last_time_ms_ = time_ms;
+	if (!cluster_.empty() && ((keyframe && time_ms - cluster_time_ms_ >= CLUSTER_MS) ||
+							  time_ms - cluster_time_ms_ > MAX_BLOCK_OFFSET_MS || cluster_.size() > MAX_CLUSTER_SIZE))
+		flushCluster();
+	if (cluster_.empty())
+	{
+		cluster_time_ms_ = time_ms;
+		cluster_keyframe_ = keyframe;
+		put_uint(cluster_, TIMECODE, time_ms);
+	}
+
+	// Matroska stores H.264 with 4-byte lengths in place of the start codes.
+	size_t payload_size = size;
+	if (h264_)
+	{
+		payload_size = 0;
+		for (auto const &nal : nals)
+			payload_size += 4 + nal.second;
+	}
+	int16_t offset = time_ms - cluster_time_ms_;
+	put_id(cluster_, SIMPLE_BLOCK);
+	put_size(cluster_, 4 + payload_size);
+	cluster_.insert(cluster_.end(), { 0x81, (uint8_t)(offset >> 8), (uint8_t)offset, (uint8_t)(keyframe ? 0x80 : 0) });
+	if (h264_)
+	{
+		for (auto const &nal : nals)
+		{
+			cluster_.insert(cluster_.end(), { (uint8_t)(nal.second >> 24), (uint8_t)(nal.second >> 16),
+											  (uint8_t)(nal.second >> 8), (uint8_t)nal.second });
+			cluster_.insert(cluster_.end(), nal.first, nal.first + nal.second);
+		}
+	}
+	else
+		cluster_.insert(cluster_.end(), data, data + size);
+}
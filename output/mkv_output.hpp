@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * mkv_output.hpp - Write output to Matroska files.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "file_output.hpp"
+
+// Mux the encoded frames straight into a Matroska file, using the real frame
+// timestamps and keyframe flags, so that no separate remux pass is required.
+// H.264 is stored as V_MPEG4/ISO/AVC and MJPEG as V_MJPEG. The file is written
+// as a sequence of self-contained clusters inside a segment of unknown size, so
+// everything up to the last complete cluster stays playable if recording is cut
+// short. On a clean close we append the cues (the seek index) and fill in the
+// header.
+
+class MkvOutput : public FileOutput
+{
+public:
+	MkvOutput(VideoOptions const *options);
+	~MkvOutput();
+
+protected:
+	void openFile(int64_t timestamp_us) override;
+	void closeFile() override;
+	void writeFrame(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	void writeHeader();
+	void flushCluster();
+	void finishFile();
+	void write(std::vector<uint8_t> const &data);
+
+	bool h264_;
+	std::vector<uint8_t> codec_private_; // the avcC record, for H.264
+	bool in_file_;
+	bool header_written_;
+	uint64_t file_pos_;
+	uint64_t segment_size_pos_;
+	uint64_t segment_start_;
+	uint64_t seek_head_pos_;
+	uint64_t duration_pos_;
+	uint64_t info_pos_;
+	uint64_t tracks_pos_;
+	int64_t file_start_us_;
+	int64_t last_time_ms_;
+	std::vector<uint8_t> cluster_;
+	int64_t cluster_time_ms_;
+	bool cluster_keyframe_;
+	struct CuePoint
+	{
+		int64_t time_ms;
+		uint64_t position;
+	};
+	std::vector<CuePoint> cues_;
+};
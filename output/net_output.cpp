@@ -6,11 +6,29 @@
  */
 
 #include <arpa/inet.h>
+#include <netinet/udp.h>
 #include <sys/socket.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <thread>
+
 #include "net_output.hpp"
 
-NetOutput::NetOutput(VideoOptions const *options) : Output(options)
+// Maximum size that sendto will accept.
+constexpr size_t MAX_UDP_SIZE = 65507;
+// Most segments the kernel will accept in a single UDP_SEGMENT send.
+constexpr size_t MAX_GSO_SEGMENTS = 64;
+// Most messages the kernel will accept in a single sendmmsg.
+constexpr size_t MAX_MMSG_MESSAGES = 1024;
+// When pacing, packets go out in batches of this many, and we aim to finish
+// this fraction of the way through the frame interval.
+constexpr size_t PACING_BATCH = 8;
+constexpr double PACING_FRACTION = 0.75;
+
+NetOutput::NetOutput(VideoOptions const *options)
+	: Output(options), payload_size_(options->udp_payload), gso_(false), frames_(0), packets_(0), syscalls_(0),
+	  send_time_(0), max_send_time_(0)
 {
 	char protocol[4];
 	int start, end, a, b, c, d, port;
@@ -32,6 +50,20 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 		saddr_ptr_ = (const sockaddr *)&saddr_; // sendto needs these for udp
 		sockaddr_in_size_ = sizeof(sockaddr_in);
+
+#ifdef UDP_SEGMENT
+		// With the segment size set on the socket, the kernel splits any larger
+		// send into payload-sized packets for us. It's only worth it if several
+		// packets fit in one send.
+		if (options->udp_gso && payload_size_ * 2 <= MAX_UDP_SIZE)
+		{
+			int segment_size = payload_size_;
+			gso_ = setsockopt(fd_, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) == 0;
+		}
+#endif
+		if (options->verbose)
+			std::cerr << "NetOutput: udp payload " << payload_size_ << " bytes, sending with "
+					  << (gso_ ? "UDP_SEGMENT" : "sendmmsg") << std::endl;
 	}
 	else if (strcmp(protocol, "tcp") == 0)
 	{
@@ -97,22 +129,117 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 NetOutput::~NetOutput()
 {
 	close(fd_);
-}
 
-// Maximum size that sendto will accept.
-constexpr size_t MAX_UDP_SIZE = 65507;
+	if (options_->verbose && syscalls_)
+		std::cerr << "NetOutput: sent " << packets_ << " packets in " << syscalls_ << " system calls ("
+				  << (double)packets_ / syscalls_ << " per call), send time per frame "
+				  << send_time_.count() * 1000 / frames_ << "ms average, " << max_send_time_.count() * 1000
+				  << "ms max" << std::endl;
+}
 
 void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
 {
 	if (options_->verbose)
 		std::cerr << "NetOutput: output buffer " << mem << " size " << size << "\n";
-	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
-	for (uint8_t *ptr = (uint8_t *)mem; size;)
+
+	if (!saddr_ptr_)
 	{
-		size_t bytes_to_send = std::min(size, max_size);
-		if (sendto(fd_, ptr, bytes_to_send, 0, saddr_ptr_, sockaddr_in_size_) < 0)
+		if (sendto(fd_, mem, size, 0, saddr_ptr_, sockaddr_in_size_) < 0)
 			throw std::runtime_error("failed to send data on socket");
-		ptr += bytes_to_send;
-		size -= bytes_to_send;
+		return;
+	}
+
+	auto start_time = std::chrono::steady_clock::now();
+	auto start_send_time = send_time_;
+	uint8_t *ptr = (uint8_t *)mem;
+	size_t num_packets = (size + payload_size_ - 1) / payload_size_;
+
+	if (options_->udp_pacing && options_->framerate > 0 && num_packets > PACING_BATCH)
+	{
+		// Send evenly spaced batches of packets, so that a big keyframe doesn't
+		// hit the network (and the receiver's socket buffer) in a single burst.
+		size_t num_batches = (num_packets + PACING_BATCH - 1) / PACING_BATCH;
+		std::chrono::duration<double> batch_interval(PACING_FRACTION / options_->framerate / num_batches);
+		for (size_t i = 0; size; i++)
+		{
+			std::this_thread::sleep_until(
+				start_time + std::chrono::duration_cast<std::chrono::steady_clock::duration>(i * batch_interval));
+			size_t bytes = std::min(size, PACING_BATCH * payload_size_);
+			sendPackets(ptr, bytes);
+			ptr += bytes;
+			size -= bytes;
+		}
+	}
+	else
+		sendPackets(ptr, size);
+
+	frames_++;
+	max_send_time_ = std::max(max_send_time_, send_time_ - start_send_time);
+}
+
+void NetOutput::sendPackets(uint8_t *ptr, size_t size)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	while (gso_ && size)
+	{
+		// The kernel turns each send into as many payload-sized packets as it holds.
+		size_t bytes = std::min(size, std::min(MAX_UDP_SIZE / payload_size_, MAX_GSO_SEGMENTS) * payload_size_);
+		if (sendto(fd_, ptr, bytes, 0, saddr_ptr_, sockaddr_in_size_) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			// The route may not support segmentation offload after all (EIO), or
+			// the payload may be larger than the MTU (EINVAL).
+			if (errno != EIO && errno != EINVAL)
+				throw std::runtime_error("failed to send data on socket");
+			std::cerr << "NetOutput: UDP_SEGMENT send failed, falling back to sendmmsg" << std::endl;
+#ifdef UDP_SEGMENT
+			int segment_size = 0;
+			setsockopt(fd_, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size));
+#endif
+			gso_ = false;
+			break;
+		}
+		packets_ += (bytes + payload_size_ - 1) / payload_size_;
+		syscalls_++;
+		ptr += bytes;
+		size -= bytes;
 	}
+
+	if (size)
+	{
+		size_t num_packets = (size + payload_size_ - 1) / payload_size_;
+		msgs_.resize(num_packets);
+		iovecs_.resize(num_packets);
+		for (size_t i = 0; i < num_packets; i++)
+		{
+			size_t offset = i * payload_size_;
+			iovecs_[i].iov_base = ptr + offset;
+			iovecs_[i].iov_len = std::min(payload_size_, size - offset);
+			msgs_[i] = {};
+			msgs_[i].msg_hdr.msg_name = (void *)saddr_ptr_;
+			msgs_[i].msg_hdr.msg_namelen = sockaddr_in_size_;
+			msgs_[i].msg_hdr.msg_iov = &iovecs_[i];
+			msgs_[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		// sendmmsg may send fewer messages than we asked, so keep going until
+		// they've all gone.
+		for (size_t sent = 0; sent < num_packets;)
+		{
+			int ret = sendmmsg(fd_, &msgs_[sent], std::min<size_t>(num_packets - sent, MAX_MMSG_MESSAGES), 0);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw std::runtime_error("failed to send data on socket");
+			}
+			sent += ret;
+			packets_ += ret;
+			syscalls_++;
+		}
+	}
+
+	send_time_ += std::chrono::steady_clock::now() - start_time;
 }
@@ -8,6 +8,10 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <vector>
 
 #include "output.hpp"
 
@@ -21,8 +25,23 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	// Send whole UDP packets in as few system calls as we can, using a single
+	// UDP_SEGMENT (GSO) send where the kernel supports it, otherwise sendmmsg.
+	void sendPackets(uint8_t *ptr, size_t size);
+
 	int fd_;
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+	size_t payload_size_;
+	bool gso_;
+	std::vector<mmsghdr> msgs_;
+	std::vector<iovec> iovecs_;
+
+	// Statistics, reported when we finish.
+	unsigned int frames_;
+	uint64_t packets_;
+	uint64_t syscalls_;
+	std::chrono::duration<double> send_time_;
+	std::chrono::duration<double> max_send_time_;
 };
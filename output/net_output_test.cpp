@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * net_output_test.cpp - send frames to ourselves over UDP and check that they arrive intact.
+ */
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/video_options.hpp"
+#include "output/net_output.hpp"
+
+// NetOutput adds no framing of its own, so joining the datagrams back together should give us
+// exactly what we sent. Loopback doesn't reorder them, but it does drop them if the socket
+// buffer overflows, so we read them as they arrive.
+
+static void receive(int fd, std::vector<uint8_t> &data, std::vector<size_t> &sizes, std::atomic<bool> &done)
+{
+	std::vector<uint8_t> buf(65536);
+	pollfd p = { fd, POLLIN, 0 };
+	// Carry on until the sender has finished and nothing more has turned up for a while.
+	while (poll(&p, 1, 200) > 0 || !done)
+	{
+		if (!(p.revents & POLLIN))
+			continue;
+		ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+		if (n < 0)
+			break;
+		data.insert(data.end(), buf.begin(), buf.begin() + n);
+		sizes.push_back(n);
+	}
+}
+
+// A fixed seed, so every run sends the same frames.
+static std::mt19937 rng(2021);
+
+static unsigned int failures = 0;
+
+static void run(unsigned int payload, bool gso, bool pacing)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		throw std::runtime_error("unable to open udp socket");
+	sockaddr_in saddr = {};
+	socklen_t saddr_size = sizeof(saddr);
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (sockaddr *)&saddr, sizeof(saddr)) < 0 || getsockname(fd, (sockaddr *)&saddr, &saddr_size) < 0)
+		throw std::runtime_error("failed to bind udp socket");
+	// Ask for plenty of room; the kernel may give us less.
+	int rcvbuf = 4 << 20;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	std::string output = "udp://127.0.0.1:" + std::to_string(ntohs(saddr.sin_port));
+	std::string payload_arg = std::to_string(payload);
+	char const *argv[] = { "net_output_test", "--output",	output.c_str(), "--udp-payload", payload_arg.c_str(),
+						   "--udp-gso",		  gso ? "1" : "0", "--udp-pacing", pacing ? "1" : "0" };
+	VideoOptions options;
+	options.Parse(sizeof(argv) / sizeof(argv[0]), const_cast<char **>(argv));
+
+	// Every tenth frame is a big keyframe, to make many packets and several system calls. The
+	// others are sizes that do and don't divide into whole packets.
+	std::vector<uint8_t> sent_data, data;
+	std::vector<size_t> sent_sizes, sizes;
+	std::atomic<bool> done(false);
+	std::thread receiver(receive, fd, std::ref(data), std::ref(sizes), std::ref(done));
+	{
+		NetOutput net_output(&options);
+		for (unsigned int i = 0; i < 30; i++)
+		{
+			size_t size = i % 10 == 0 ? 300000 : i % 3 == 0 ? 2 * payload : 1000 + rng() % 20000;
+			std::vector<uint8_t> frame(size);
+			for (auto &b : frame)
+				b = rng();
+			net_output.OutputReady(frame.data(), size, i * 33333, i % 10 == 0);
+
+			sent_data.insert(sent_data.end(), frame.begin(), frame.end());
+			for (size_t offset = 0; offset < size; offset += payload)
+				sent_sizes.push_back(std::min<size_t>(size - offset, payload));
+		}
+	}
+	done = true;
+	receiver.join();
+	close(fd);
+
+	std::string name =
+		"payload " + payload_arg + (gso ? ", UDP_SEGMENT allowed" : ", sendmmsg only") + (pacing ? ", paced" : "");
+	std::cout << name << ": received " << sizes.size() << " of " << sent_sizes.size() << " packets, " << data.size()
+			  << " of " << sent_data.size() << " bytes" << std::endl;
+
+	if (sizes != sent_sizes)
+	{
+		std::cerr << "FAIL: " << name << " didn't split the frames into the expected packets" << std::endl;
+		failures++;
+	}
+	if (data != sent_data)
+	{
+		std::cerr << "FAIL: " << name << " didn't give back the frames that were sent" << std::endl;
+		failures++;
+	}
+}
+
+int main()
+{
+	for (bool gso : { true, false })
+	{
+		for (bool pacing : { false, true })
+			run(1472, gso, pacing);
+	}
+	// Packets too big for UDP_SEGMENT to help, so sendmmsg is used anyway.
+	run(65507, true, false);
+
+	if (failures)
+	{
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "All checks passed" << std::endl;
+	return 0;
+}
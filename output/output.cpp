@@ -10,6 +10,7 @@
 
 #include "circular_output.hpp"
 #include "file_output.hpp"
+#include "mkv_output.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
 
@@ -74,6 +75,9 @@ Output *Output::Create(VideoOptions const *options)
 		return new NetOutput(options);
 	else if (options->circular)
 		return new CircularOutput(options);
+	else if (options->output.size() > 4 &&
+			 strcasecmp(options->output.c_str() + options->output.size() - 4, ".mkv") == 0)
+		return new MkvOutput(options);
 	else if (!options->output.empty())
 		return new FileOutput(options);
 	else
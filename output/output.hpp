@@ -21,6 +21,8 @@ public:
 	Output(VideoOptions const *options);
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
+	// Write out anything still pending once the encoder has stopped, throwing if that fails.
+	virtual void Finish() {}
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
 
 protected:
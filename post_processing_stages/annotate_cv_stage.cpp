@@ -7,8 +7,25 @@
 
 // The text string can include the % directives supported by FrameInfo.
 
+// Drawing text with OpenCV every frame is fairly slow, so we render each character once
+// into a cache of glyph masks, and build a mask for the whole string out of those. When
+// the text changes (usually just a few digits of the frame number, say) only the changed
+// characters need redrawing in the mask. Then we just blend the background and text
+// colours into the image over the text rectangle.
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+
 #include <libcamera/stream.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "core/frame_info.hpp"
 #include "core/libcamera_app.hpp"
 
@@ -24,7 +41,7 @@ using Stream = libcamera::Stream;
 class AnnotateCvStage : public PostProcessingStage
 {
 public:
-	AnnotateCvStage(LibcameraApp *app) : PostProcessingStage(app) {}
+	AnnotateCvStage(LibcameraApp *app) : PostProcessingStage(app), stream_(nullptr) {}
 
 	char const *Name() const override;
 
@@ -34,7 +51,20 @@ public:
 
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	ReloadFn Reload(boost::property_tree::ptree const &params) override;
+
+	bool HasRowKernel() const override;
+
+	RowKernel GetRowKernel(CompletedRequestPtr &completed_request) override;
+
 private:
+	void setupFont();
+	Mat const &getGlyph(char c);
+	void drawGlyphs(int x0, int x1);
+	void updateMask(std::string const &text);
+	void updateText(CompletedRequestPtr &completed_request);
+	void blend(uint8_t *ptr, int stride, int width, int height, int fg, int bg, int subsample);
+
 	Stream *stream_;
 	StreamInfo info_;
 	std::string text_;
@@ -43,12 +73,26 @@ private:
 	double scale_;
 	int thickness_;
 	double alpha_;
+	bool blend_uv_;
 	double adjusted_scale_;
 	int adjusted_thickness_;
+	// Each glyph is drawn with this much space around it for the stroke thickness.
+	int pad_;
+	int text_height_;
+	int baseline_;
+	std::map<char, Mat> glyphs_;
+	// The mask for the text we last drew, and the position of each of its characters.
+	std::string mask_text_;
+	std::vector<int> positions_;
+	Size text_size_;
+	Mat mask_;
+	std::mutex mutex_;
 };
 
 #define NAME "annotate_cv"
 
+static constexpr int FONT = FONT_HERSHEY_SIMPLEX;
+
 char const *AnnotateCvStage::Name() const
 {
 	return NAME;
@@ -57,11 +101,12 @@ char const *AnnotateCvStage::Name() const
 void AnnotateCvStage::Read(boost::property_tree::ptree const &params)
 {
 	text_ = params.get<std::string>("text");
-	fg_ = params.get<int>("fg", 255);
-	bg_ = params.get<int>("bg", 0);
+	fg_ = std::clamp(params.get<int>("fg", 255), 0, 255);
+	bg_ = std::clamp(params.get<int>("bg", 0), 0, 255);
 	scale_ = params.get<double>("scale", 1.0);
 	thickness_ = params.get<int>("thickness", 2);
-	alpha_ = params.get<double>("alpha", 0.5);
+	alpha_ = std::clamp(params.get<double>("alpha", 0.5), 0.0, 1.0);
+	blend_uv_ = params.get<int>("blend_uv", 0);
 }
 
 void AnnotateCvStage::Configure()
@@ -71,41 +116,271 @@ void AnnotateCvStage::Configure()
 		throw std::runtime_error("AnnotateCvStage: only YUV420 format supported");
 	info_ = app_->GetStreamInfo(stream_);
 
+	setupFont();
+}
+
+void AnnotateCvStage::setupFont()
+{
 	// Adjust the scale and thickness according to the image size, so that the relative
 	// size is preserved across different camera modes. Note that the thickness can get
 	// rather harshly quantised, not much we can do about that.
 	adjusted_scale_ = scale_ * info_.width / 1200;
 	adjusted_thickness_ = std::max(thickness_ * info_.width / 700, 1u);
+
+	// The text height doesn't depend on the characters in it.
+	pad_ = adjusted_thickness_;
+	baseline_ = 0;
+	text_height_ = getTextSize(" ", FONT, adjusted_scale_, adjusted_thickness_, &baseline_).height;
+
+	glyphs_.clear();
+	mask_text_.clear();
+	mask_ = Mat();
 }
 
-bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
+ReloadFn AnnotateCvStage::Reload(boost::property_tree::ptree const &params)
+{
+	// Reading the parameters can't fail part way through if it has already worked once.
+	AnnotateCvStage(app_).Read(params);
+
+	return [this, params]() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		Read(params);
+		if (stream_)
+			setupFont();
+	};
+}
+
+Mat const &AnnotateCvStage::getGlyph(char c)
+{
+	auto it = glyphs_.find(c);
+	if (it != glyphs_.end())
+		return it->second;
+
+	std::string str(1, c);
+	int baseline = 0;
+	Size size = getTextSize(str, FONT, adjusted_scale_, adjusted_thickness_, &baseline);
+	Mat glyph = Mat::zeros(text_height_ + baseline_ + pad_, size.width + 2 * pad_, CV_8U);
+	putText(glyph, str, Point(pad_, text_height_), FONT, adjusted_scale_, 255, adjusted_thickness_, 0);
+	return glyphs_[c] = glyph;
+}
+
+// Redraw the columns x0 to x1 of the mask from the glyphs that overlap them.
+
+void AnnotateCvStage::drawGlyphs(int x0, int x1)
+{
+	x0 = std::max(x0, 0);
+	x1 = std::min(x1, mask_.cols);
+	if (x0 >= x1)
+		return;
+	mask_.colRange(x0, x1).setTo(0);
+	for (unsigned int i = 0; i < mask_text_.size(); i++)
+	{
+		Mat const &glyph = getGlyph(mask_text_[i]);
+		int left = positions_[i] - pad_;
+		int from = std::max(left, x0), to = std::min(left + glyph.cols, x1);
+		if (from >= to)
+			continue;
+		Mat dest = mask_.colRange(from, to);
+		cv::max(dest, glyph.colRange(from - left, to - left), dest);
+	}
+}
+
+void AnnotateCvStage::updateMask(std::string const &text)
+{
+	if (text == mask_text_ && !mask_.empty())
+		return;
+
+	// Each character goes where OpenCV would have put it, drawing the string in one go.
+	int baseline = 0;
+	Size size = getTextSize(text, FONT, adjusted_scale_, adjusted_thickness_, &baseline);
+	std::vector<int> positions(text.size());
+	for (unsigned int i = 1; i < text.size(); i++)
+		positions[i] = getTextSize(text.substr(0, i), FONT, adjusted_scale_, adjusted_thickness_, &baseline).width -
+					   adjusted_thickness_;
+
+	std::string old_text = mask_text_;
+	mask_text_ = text;
+	text_size_ = Size(size.width, text_height_ + baseline_);
+
+	// A wider last character would change the size of the mask, so needs a new one too.
+	if (positions == positions_ && !mask_.empty() && size.width + pad_ == mask_.cols)
+	{
+		// Everything is in the same place, so we need only redraw the characters that changed.
+		for (unsigned int i = 0; i < text.size(); i++)
+		{
+			if (text[i] != old_text[i])
+			{
+				int left = positions_[i] - pad_;
+				drawGlyphs(left, left + getGlyph(text[i]).cols);
+				drawGlyphs(left, left + getGlyph(old_text[i]).cols);
+			}
+		}
+		return;
+	}
+
+	positions_ = positions;
+	mask_ = Mat::zeros(text_height_ + baseline_ + pad_, size.width + pad_, CV_8U);
+	drawGlyphs(0, mask_.cols);
+}
+
+// Blend the background colour over the text rectangle, and the foreground colour wherever
+// the mask says, in row y of one plane of the image. For the chroma planes, the mask gets
+// subsampled. All the arithmetic fits in 16 bits, so 8 or 16 pixels go at a time.
+
+static void blend_row(uint8_t *ptr, int y, int width, Mat const &mask, Size text_size, int alpha, int fg, int bg,
+					  int subsample)
+{
+	if (y >= mask.rows / subsample)
+		return;
+
+	if (y < text_size.height / subsample)
+	{
+		int rect_width = std::min(text_size.width / subsample, width);
+		int x = 0;
+#if defined(__ARM_NEON)
+		uint16x8_t a = vdupq_n_u16(256 - alpha), b = vdupq_n_u16(bg * alpha + 128);
+		for (; x + 16 <= rect_width; x += 16)
+		{
+			uint8x16_t p = vld1q_u8(ptr + x);
+			uint16x8_t lo = vshrq_n_u16(vmlaq_u16(b, vmovl_u8(vget_low_u8(p)), a), 8);
+			uint16x8_t hi = vshrq_n_u16(vmlaq_u16(b, vmovl_u8(vget_high_u8(p)), a), 8);
+			vst1q_u8(ptr + x, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+		}
+#elif defined(__SSE2__)
+		__m128i zero = _mm_setzero_si128(), a = _mm_set1_epi16(256 - alpha), b = _mm_set1_epi16(bg * alpha + 128);
+		auto mix = [a, b](__m128i p) { return _mm_srli_epi16(_mm_add_epi16(b, _mm_mullo_epi16(p, a)), 8); };
+		for (; x + 16 <= rect_width; x += 16)
+		{
+			__m128i p = _mm_loadu_si128((__m128i const *)(ptr + x));
+			p = _mm_packus_epi16(mix(_mm_unpacklo_epi8(p, zero)), mix(_mm_unpackhi_epi8(p, zero)));
+			_mm_storeu_si128((__m128i *)(ptr + x), p);
+		}
+#endif
+		for (; x < rect_width; x++)
+			ptr[x] = (bg * alpha + (256 - alpha) * ptr[x] + 128) >> 8;
+	}
+
+	// This is (fg * m + value * (255 - m)) / 255, rounded.
+	uint8_t const *mask_row = mask.ptr<uint8_t>(y * subsample);
+	int mask_width = std::min(mask.cols / subsample, width);
+	int x = 0;
+#if defined(__ARM_NEON)
+	uint16x8_t fg16 = vdupq_n_u16(fg), max = vdupq_n_u16(255), round = vdupq_n_u16(128);
+	auto mix = [fg16, max, round](uint16x8_t p, uint16x8_t m) {
+		uint16x8_t t = vaddq_u16(vmlaq_u16(vmulq_u16(fg16, m), p, vsubq_u16(max, m)), round);
+		return vmovn_u16(vshrq_n_u16(vsraq_n_u16(t, t, 8), 8));
+	};
+	for (; subsample <= 2 && x + 16 <= mask_width; x += 16)
+	{
+		uint8x16_t p = vld1q_u8(ptr + x);
+		uint8x16_t m = subsample == 1 ? vld1q_u8(mask_row + x) : vld2q_u8(mask_row + 2 * x).val[0];
+		uint8x8_t lo = mix(vmovl_u8(vget_low_u8(p)), vmovl_u8(vget_low_u8(m)));
+		uint8x8_t hi = mix(vmovl_u8(vget_high_u8(p)), vmovl_u8(vget_high_u8(m)));
+		vst1q_u8(ptr + x, vcombine_u8(lo, hi));
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128(), fg16 = _mm_set1_epi16(fg), max = _mm_set1_epi16(255),
+			round = _mm_set1_epi16(128), even = _mm_set1_epi16(0xff);
+	auto mix = [fg16, max, round](__m128i p, __m128i m) {
+		__m128i t = _mm_add_epi16(_mm_mullo_epi16(fg16, m), _mm_mullo_epi16(p, _mm_sub_epi16(max, m)));
+		t = _mm_add_epi16(t, round);
+		return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+	};
+	for (; subsample <= 2 && x + 16 <= mask_width; x += 16)
+	{
+		__m128i p = _mm_loadu_si128((__m128i const *)(ptr + x)), m_lo, m_hi;
+		if (subsample == 1)
+		{
+			__m128i m = _mm_loadu_si128((__m128i const *)(mask_row + x));
+			m_lo = _mm_unpacklo_epi8(m, zero), m_hi = _mm_unpackhi_epi8(m, zero);
+		}
+		else
+		{
+			m_lo = _mm_and_si128(_mm_loadu_si128((__m128i const *)(mask_row + 2 * x)), even);
+			m_hi = _mm_and_si128(_mm_loadu_si128((__m128i const *)(mask_row + 2 * x + 16)), even);
+		}
+		p = _mm_packus_epi16(mix(_mm_unpacklo_epi8(p, zero), m_lo), mix(_mm_unpackhi_epi8(p, zero), m_hi));
+		_mm_storeu_si128((__m128i *)(ptr + x), p);
+	}
+#endif
+	for (; x < mask_width; x++)
+	{
+		int m = mask_row[x * subsample];
+		int t = fg * m + ptr[x] * (255 - m) + 128;
+		ptr[x] = (t + (t >> 8)) >> 8;
+	}
+}
+
+void AnnotateCvStage::blend(uint8_t *ptr, int stride, int width, int height, int fg, int bg, int subsample)
+{
+	int alpha = std::lround(alpha_ * 256);
+	int mask_height = std::min(mask_.rows / subsample, height);
+	for (int y = 0; y < mask_height; y++, ptr += stride)
+		blend_row(ptr, y, width, mask_, text_size_, alpha, fg, bg, subsample);
+}
+
+// Called with the lock held.
+
+void AnnotateCvStage::updateText(CompletedRequestPtr &completed_request)
 {
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
 	FrameInfo info(completed_request->metadata);
 	info.sequence = completed_request->sequence;
 
 	// Other post-processing stages can supply metadata to update the text.
 	completed_request->post_process_metadata.Get("annotate.text", text_);
-	std::string text = info.ToString(text_);
+	updateMask(info.ToString(text_));
+}
 
-	uint8_t *ptr = (uint8_t *)buffer.data();
-	Mat im(info_.height, info_.width, CV_8U, ptr, info_.stride);
-	int font = FONT_HERSHEY_SIMPLEX;
+bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
+{
+	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
 
-	int baseline = 0;
-	Size size = getTextSize(text, font, adjusted_scale_, adjusted_thickness_, &baseline);
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	updateText(completed_request);
+
+	uint8_t *ptr = (uint8_t *)buffer.data();
+	blend(ptr, info_.stride, info_.width, info_.height, fg_, bg_, 1);
 
-	// Can't find a handy "draw rectangle with alpha" function...
-	for (int y = 0; y < size.height + baseline; y++, ptr += info_.stride)
+	// Optionally take the colour out of the text rectangle too.
+	if (blend_uv_)
 	{
-		for (int x = 0; x < size.width; x++)
-			ptr[x] = bg_ * alpha_ + (1 - alpha_) * ptr[x];
+		int stride2 = info_.stride / 2, width2 = info_.width / 2, height2 = info_.height / 2;
+		uint8_t *U = ptr + info_.stride * info_.height, *V = U + stride2 * height2;
+		blend(U, stride2, width2, height2, 128, 128, 2);
+		blend(V, stride2, width2, height2, 128, 128, 2);
 	}
-	putText(im, text, Point(0, size.height), font, adjusted_scale_, fg_, adjusted_thickness_, 0);
 
 	return false;
 }
 
+bool AnnotateCvStage::HasRowKernel() const
+{
+	return true;
+}
+
+// The kernel gets its own copy of the mask, which is small, so that the next request can
+// go ahead and change ours.
+
+RowKernel AnnotateCvStage::GetRowKernel(CompletedRequestPtr &completed_request)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	updateText(completed_request);
+
+	return [mask = mask_.clone(), text_size = text_size_, alpha = (int)std::lround(alpha_ * 256), fg = fg_, bg = bg_,
+			blend_uv = blend_uv_](ImageRow &row) {
+		if (row.y >= (unsigned int)mask.rows)
+			return;
+		blend_row(row.Y, row.y, row.width, mask, text_size, alpha, fg, bg, 1);
+		if (blend_uv && row.U)
+		{
+			blend_row(row.U, row.y / 2, row.width / 2, mask, text_size, alpha, 128, 128, 2);
+			blend_row(row.V, row.y / 2, row.width / 2, mask, text_size, alpha, 128, 128, 2);
+		}
+	};
+}
+
 static PostProcessingStage *Create(LibcameraApp *app)
 {
 	return new AnnotateCvStage(app);
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * cadence.cpp - decide which frames to run an expensive detector on
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+
+#include "post_processing_stages/cadence.hpp"
+
+using namespace std::chrono_literals;
+
+// How quickly the smoothed measurements follow new ones.
+static constexpr double SMOOTHING = 0.1;
+
+static void smooth(double &value, double measurement)
+{
+	value = value ? value + SMOOTHING * (measurement - value) : measurement;
+}
+
+Cadence::Cadence()
+	: fixed_rate_(5), cpu_share_(0), latency_target_us_(0), min_rate_(1), max_rate_(30), refresh_rate_(5)
+{
+	Reset();
+}
+
+void Cadence::Read(boost::property_tree::ptree const &params)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	fixed_rate_ = params.get<unsigned int>("refresh_rate", 5);
+	cpu_share_ = params.get<double>("cpu_share", 0);
+	latency_target_us_ = params.get<double>("latency_target", 0) * 1000;
+	min_rate_ = std::max(params.get<unsigned int>("min_refresh_rate", 1), 1u);
+	max_rate_ = std::max(params.get<unsigned int>("max_refresh_rate", 30), min_rate_);
+	update();
+}
+
+void Cadence::Reset()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	frame_time_us_ = run_time_us_ = latency_us_ = 0;
+	started_ = false;
+	last_sequence_ = last_run_ = 0;
+	load_ = 0;
+	update();
+}
+
+bool Cadence::Due(unsigned int sequence)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto now = std::chrono::steady_clock::now();
+
+	// Frames may be processed concurrently, so can turn up slightly out of order.
+	if (started_ && sequence <= last_sequence_)
+		return false;
+	if (started_)
+		smooth(frame_time_us_, std::chrono::duration<double, std::micro>(now - last_time_).count() /
+								   (sequence - last_sequence_));
+	bool first = !started_;
+	started_ = true;
+	last_sequence_ = sequence;
+	last_time_ = now;
+
+	if (!refresh_rate_)
+		return false;
+	if (!cpu_share_ && !latency_target_us_)
+		return sequence % refresh_rate_ == 0;
+	if (!first && sequence - last_run_ < refresh_rate_)
+		return false;
+	last_run_ = sequence;
+	return true;
+}
+
+void Cadence::Finished(std::chrono::steady_clock::duration run_time, std::chrono::steady_clock::duration latency)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	smooth(run_time_us_, std::chrono::duration<double, std::micro>(run_time).count());
+	smooth(latency_us_, std::chrono::duration<double, std::micro>(latency).count());
+
+	auto now = std::chrono::steady_clock::now();
+	if (now - last_load_time_ > 1s)
+	{
+		double loadavg;
+		if (getloadavg(&loadavg, 1) == 1)
+			load_ = loadavg / std::max(std::thread::hardware_concurrency(), 1u);
+		last_load_time_ = now;
+	}
+
+	update();
+}
+
+unsigned int Cadence::RefreshRate() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return refresh_rate_;
+}
+
+// Called with the lock held.
+void Cadence::update()
+{
+	if ((!cpu_share_ && !latency_target_us_) || !fixed_rate_)
+	{
+		refresh_rate_ = fixed_rate_;
+		return;
+	}
+	// Until we've measured something, start from the fixed rate.
+	if (!frame_time_us_ || !run_time_us_)
+	{
+		refresh_rate_ = std::clamp(fixed_rate_, min_rate_, max_rate_);
+		return;
+	}
+
+	// Handing over frames faster than the detector gets through them only makes them wait.
+	double frames_per_run = run_time_us_ / frame_time_us_;
+	double rate = std::ceil(frames_per_run);
+	if (cpu_share_)
+		rate = std::max(rate, std::ceil(frames_per_run / cpu_share_));
+	// Results get as old as the latency plus the time until the next ones, so that limits how
+	// long we can wait between runs. A CPU share, if there is one, takes precedence.
+	if (latency_target_us_)
+		rate = std::max(rate, std::floor((latency_target_us_ - latency_us_) / frame_time_us_));
+	// Give the rest of the system a chance if it's overloaded.
+	if (load_ > 1)
+		rate = std::ceil(rate * load_);
+
+	refresh_rate_ = std::clamp<double>(rate, min_rate_, max_rate_);
+}
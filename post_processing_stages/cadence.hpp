@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * cadence.hpp - decide which frames to run an expensive detector on
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+
+#include <boost/property_tree/ptree.hpp>
+
+// Detectors and neural networks run on one frame in every "refresh_rate". Normally that's
+// fixed, but if we're given a "cpu_share" (the fraction of the time the detector may be
+// busy) or a "latency_target" (in milliseconds, how old the results may get before they're
+// replaced) we measure how long each run takes, and how often frames arrive, and choose the
+// refresh rate to fit, between "min_refresh_rate" and "max_refresh_rate". If the whole
+// system is overloaded, we back off further.
+
+class Cadence
+{
+public:
+	Cadence();
+	void Read(boost::property_tree::ptree const &params);
+	// Forget what we've measured, for when the camera is reconfigured.
+	void Reset();
+	// Call this for every frame; it says whether to run the detector on this one.
+	bool Due(unsigned int sequence);
+	// Report how long a run took, and its latency from when the frame arrived.
+	void Finished(std::chrono::steady_clock::duration run_time, std::chrono::steady_clock::duration latency);
+	// How many frames there currently are between runs (0 for never).
+	unsigned int RefreshRate() const;
+
+private:
+	void update();
+
+	mutable std::mutex mutex_;
+	unsigned int fixed_rate_;
+	double cpu_share_;
+	double latency_target_us_;
+	unsigned int min_rate_, max_rate_;
+
+	unsigned int refresh_rate_;
+	// Smoothed measurements, zero until we have them.
+	double frame_time_us_;
+	double run_time_us_;
+	double latency_us_;
+	bool started_;
+	unsigned int last_sequence_;
+	std::chrono::steady_clock::time_point last_time_;
+	unsigned int last_run_;
+	std::chrono::steady_clock::time_point last_load_time_;
+	double load_; // load average per CPU
+};
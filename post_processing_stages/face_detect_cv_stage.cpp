@@ -17,7 +17,9 @@
 
 #include "core/libcamera_app.hpp"
 
+#include "post_processing_stages/cadence.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
+#include "post_processing_stages/tracker.hpp"
 
 #include "opencv2/imgproc.hpp"
 #include "opencv2/objdetect.hpp"
@@ -43,7 +45,7 @@ public:
 
 private:
 	void detectFeatures(cv::CascadeClassifier &cascade);
-	void drawFeatures(cv::Mat &img);
+	void drawFeatures(cv::Mat &img, std::vector<cv::Rect> const &faces);
 
 	Stream *stream_;
 	StreamInfo low_res_info_;
@@ -52,15 +54,18 @@ private:
 	std::unique_ptr<std::future<void>> future_ptr_;
 	std::mutex face_mutex_;
 	std::mutex future_ptr_mutex_;
+	DerivedImagePtr grey_;
 	Mat image_;
 	std::vector<cv::Rect> faces_;
+	bool new_faces_;
+	Tracker tracker_;
 	CascadeClassifier cascade_;
 	std::string cascadeName_;
 	double scaling_factor_;
 	int min_neighbors_;
 	int min_size_;
 	int max_size_;
-	int refresh_rate_;
+	Cadence cadence_;
 	int draw_features_;
 };
 
@@ -81,8 +86,9 @@ void FaceDetectCvStage::Read(boost::property_tree::ptree const &params)
 	min_neighbors_ = params.get<int>("min_neighbors", 3);
 	min_size_ = params.get<int>("min_size", 32);
 	max_size_ = params.get<int>("max_size", 256);
-	refresh_rate_ = params.get<int>("refresh_rate", 5);
+	cadence_.Read(params);
 	draw_features_ = params.get<int>("draw_features", 1);
+	tracker_.Read(params);
 }
 
 void FaceDetectCvStage::Configure()
@@ -108,6 +114,11 @@ void FaceDetectCvStage::Configure()
 	full_stream_info_ = app_->GetStreamInfo(full_stream_);
 	if (draw_features_ && full_stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("FaceDetectCvStage: drawing only supported for YUV420 images");
+
+	faces_.clear();
+	new_faces_ = false;
+	tracker_.Configure(full_stream_info_, low_res_info_);
+	cadence_.Reset();
 }
 
 bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
@@ -117,32 +128,63 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 
 	{
 		std::unique_lock<std::mutex> lck(future_ptr_mutex_);
-		if (completed_request->sequence % refresh_rate_ == 0 &&
-			(!future_ptr_ || future_ptr_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+		if ((!future_ptr_ || future_ptr_->wait_for(std::chrono::seconds(0)) == std::future_status::ready) &&
+			cadence_.Due(completed_request->sequence))
 		{
-			libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
-			uint8_t *ptr = (uint8_t *)buffer.data();
-			Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
-			image_ = image.clone();
+			auto handed_over = std::chrono::steady_clock::now();
+			grey_ = GetDerivedImage(completed_request, stream_, DerivedImages::GREY);
 
 			future_ptr_ = std::make_unique<std::future<void>>();
-			*future_ptr_ = std::async(std::launch::async, [this] { detectFeatures(cascade_); });
+			*future_ptr_ = std::async(std::launch::async, [this, handed_over] {
+				auto start_time = std::chrono::steady_clock::now();
+				detectFeatures(cascade_);
+				auto end_time = std::chrono::steady_clock::now();
+				cadence_.Finished(end_time - start_time, end_time - handed_over);
+			});
 		}
 	}
 
 	std::unique_lock<std::mutex> lock(face_mutex_);
 
+	std::vector<Rect> faces;
+	if (tracker_.Enabled())
+	{
+		// Move the faces on to this frame, giving each a stable id.
+		if (new_faces_)
+		{
+			std::vector<Tracker::Object> objects;
+			for (auto const &r : faces_)
+				objects.push_back({ 0, 0, 1.0f, libcamera::Rectangle(r.x, r.y, r.width, r.height) });
+			tracker_.Update(objects);
+			new_faces_ = false;
+		}
+
+		DerivedImagePtr lores = GetDerivedImage(completed_request, stream_, DerivedImages::GREY);
+		tracker_.Advance(completed_request->sequence, lores->data.data());
+
+		std::vector<unsigned int> ids;
+		for (auto const &object : tracker_.Objects())
+		{
+			faces.emplace_back(object.box.x, object.box.y, object.box.width, object.box.height);
+			ids.push_back(object.id);
+		}
+		completed_request->post_process_metadata.Set("detected_faces.ids", ids);
+	}
+	else
+		faces = faces_;
+
 	std::vector<libcamera::Rectangle> temprect;
-	std::transform(faces_.begin(), faces_.end(), std::back_inserter(temprect),
+	std::transform(faces.begin(), faces.end(), std::back_inserter(temprect),
 				   [](Rect &r) { return libcamera::Rectangle(r.x, r.y, r.width, r.height); });
 	completed_request->post_process_metadata.Set("detected_faces", temprect);
+	completed_request->post_process_metadata.Set(NAME ".refresh_rate", cadence_.RefreshRate());
 
 	if (draw_features_)
 	{
 		libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[full_stream_])[0];
 		uint8_t *ptr = (uint8_t *)buffer.data();
 		Mat image(full_stream_info_.height, full_stream_info_.width, CV_8U, ptr, full_stream_info_.stride);
-		drawFeatures(image);
+		drawFeatures(image, faces);
 	}
 
 	return false;
@@ -150,7 +192,8 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 
 void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
 {
-	equalizeHist(image_, image_);
+	Mat grey(grey_->height, grey_->width, CV_8U, (void *)grey_->data.data(), grey_->stride);
+	equalizeHist(grey, image_);
 
 	std::vector<Rect> temp_faces;
 	cascade.detectMultiScale(image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
@@ -168,18 +211,19 @@ void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
 	}
 	std::unique_lock<std::mutex> lock(face_mutex_);
 	faces_ = std::move(temp_faces);
+	new_faces_ = true;
 }
 
-void FaceDetectCvStage::drawFeatures(Mat &img)
+void FaceDetectCvStage::drawFeatures(Mat &img, std::vector<Rect> const &faces)
 {
 	const static Scalar colors[] = {
 		Scalar(255, 0, 0),	 Scalar(255, 128, 0), Scalar(255, 255, 0), Scalar(0, 255, 0),
 		Scalar(0, 128, 255), Scalar(0, 255, 255), Scalar(0, 0, 255),   Scalar(255, 0, 255)
 	};
 
-	for (size_t i = 0; i < faces_.size(); i++)
+	for (size_t i = 0; i < faces.size(); i++)
 	{
-		Rect r = faces_[i];
+		Rect r = faces[i];
 		Point center;
 		Scalar color = colors[i % 8];
 		int radius;
@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * hdr_lp_filter.cpp - edge-preserving low pass filter for the HDR stage
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "post_processing_stages/hdr_lp_filter.hpp"
+
+// One direction of the IIR low pass filter. Each output pixel depends only on the row
+// before it (in the direction of travel) and the pixel before it in the same row, so
+// we just keep the last few rows of filtered values rather than a whole image. In the
+// reverse direction (dir = -1) we run from the bottom right corner up to the top left.
+// Several threads can work on a pass at once, taking rows in turn, as each one needs
+// only to stay a little behind the thread doing the row before it.
+
+struct LpFilterPass
+{
+	LpFilterPass(int16_t const *in, int width, int height, int dir, int num_threads, LpFilterConfig const &config,
+				 std::vector<double> const &weights, std::vector<double> const &threshold)
+		: in(in), width(width), height(height), dir(dir), num_threads(num_threads), strength(config.strength),
+		  weights(weights), threshold(threshold), rows(num_threads + 1, std::vector<int>(width + 2)),
+		  progress(num_threads + 1)
+	{
+		for (auto &p : progress)
+			p = -1;
+	}
+	void Run(int y_begin, int y_end, int16_t *out, std::vector<uint16_t> &weight_sums, bool combine);
+	void FilterRow(int i, int16_t *out, std::vector<uint16_t> &weight_sums, bool combine);
+
+	int16_t const *in;
+	int width;
+	int height;
+	int dir;
+	int num_threads;
+	double strength;
+	std::vector<double> const &weights;
+	std::vector<double> const &threshold;
+	// Filtered values of the rows being worked on, with a zero at each end so that we
+	// needn't check the image edges. The recurrence only ever used the integer part of
+	// these values. Row i (counting in the direction of travel) goes in rows[i % rows.size()].
+	std::vector<std::vector<int>> rows;
+	// How far each of those rows has got, as i * (width + 1) + number of pixels done.
+	std::vector<std::atomic<int64_t>> progress;
+};
+
+// The weight sums range from strength up to strength + 4, so we can store them as 16-bit
+// fixed point values with room to spare.
+static double weight_sum_scale(double strength)
+{
+	return 65535 / (strength + 4);
+}
+
+// Filter rows y_begin up to (but not including) y_end. The first time through we store
+// the filtered values in out and their weight sums in weight_sums; the second time we
+// combine them with what the other direction stored there.
+
+void LpFilterPass::Run(int y_begin, int y_end, int16_t *out, std::vector<uint16_t> &weight_sums, bool combine)
+{
+	int i_begin = dir > 0 ? y_begin : height - 1 - y_begin;
+	int i_end = dir > 0 ? y_end : height - 1 - y_end;
+	auto filter_rows = [&](int first) {
+		for (int i = first; i < i_end; i += num_threads)
+			FilterRow(i, out, weight_sums, combine);
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 1; t < num_threads; t++)
+		threads.emplace_back(filter_rows, i_begin + t);
+	filter_rows(i_begin);
+	for (auto &thread : threads)
+		thread.join();
+}
+
+void LpFilterPass::FilterRow(int i, int16_t *out, std::vector<uint16_t> &weight_sums, bool combine)
+{
+	// Pixels are done in blocks, after which we tell the next row how far we've got.
+	constexpr int BLOCK = 64;
+	int size = 1;
+	double scale_wt = weight_sum_scale(strength);
+	int num_rows = rows.size();
+	std::vector<int> &cur_row = rows[i % num_rows];
+	std::vector<int> const &prev_row = rows[(i + num_rows - 1) % num_rows];
+	std::atomic<int64_t> &prev_progress = progress[(i + num_rows - 1) % num_rows];
+	int y = dir > 0 ? i : height - 1 - i;
+	// (As before, we don't filter the first rows and columns we encounter.)
+	bool filter_row = i >= size;
+
+	for (int j0 = 0; j0 < width; j0 += BLOCK)
+	{
+		int j1 = std::min(j0 + BLOCK, width);
+		// Each pixel needs the one diagonally ahead of it in the previous row.
+		int64_t needed = (int64_t)(i - 1) * (width + 1) + std::min(j1 + 1, width);
+		while (filter_row && prev_progress.load(std::memory_order_acquire) < needed)
+			std::this_thread::yield();
+
+		for (int j = j0; j < j1; j++)
+		{
+			int x = dir > 0 ? j : width - 1 - j;
+			unsigned int off = y * width + x;
+			double pixel_lp = 0, wt_sum = 0;
+			if (filter_row && j >= size)
+			{
+				int pixel = in[off];
+				double scale = 10 / threshold[pixel];
+				double pixel_wt_sum = pixel * strength;
+				wt_sum = strength;
+
+				// Compiler generates faster code from this:
+				unsigned int p[4], idx[4];
+				double wt[4];
+				p[0] = prev_row[x + 1 - dir];
+				p[1] = prev_row[x + 1];
+				p[2] = prev_row[x + 1 + dir];
+				p[3] = cur_row[x + 1 - dir];
+				idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
+				idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
+				idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
+				idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
+				wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
+				wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
+				wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
+				wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
+				pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
+				wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
+
+				pixel_lp = pixel_wt_sum / wt_sum;
+				cur_row[x + 1] = pixel_lp;
+			}
+
+			if (!combine)
+			{
+				out[off] = pixel_lp + 0.5;
+				weight_sums[off] = wt_sum * scale_wt + 0.5;
+			}
+			else
+			{
+				double other_wt_sum = weight_sums[off] / scale_wt, total_wt_sum = wt_sum + other_wt_sum;
+				// The corners that neither direction reaches just keep the original value.
+				if (total_wt_sum > 0)
+					out[off] = (pixel_lp * wt_sum + out[off] * other_wt_sum) / total_wt_sum;
+				else
+					out[off] = in[off];
+			}
+		}
+
+		progress[i % num_rows].store((int64_t)i * (width + 1) + j1, std::memory_order_release);
+	}
+}
+
+// Low pass IIR filter. We perform a forwards and a reverse pass, finally combining
+// the results to get a smoothed but vaguely edge-preserving version of the
+// accumulator image. You could imagine implementing alternative (more sophisticated)
+// filters.
+// Rather than keep complete images from both passes, the forward pass does the top
+// half and the reverse pass the bottom half (in parallel), each leaving its results
+// in the output image. Then they carry on into the other half, combining their
+// results with those as they go. So we need only a 16-bit weight sum per pixel on
+// top of the output image itself.
+
+void lp_filter(int16_t const *in, int16_t *out, int width, int height, LpFilterConfig const &config)
+{
+	// Cache threshold values, computing them would be slow.
+	std::vector<double> threshold = config.threshold.GenerateLut<double>();
+
+	// Cache values of e^(-x^2) for 0 <= x <= 3, it will be much quicker
+	std::vector<double> weights(31);
+	for (int d = 0; d <= 30; d++)
+		weights[d] = exp(-d * d / 100.0);
+
+	std::vector<uint16_t> weight_sums(width * height);
+
+	// The two passes share the cores between them.
+	int num_threads = std::max<int>(std::thread::hardware_concurrency() / 2, 1);
+	LpFilterPass fwd(in, width, height, 1, num_threads, config, weights, threshold);
+	LpFilterPass rev(in, width, height, -1, num_threads, config, weights, threshold);
+	int mid = height / 2;
+
+	std::thread fwd_pass(&LpFilterPass::Run, &fwd, 0, mid, out, std::ref(weight_sums), false);
+	rev.Run(height - 1, mid - 1, out, weight_sums, false);
+	fwd_pass.join();
+
+	fwd_pass = std::thread(&LpFilterPass::Run, &fwd, mid, height, out, std::ref(weight_sums), true);
+	rev.Run(mid - 1, -1, out, weight_sums, true);
+	fwd_pass.join();
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * hdr_lp_filter.hpp - edge-preserving low pass filter for the HDR stage
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "post_processing_stages/pwl.hpp"
+
+struct LpFilterConfig
+{
+	double strength; // smaller value actually smoothes more
+	Pwl threshold; // defines the level of pixel differences that will be smoothed over
+};
+
+// Smooth the width x height image in to give out, except across edges bigger than the
+// threshold allows for. The threshold is indexed by pixel value, so must cover every value
+// in the image.
+void lp_filter(int16_t const *in, int16_t *out, int width, int height, LpFilterConfig const &config);
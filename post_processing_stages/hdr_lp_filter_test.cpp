@@ -0,0 +1,188 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * hdr_lp_filter_test.cpp - compare the HDR low pass filter with the original version, which
+ * kept whole images of doubles. With --bench, also try a full resolution HQ camera image.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "post_processing_stages/hdr_lp_filter.hpp"
+
+// The original filter, as it was before it was changed to keep only a few rows, except that it
+// gives back the doubles so that we can see where it divided 0 by 0.
+
+static void old_pass(std::vector<double> &pixels, std::vector<double> &weight_sums, int16_t const *in,
+					 std::vector<double> const &weights, std::vector<double> const &threshold, int width, int height,
+					 int size, double strength, int dir)
+{
+	for (int y = size; y < height; y++)
+	{
+		for (int x = size; x < width; x++)
+		{
+			// The reverse pass is the forward one with everything back to front.
+			unsigned int off = dir > 0 ? y * width + x : (height - 1 - y) * width + width - 1 - x;
+			int pixel = in[off];
+			double scale = 10 / threshold[pixel];
+			double pixel_wt_sum = pixel * strength, wt_sum = strength;
+
+			unsigned int p[4], idx[4];
+			double wt[4];
+			p[0] = pixels[off - dir * (width + 1)];
+			p[1] = pixels[off - dir * width];
+			p[2] = pixels[off - dir * (width - 1)];
+			p[3] = pixels[off - dir];
+			for (int i = 0; i < 4; i++)
+			{
+				idx[i] = std::abs(static_cast<int>(p[i]) - pixel) * scale;
+				wt[i] = idx[i] >= weights.size() ? 0.0 : weights[idx[i]];
+			}
+			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
+			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
+
+			pixels[off] = pixel_wt_sum / wt_sum;
+			weight_sums[off] = wt_sum;
+		}
+	}
+}
+
+static std::vector<double> old_lp_filter(int16_t const *in, int width, int height, LpFilterConfig const &config)
+{
+	std::vector<double> threshold = config.threshold.GenerateLut<double>();
+	std::vector<double> weights(31);
+	for (int d = 0; d <= 30; d++)
+		weights[d] = exp(-d * d / 100.0);
+
+	std::vector<double> fwd_pixels(width * height), fwd_weight_sums(width * height);
+	std::vector<double> rev_pixels(width * height), rev_weight_sums(width * height);
+	old_pass(fwd_pixels, fwd_weight_sums, in, weights, threshold, width, height, 1, config.strength, 1);
+	old_pass(rev_pixels, rev_weight_sums, in, weights, threshold, width, height, 1, config.strength, -1);
+
+	std::vector<double> out(width * height);
+	for (int off = 0; off < width * height; off++)
+		out[off] = (fwd_pixels[off] * fwd_weight_sums[off] + rev_pixels[off] * rev_weight_sums[off]) /
+				   (fwd_weight_sums[off] + rev_weight_sums[off]);
+	return out;
+}
+
+// A fixed seed, so every run sees the same pictures.
+static std::mt19937 rng(2021);
+
+// A smooth gradient with some hard edged blocks on it, and noise, like the sum of num_frames
+// 8-bit frames.
+static std::vector<int16_t> make_scene(int width, int height, int num_frames)
+{
+	int max = 256 * num_frames - 1;
+	std::normal_distribution<double> noise(0, 2 * std::sqrt(num_frames));
+	std::vector<int16_t> image(width * height);
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			double v = max * (0.1 + 0.5 * x / width + 0.2 * y / height);
+			if ((x * 8 / width + y * 6 / height) % 3 == 0)
+				v = v * 0.3;
+			image[y * width + x] = std::clamp<int>(v + noise(rng), 0, max);
+		}
+	}
+	return image;
+}
+
+static std::vector<int16_t> make_noise(int width, int height, int num_frames)
+{
+	std::vector<int16_t> image(width * height);
+	for (auto &p : image)
+		p = rng() % (256 * num_frames);
+	return image;
+}
+
+static unsigned int failures = 0;
+
+static void compare(std::string const &name, std::vector<int16_t> const &in, int width, int height, int num_frames,
+					LpFilterConfig const &config)
+{
+	std::vector<int16_t> out(width * height);
+	auto start = std::chrono::high_resolution_clock::now();
+	lp_filter(in.data(), out.data(), width, height, config);
+	std::chrono::duration<double, std::milli> new_time = std::chrono::high_resolution_clock::now() - start;
+
+	start = std::chrono::high_resolution_clock::now();
+	std::vector<double> old = old_lp_filter(in.data(), width, height, config);
+	std::chrono::duration<double, std::milli> old_time = std::chrono::high_resolution_clock::now() - start;
+
+	// The old filter converted its doubles to int16_t, which truncates. Where it had nothing to
+	// divide by, we now keep the input pixel.
+	unsigned int same = 0, undefined = 0, worst = 0;
+	bool kept_input = true;
+	double squares = 0;
+	for (int off = 0; off < width * height; off++)
+	{
+		if (std::isnan(old[off]))
+		{
+			undefined++;
+			kept_input &= out[off] == in[off];
+			continue;
+		}
+		int diff = std::abs(out[off] - static_cast<int16_t>(old[off]));
+		same += diff == 0;
+		worst = std::max<unsigned int>(worst, diff);
+		squares += diff * diff;
+	}
+
+	double peak = 256 * num_frames - 1, mse = squares / (width * height - undefined);
+	std::cout << name << " " << width << "x" << height << ": " << same << " of " << width * height - undefined
+			  << " pixels the same, worst difference " << worst << ", PSNR ";
+	if (mse)
+		std::cout << 10 * std::log10(peak * peak / mse) << " dB";
+	else
+		std::cout << "infinite";
+	std::cout << ", " << undefined << " pixels that were 0/0. Time " << new_time.count() << " ms, was "
+			  << old_time.count() << " ms" << std::endl;
+
+	// The new filter rounds the stored results from the first half of each pass.
+	if (worst > 1)
+	{
+		std::cerr << "FAIL: " << name << " differs by more than 1" << std::endl;
+		failures++;
+	}
+	if (!kept_input)
+	{
+		std::cerr << "FAIL: " << name << " didn't keep the input where the old filter had 0/0" << std::endl;
+		failures++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	// These are the settings in the example HDR and DRC files.
+	LpFilterConfig config;
+	config.strength = 0.2;
+	config.threshold = Pwl({ { 0, 10 }, { 2048, 205 }, { 4095, 205 } });
+
+	static const int sizes[][2] = { { 33, 17 }, { 640, 480 }, { 1333, 999 } };
+	for (auto const &s : sizes)
+	{
+		compare("DRC scene", make_scene(s[0], s[1], 1), s[0], s[1], 1, config);
+		compare("HDR scene", make_scene(s[0], s[1], 16), s[0], s[1], 16, config);
+		compare("HDR noise", make_noise(s[0], s[1], 16), s[0], s[1], 16, config);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "--bench"))
+		compare("HDR scene", make_scene(4056, 3040, 16), 4056, 3040, 16, config);
+
+	if (failures)
+	{
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "All checks passed" << std::endl;
+	return 0;
+}
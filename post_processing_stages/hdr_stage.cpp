@@ -16,12 +16,27 @@
 // HDR will accumulate multiple frames faster without colour denoise, so maybe:
 // libcamera-still -o test.jpg --ev -2 --denoise cdn_off --post-process-file hdr.json
 
+// There's also a much cheaper DRC mode for video (and preview) frames, which works out
+// the low pass image and tone curve on a small image every few frames, and then just
+// applies the resulting gains to every frame. It will use the lores stream if you have
+// one, so maybe:
+// libcamera-vid -o test.h264 --lores-width 320 --lores-height 240 --post-process-file drc_video.json
+
 // Obviously this runs as a post-processing stage on fully-processed 8-bit images. Normally
 // I'd rather do HDR in the raw domain where the signals are still linear, and there are
 // more bits to play with, but clearly that's not possible here. It does mean some of the
 // pixel manipulations, especially when it comes to colour, are a bit random. You have
 // been warned. Enjoy!
 
+#include <memory>
+#include <mutex>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <libcamera/stream.h>
 
 #include "core/libcamera_app.hpp"
@@ -30,18 +45,14 @@
 
 #include "image/image.hpp"
 
+#include "post_processing_stages/hdr_lp_filter.hpp"
 #include "post_processing_stages/histogram.hpp"
+#include "post_processing_stages/parallel_for.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 #include "post_processing_stages/pwl.hpp"
 
 using Stream = libcamera::Stream;
 
-struct LpFilterConfig
-{
-	double strength; // smaller value actually smoothes more
-	Pwl threshold; // defines the level of pixel differences that will be smoothed over
-};
-
 // A TonemapPoint gives a target value within the full dynamic range where we would like
 // the given quantile (actually, inter-quantile mean) in the image's histogram to go.
 // Additionally there are limits to how much the current value can be scaled up or down.
@@ -76,6 +87,13 @@ struct LocalTonemapConfig
 	double colour_scale; // allows colour saturation to be increased or reduced slightly
 };
 
+struct VideoDrcConfig
+{
+	unsigned int period; // recompute the gains every this many frames (0 disables video DRC)
+	double smoothing; // weight given to new gains, so smaller values change more gradually
+	unsigned int downsample; // without a lores stream, shrink the main image by this factor
+};
+
 struct HdrConfig
 {
 	unsigned int num_frames; // number of frames to accumulate
@@ -83,6 +101,7 @@ struct HdrConfig
 	GlobalTonemapConfig global_tonemap; // global tonemap settings
 	LocalTonemapConfig local_tonemap; // settings for adding back local contrast
 	std::string jpeg_filename; // set this if you want individual jpegs saved as well
+	VideoDrcConfig video; // settings for DRC on video frames
 };
 
 struct HdrImage
@@ -105,169 +124,83 @@ struct HdrImage
 	void Scale(double factor);
 };
 
-static void add_Y_pixels(int16_t *dest, uint8_t const *src, int width, int stride, int height)
+// Add a row of 8-bit pixels, less the given offset, into the accumulator.
+
+static void add_pixels(int16_t *dest, uint8_t const *src, int width, int offset)
 {
-	for (int y = 0; y < height; y++, src += stride)
+	int x = 0;
+#if defined(__ARM_NEON)
+	int16x8_t off = vdupq_n_s16(offset);
+	for (; x + 16 <= width; x += 16)
 	{
-		for (int x = 0; x < width; x++)
-			*(dest++) += src[x];
+		uint8x16_t pixels = vld1q_u8(src + x);
+		int16x8_t lo = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(pixels))), off);
+		int16x8_t hi = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(pixels))), off);
+		vst1q_s16(dest + x, vaddq_s16(vld1q_s16(dest + x), lo));
+		vst1q_s16(dest + x + 8, vaddq_s16(vld1q_s16(dest + x + 8), hi));
 	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128(), off = _mm_set1_epi16(offset);
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i pixels = _mm_loadu_si128((__m128i const *)(src + x));
+		__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(pixels, zero), off);
+		__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(pixels, zero), off);
+		__m128i *d = (__m128i *)(dest + x);
+		_mm_storeu_si128(d, _mm_add_epi16(_mm_loadu_si128(d), lo));
+		_mm_storeu_si128(d + 1, _mm_add_epi16(_mm_loadu_si128(d + 1), hi));
+	}
+#endif
+	for (; x < width; x++)
+		dest[x] += src[x] - offset;
 }
 
 // Add the new image buffer to this "accumulator" image. We just add them as
 // we don't have the horsepower to do any fancy alignment or anything.
-// Actually, spreading it across a few threads doesn't seem to help much, though
-// compiling with "gcc -mfpu=neon-fp-armv8 -ftree-vectorize" gives a big
-// improvement.
+// Each core takes a band of rows of the Y and of the (combined) U and V planes.
 
 void HdrImage::Accumulate(uint8_t const *src, int stride)
 {
-	int16_t *dest = &P(0);
 	int width2 = width / 2, stride2 = stride / 2;
-	std::thread thread1(add_Y_pixels, dest, src, width, stride, height);
 
-	dest += width * height;
-	src += stride * height;
+	parallel_for(height, [&](int begin, int end) {
+		for (int y = begin; y < end; y++)
+			add_pixels(&P(y * width), src + y * stride, width, 0);
 
-	// U and V components
-	for (int y = 0; y < height; y++, src += stride2)
-	{
-		for (int x = 0; x < width2; x++)
-			*(dest++) += src[x] - 128;
-	}
+		// U and V components
+		int16_t *dest = &P(width * height);
+		uint8_t const *src_uv = src + stride * height;
+		for (int y = begin; y < end; y++)
+			add_pixels(dest + y * width2, src_uv + y * stride2, width2, 128);
+	});
 
 	dynamic_range += 256;
-
-	thread1.join();
-}
-
-// Forward pass of the IIR low pass filter.
-
-static void forward_pass(std::vector<double> &fwd_pixels, std::vector<double> &fwd_weight_sums, HdrImage const &in,
-						 std::vector<double> &weights, std::vector<double> &threshold, int width, int height, int size,
-						 double strength)
-
-{
-	// (Should probably initialise the top/left elements of fwd_pixels/fwd_weight_sums...)
-	for (int y = size; y < height; y++)
-	{
-		unsigned int off = y * width + size;
-		for (int x = size; x < width; x++, off++)
-		{
-			int pixel = in.P(off);
-			double scale = 10 / threshold[pixel];
-			double pixel_wt_sum = pixel * strength, wt_sum = strength;
-
-			// Compiler generates faster code from this:
-			unsigned int p[4], idx[4];
-			double wt[4];
-			p[0] = fwd_pixels[off - width - 1];
-			p[1] = fwd_pixels[off - width];
-			p[2] = fwd_pixels[off - width + 1];
-			p[3] = fwd_pixels[off - 1];
-			idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
-			idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
-			idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
-			idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
-			wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
-			wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
-			wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
-			wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
-			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
-			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
-
-			fwd_pixels[off] = pixel_wt_sum / wt_sum;
-			fwd_weight_sums[off] = wt_sum;
-		}
-	}
 }
 
-// Low pass IIR filter. We perform a forwards and a reverse pass, finally combining
-// the results to get a smoothed but vaguely edge-preserving version of the
-// accumulator image. You could imagine implementing alternative (more sophisticated)
-// filters.
+// The filter itself lives in hdr_lp_filter.cpp, where it can be tested on its own.
 
 HdrImage HdrImage::LpFilter(LpFilterConfig const &config) const
 {
-	// Cache threshold values, computing them would be slow.
-	std::vector<double> threshold = config.threshold.GenerateLut<double>();
-
-	// Cache values of e^(-x^2) for 0 <= x <= 3, it will be much quicker
-	std::vector<double> weights(31);
-	for (int d = 0; d <= 30; d++)
-		weights[d] = exp(-d * d / 100.0);
-
-	int size = 1;
-	double strength = config.strength;
-
-	// Forward pass.
-	std::vector<double> fwd_weight_sums(width * height);
-	std::vector<double> fwd_pixels(width * height);
-
 	HdrImage out(width, height, width * height);
 	out.dynamic_range = dynamic_range;
-
-	// Run the forward pass in other thread, so that the two passes run in parallel.
-	std::thread fwd_pass(forward_pass, std::ref(fwd_pixels), std::ref(fwd_weight_sums), std::ref(*this),
-						 std::ref(weights), std::ref(threshold), width, height, size, strength);
-
-	// Reverse pass, but otherwise the same as the forward pass. There could be a small
-	// saving in omitting it, but it's not huge given that they run in parallel.
-	std::vector<double> rev_weight_sums(width * height);
-	std::vector<double> rev_pixels(width * height);
-	// (Should probably initialise the bottom/right elements of rev_pixels/rev_weight_sums...)
-	for (int y = height - 1 - size; y >= 0; y--)
-	{
-		unsigned int off = y * width + width - 1 - size;
-		for (int x = width - 1 - size; x >= 0; x--, off--)
-		{
-			int pixel = P(off);
-			double scale = 10 / threshold[pixel];
-			double pixel_wt_sum = pixel * strength, wt_sum = strength;
-
-			// Compiler generates faster code from this:
-			unsigned int p[4], idx[4];
-			double wt[4];
-			p[0] = rev_pixels[off + width + 1];
-			p[1] = rev_pixels[off + width];
-			p[2] = rev_pixels[off + width - 1];
-			p[3] = rev_pixels[off + 1];
-			idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
-			idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
-			idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
-			idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
-			wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
-			wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
-			wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
-			wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
-			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
-			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
-
-			rev_pixels[off] = pixel_wt_sum / wt_sum;
-			rev_weight_sums[off] = wt_sum;
-		}
-	}
-
-	fwd_pass.join();
-
-	// Combine.
-	unsigned int off = 0;
-	for (int y = 0; y < height; y++)
-	{
-		for (int x = 0; x < width; x++, off++)
-			out.P(off) = (fwd_pixels[off] * fwd_weight_sums[off] + rev_pixels[off] * rev_weight_sums[off]) /
-						 (fwd_weight_sums[off] + rev_weight_sums[off]);
-	}
-
+	lp_filter(pixels.data(), out.pixels.data(), width, height, config);
 	return out;
 }
 
+// Each core makes a histogram of its own part of the image, and we add them up at the end.
+
 Histogram HdrImage::CalculateHistogram() const
 {
 	std::vector<uint32_t> bins(dynamic_range);
-	std::fill(bins.begin(), bins.end(), 0);
-	for (int i = 0; i < width * height; i++)
-		bins[P(i)]++;
+	std::mutex bins_mutex;
+	parallel_for(height, [&](int begin, int end) {
+		std::vector<uint32_t> partial_bins(dynamic_range);
+		for (int i = begin * width; i < end * width; i++)
+			partial_bins[P(i)]++;
+		std::lock_guard<std::mutex> lock(bins_mutex);
+		for (int i = 0; i < dynamic_range; i++)
+			bins[i] += partial_bins[i];
+	});
 	return Histogram(&bins[0], dynamic_range);
 }
 
@@ -296,84 +229,183 @@ Pwl HdrImage::CreateTonemap(GlobalTonemapConfig const &config) const
 }
 
 // Tonemap the low pass image according to the global tone curve, and add back the high pass
-// detail (given by the original pixel minus the low pass equivalent).
+// detail (given by the original pixel minus the low pass equivalent). The work is divided
+// between the cores in bands of pairs of rows, as each pair shares a row of U and V.
 
 void HdrImage::Tonemap(HdrImage const &lp, HdrConfig const &config)
 {
 	Pwl tonemap = CreateTonemap(config.global_tonemap);
 
-	// Make LUTs for the all the Pwls, it'll be much quicker.
+	// Make LUTs for the all the Pwls, it'll be much quicker. The local contrast strengths
+	// are held in fixed point (with 12 fractional bits) to keep the per-pixel work integer.
 	std::vector<int> tonemap_lut = tonemap.GenerateLut<int>();
 	std::vector<double> pos_strength_lut = config.local_tonemap.pos_strength.GenerateLut<double>();
 	std::vector<double> neg_strength_lut = config.local_tonemap.neg_strength.GenerateLut<double>();
+	std::vector<int> pos_strength_fixed(pos_strength_lut.size()), neg_strength_fixed(neg_strength_lut.size());
+	for (unsigned int i = 0; i < pos_strength_lut.size(); i++)
+		pos_strength_fixed[i] = std::lround(pos_strength_lut[i] * 4096);
+	for (unsigned int i = 0; i < neg_strength_lut.size(); i++)
+		neg_strength_fixed[i] = std::lround(neg_strength_lut[i] * 4096);
 	double colour_scale = config.local_tonemap.colour_scale;
 
 	int maxval = dynamic_range - 1;
-	for (int y = 0; y < height; y++)
-	{
-		unsigned int off_Y = y * width;
-		unsigned int off_U = y * width / 4 + width * height;
-		unsigned int off_V = off_U + width * height / 4;
-		for (int x = 0; x < width; x++, off_Y++)
+	parallel_for((height + 1) / 2, [&](int begin, int end) {
+		for (int y = begin * 2; y < std::min(end * 2, height); y++)
 		{
-			int Y_lp_orig = lp.P(off_Y), Y_hp = P(off_Y) - Y_lp_orig;
-			int Y_lp_mapped = tonemap_lut[Y_lp_orig];
-			double strength = (Y_hp > 0 ? pos_strength_lut : neg_strength_lut)[Y_lp_orig];
-			int Y_final = std::clamp(Y_lp_mapped + (int)(strength * Y_hp), 0, maxval);
-			P(off_Y) = Y_final;
-			if (!(x & 1) && !(y & 1))
+			unsigned int off_Y = y * width;
+			unsigned int off_U = y * width / 4 + width * height;
+			unsigned int off_V = off_U + width * height / 4;
+			for (int x = 0; x < width; x++, off_Y++)
 			{
-				double f = (Y_final + 1) / (double)(Y_lp_orig + 1);
-				// The values here are non-linear to colours can come out slightly saturated.
-				// The colour_scale allows us to tweak that a little if we want.
-				f = (f - 1) * colour_scale + 1;
-				int U = P(off_U), V = P(off_V);
-				P(off_U) = U * f;
-				P(off_V) = V * f;
-				off_U++, off_V++;
+				int Y_lp_orig = lp.P(off_Y), Y_hp = P(off_Y) - Y_lp_orig;
+				int Y_lp_mapped = tonemap_lut[Y_lp_orig];
+				int strength = (Y_hp > 0 ? pos_strength_fixed : neg_strength_fixed)[Y_lp_orig];
+				int Y_final = std::clamp(Y_lp_mapped + strength * Y_hp / 4096, 0, maxval);
+				P(off_Y) = Y_final;
+				if (!(x & 1) && !(y & 1))
+				{
+					double f = (Y_final + 1) / (double)(Y_lp_orig + 1);
+					// The values here are non-linear to colours can come out slightly saturated.
+					// The colour_scale allows us to tweak that a little if we want.
+					f = (f - 1) * colour_scale + 1;
+					int U = P(off_U), V = P(off_V);
+					P(off_U) = U * f;
+					P(off_V) = V * f;
+					off_U++, off_V++;
+				}
 			}
 		}
-	}
+	});
 }
 
 // Write image back out to 8-bit buffer with given stride.
 
 void HdrImage::Extract(uint8_t *dest, int stride) const
 {
-	double ratio = dynamic_range / 256;
-	const int16_t *Y_ptr = &pixels[0];
-	const int16_t *U_ptr = Y_ptr + width * height, *V_ptr = U_ptr + width * height / 4;
-	uint8_t *dest_y = dest;
-	uint8_t *dest_u = dest_y + stride * height, *dest_v = dest_u + stride * height / 4;
+	// The ratio is always a whole number, so integer division gives the same answers.
+	int ratio = std::max(dynamic_range / 256, 1);
+	// A table is quicker than dividing every Y value.
+	std::vector<uint8_t> Y_lut(dynamic_range);
+	for (int i = 0; i < dynamic_range; i++)
+		Y_lut[i] = std::min(i / ratio, 255);
+	int w = width / 2, h = height / 2, s = stride / 2;
 
-	for (int y = 0; y < height; y++, dest_y += stride)
-	{
-		for (int x = 0; x < width; x++)
-			dest_y[x] = *(Y_ptr++) / ratio;
-	}
+	parallel_for(height, [&](int begin, int end) {
+		const int16_t *Y_ptr = &pixels[begin * width];
+		uint8_t *dest_y = dest + begin * stride;
+		for (int y = begin; y < end; y++, dest_y += stride)
+		{
+			for (int x = 0; x < width; x++)
+				dest_y[x] = Y_lut[std::clamp<int>(*(Y_ptr++), 0, dynamic_range - 1)];
+		}
 
-	int w = width / 2, h = height / 2, s = stride / 2;
-	for (int y = 0; y < h; y++, dest_u += s, dest_v += s)
-	{
-		for (int x = 0; x < w; x++)
+		// Each band of Y rows does the corresponding U and V rows.
+		int begin2 = begin / 2, end2 = end == height ? h : end / 2;
+		const int16_t *U_ptr = &pixels[width * height + begin2 * w], *V_ptr = U_ptr + width * height / 4;
+		uint8_t *dest_u = dest + stride * height + begin2 * s, *dest_v = dest_u + stride * height / 4;
+		for (int y = begin2; y < end2; y++, dest_u += s, dest_v += s)
 		{
-			int U = *(U_ptr++) / ratio;
-			int V = *(V_ptr++) / ratio;
-			dest_u[x] = std::clamp(U + 128, 0, 255);
-			dest_v[x] = std::clamp(V + 128, 0, 255);
+			for (int x = 0; x < w; x++)
+			{
+				int U = *(U_ptr++) / ratio;
+				int V = *(V_ptr++) / ratio;
+				dest_u[x] = std::clamp(U + 128, 0, 255);
+				dest_v[x] = std::clamp(V + 128, 0, 255);
+			}
 		}
-	}
+	});
 }
 
 // Apply simple scaling to all pixels.
 
 void HdrImage::Scale(double factor)
 {
-	for (unsigned int i = 0; i < pixels.size(); i++)
-		pixels[i] *= factor;
+	int num_pixels = pixels.size();
+	parallel_for(num_pixels, [&](int begin, int end) {
+		for (int i = begin; i < end; i++)
+			pixels[i] *= factor;
+	});
 	dynamic_range *= factor;
 }
 
+// Gains for video DRC. The gains are calculated on a coarse grid, but we store them
+// already interpolated horizontally to the width of the image (and, separately, of the
+// chroma planes), as 8.8 fixed point values. Then each image row needs just a blend of
+// two of these rows.
+
+struct VideoGains
+{
+	static constexpr int MAX_GAIN = 16 << 8;
+	int grid_height;
+	std::vector<uint16_t> Y_rows;
+	std::vector<uint16_t> UV_rows;
+};
+
+// Apply a row of gains to a row of Y pixels.
+
+static void apply_Y_gains(uint8_t *row, uint16_t const *gains, int width)
+{
+	int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 8 <= width; x += 8)
+	{
+		uint16x8_t pixels = vmovl_u8(vld1_u8(row + x));
+		uint16x8_t g = vld1q_u16(gains + x);
+		uint32x4_t lo = vmull_u16(vget_low_u16(pixels), vget_low_u16(g));
+		uint32x4_t hi = vmull_u16(vget_high_u16(pixels), vget_high_u16(g));
+		uint16x8_t result = vcombine_u16(vrshrn_n_u32(lo, 8), vrshrn_n_u32(hi, 8));
+		vst1_u8(row + x, vqmovn_u16(result));
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(128);
+	for (; x + 8 <= width; x += 8)
+	{
+		__m128i pixels = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *)(row + x)), zero);
+		__m128i g = _mm_loadu_si128((__m128i const *)(gains + x));
+		__m128i prod_lo = _mm_mullo_epi16(pixels, g), prod_hi = _mm_mulhi_epu16(pixels, g);
+		__m128i lo = _mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi16(prod_lo, prod_hi), round), 8);
+		__m128i hi = _mm_srli_epi32(_mm_add_epi32(_mm_unpackhi_epi16(prod_lo, prod_hi), round), 8);
+		__m128i result = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64((__m128i *)(row + x), _mm_packus_epi16(result, result));
+	}
+#endif
+	for (; x < width; x++)
+		row[x] = std::min((row[x] * gains[x] + 128) >> 8, 255);
+}
+
+// Blend two rows of gains, with weight (out of 256) given to the second.
+
+static void blend_gains(uint16_t *dest, uint16_t const *row0, uint16_t const *row1, int weight, int width)
+{
+	for (int x = 0; x < width; x++)
+		dest[x] = (row0[x] * (256 - weight) + row1[x] * weight + 128) >> 8;
+}
+
+// Find the two grid rows either side of image row y, and the weight of the second one.
+
+static void grid_rows(int y, int height, int grid_height, int &row0, int &row1, int &weight)
+{
+	int pos = ((2 * y + 1) * grid_height * 128) / height - 128; // in 256ths of a grid row
+	pos = std::clamp(pos, 0, (grid_height - 1) * 256);
+	row0 = pos >> 8;
+	row1 = std::min(row0 + 1, grid_height - 1);
+	weight = pos & 255;
+}
+
+// Interpolate a row of grid values across a row of the image, converting to 8.8 fixed point.
+
+static void expand_row(uint16_t *dest, float const *grid_row, int grid_width, int width)
+{
+	for (int x = 0; x < width; x++)
+	{
+		float pos = std::clamp((x + 0.5f) * grid_width / width - 0.5f, 0.0f, grid_width - 1.0f);
+		int i = pos;
+		int j = std::min(i + 1, grid_width - 1);
+		float value = grid_row[i] + (grid_row[j] - grid_row[i]) * (pos - i);
+		dest[x] = std::clamp<int>(std::lround(value * 256), 0, VideoGains::MAX_GAIN);
+	}
+}
+
 class HdrStage : public PostProcessingStage
 {
 public:
@@ -389,13 +421,27 @@ public:
 
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	ReloadFn Reload(boost::property_tree::ptree const &params) override;
+
 private:
+	static void readConfig(HdrConfig &config, boost::property_tree::ptree const &params);
+	void configureVideo();
+	void updateVideoGains(CompletedRequestPtr &completed_request);
+	void applyVideoGains(uint8_t *image, VideoGains const &gains);
+
 	Stream *stream_;
 	StreamInfo info_;
 	HdrConfig config_;
 	unsigned int frame_num_;
 	std::mutex mutex_;
 	HdrImage acc_, lp_;
+	// For video DRC.
+	Stream *video_stream_;
+	StreamInfo video_info_;
+	Stream *lores_stream_;
+	StreamInfo lores_info_;
+	std::vector<float> smoothed_gains_;
+	std::shared_ptr<VideoGains const> video_gains_;
 };
 
 #define NAME "hdr"
@@ -407,36 +453,45 @@ char const *HdrStage::Name() const
 
 void HdrStage::Read(boost::property_tree::ptree const &params)
 {
-	config_.num_frames = params.get<unsigned int>("num_frames");
+	readConfig(config_, params);
+}
+
+void HdrStage::readConfig(HdrConfig &config, boost::property_tree::ptree const &params)
+{
+	config.num_frames = params.get<unsigned int>("num_frames", 1);
 
-	config_.lp_filter.strength = params.get<double>("lp_filter_strength");
-	config_.lp_filter.threshold.Read(params.get_child("lp_filter_threshold"));
+	config.lp_filter.strength = params.get<double>("lp_filter_strength");
+	config.lp_filter.threshold.Read(params.get_child("lp_filter_threshold"));
 
 	for (auto &p : params.get_child("global_tonemap_points"))
 	{
 		TonemapPoint tp;
 		tp.Read(p.second);
-		config_.global_tonemap.points.push_back(tp);
+		config.global_tonemap.points.push_back(tp);
 	}
-	config_.global_tonemap.strength = params.get<double>("global_tonemap_strength");
+	config.global_tonemap.strength = params.get<double>("global_tonemap_strength");
 
 	Pwl pos_strength, neg_strength;
 	pos_strength.Read(params.get_child("local_pos_strength"));
 	neg_strength.Read(params.get_child("local_neg_strength"));
 	double strength = params.get<double>("local_tonemap_strength");
-	config_.local_tonemap.colour_scale = params.get<double>("local_colour_scale");
+	config.local_tonemap.colour_scale = params.get<double>("local_colour_scale");
 
 	// A strength of 1 should give the value in the function; a strength of 0 should give the value 1.
-	pos_strength.Map([this, strength](double x, double y) {
+	pos_strength.Map([&config, strength](double x, double y) {
 		y = y * strength + 1 - strength;
-		config_.local_tonemap.pos_strength.Append(x, y);
+		config.local_tonemap.pos_strength.Append(x, y);
 	});
-	neg_strength.Map([this, strength](double x, double y) {
+	neg_strength.Map([&config, strength](double x, double y) {
 		y = y * strength + 1 - strength;
-		config_.local_tonemap.neg_strength.Append(x, y);
+		config.local_tonemap.neg_strength.Append(x, y);
 	});
 
-	config_.jpeg_filename = params.get<std::string>("jpeg_filename", "");
+	config.jpeg_filename = params.get<std::string>("jpeg_filename", "");
+
+	config.video.period = params.get<unsigned int>("video_period", 0);
+	config.video.smoothing = std::clamp(params.get<double>("video_smoothing", 0.3), 0.0, 1.0);
+	config.video.downsample = std::max(params.get<unsigned int>("video_downsample", 8), 1u);
 }
 
 void HdrStage::AdjustConfig(std::string const &use_case, StreamConfiguration *config)
@@ -449,9 +504,14 @@ void HdrStage::AdjustConfig(std::string const &use_case, StreamConfiguration *co
 
 void HdrStage::Configure()
 {
+	video_stream_ = nullptr;
 	stream_ = app_->StillStream(&info_);
 	if (!stream_)
+	{
+		if (config_.video.period)
+			configureVideo();
 		return;
+	}
 	if (stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("HdrStage: only supports YUV420");
 
@@ -465,7 +525,22 @@ void HdrStage::Configure()
 bool HdrStage::Process(CompletedRequestPtr &completed_request)
 {
 	if (!stream_)
-		return false; // in viewfinder mode, do nothing
+	{
+		// Not capturing stills, so there's only video DRC to do, if that's enabled.
+		Stream *video_stream;
+		std::shared_ptr<VideoGains const> gains;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			video_stream = video_stream_;
+			if (!video_stream)
+				return false;
+			if (!video_gains_ || completed_request->sequence % config_.video.period == 0)
+				updateVideoGains(completed_request);
+			gains = video_gains_;
+		}
+		applyVideoGains(app_->Mmap(completed_request->buffers[video_stream])[0].data(), *gains);
+		return false;
+	}
 
 	std::lock_guard<std::mutex> lock(mutex_);
 
@@ -515,6 +590,159 @@ bool HdrStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
+ReloadFn HdrStage::Reload(boost::property_tree::ptree const &params)
+{
+	HdrConfig config;
+	readConfig(config, params);
+
+	// Video DRC might be turned on, so check now that it would work.
+	Stream *main_stream = app_->GetMainStream();
+	if (!stream_ && config.video.period && main_stream &&
+		main_stream->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("HdrStage: only supports YUV420");
+
+	// New settings apply from the next frame. Anything accumulated so far for a still is kept,
+	// as are the current video gains unless video DRC needs setting up differently.
+	return [this, config = std::move(config)]() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		bool video_changed =
+			config.video.period != config_.video.period || config.video.downsample != config_.video.downsample;
+		config_ = std::move(config);
+		if (!stream_ && video_changed)
+		{
+			video_stream_ = nullptr;
+			if (config_.video.period)
+				configureVideo();
+		}
+	};
+}
+
+void HdrStage::configureVideo()
+{
+	video_stream_ = app_->GetMainStream();
+	if (!video_stream_)
+		return;
+	video_info_ = app_->GetStreamInfo(video_stream_);
+	if (video_stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("HdrStage: only supports YUV420");
+
+	lores_stream_ = app_->LoresStream(&lores_info_);
+	if (lores_stream_ && lores_stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		lores_stream_ = nullptr;
+	if (!lores_stream_)
+	{
+		lores_info_.width = std::max(video_info_.width / config_.video.downsample, 1u);
+		lores_info_.height = std::max(video_info_.height / config_.video.downsample, 1u);
+	}
+
+	smoothed_gains_.clear();
+	video_gains_.reset();
+}
+
+// Work out a fresh set of gains for video DRC. We make a small version of the image
+// (from the lores stream if there is one) and run the same low pass filter and tone
+// curve calculation on it as we would for a still. The gain at each grid point is then
+// what turns the low pass value into its tonemapped value. The local contrast settings
+// aren't used; detail simply gets the same gain as its surroundings.
+
+void HdrStage::updateVideoGains(CompletedRequestPtr &completed_request)
+{
+	int grid_width = lores_info_.width, grid_height = lores_info_.height;
+	HdrImage small(grid_width, grid_height, grid_width * grid_height);
+	small.dynamic_range = 4096;
+
+	if (lores_stream_)
+	{
+		DerivedImagePtr lores = GetDerivedImage(completed_request, lores_stream_, DerivedImages::GREY);
+		for (int y = 0; y < grid_height; y++)
+		{
+			for (int x = 0; x < grid_width; x++)
+				small.P(y * grid_width + x) = lores->data[y * lores->stride + x] << 4;
+		}
+	}
+	else
+	{
+		// Average blocks of the main image's Y plane instead.
+		uint8_t const *src = app_->Mmap(completed_request->buffers[video_stream_])[0].data();
+		int f = config_.video.downsample;
+		std::vector<int> sums(grid_width);
+		for (int y = 0; y < grid_height; y++)
+		{
+			std::fill(sums.begin(), sums.end(), 0);
+			for (int dy = 0; dy < f; dy++)
+			{
+				uint8_t const *row = src + (y * f + dy) * video_info_.stride;
+				for (int x = 0; x < grid_width; x++)
+				{
+					for (int dx = 0; dx < f; dx++)
+						sums[x] += row[x * f + dx];
+				}
+			}
+			for (int x = 0; x < grid_width; x++)
+				small.P(y * grid_width + x) = (sums[x] << 4) / (f * f);
+		}
+	}
+
+	HdrImage lp = small.LpFilter(config_.lp_filter);
+	std::vector<int> tonemap_lut = small.CreateTonemap(config_.global_tonemap).GenerateLut<int>();
+
+	// Smooth the gains over time so that the picture doesn't visibly jump when they change.
+	double smoothing = smoothed_gains_.size() == lp.pixels.size() ? config_.video.smoothing : 1.0;
+	smoothed_gains_.resize(lp.pixels.size());
+	for (unsigned int i = 0; i < lp.pixels.size(); i++)
+	{
+		int Y_lp = lp.P(i);
+		float gain = (tonemap_lut[Y_lp] + 1) / (float)(Y_lp + 1);
+		smoothed_gains_[i] += (gain - smoothed_gains_[i]) * smoothing;
+	}
+
+	std::shared_ptr<VideoGains> gains = std::make_shared<VideoGains>();
+	int width = video_info_.width, width2 = width / 2;
+	gains->grid_height = grid_height;
+	gains->Y_rows.resize(grid_height * width);
+	gains->UV_rows.resize(grid_height * width2);
+	// As for stills, the colours are scaled along with Y, modified by the colour_scale.
+	std::vector<float> colour_gains(grid_width);
+	double colour_scale = config_.local_tonemap.colour_scale;
+	for (int y = 0; y < grid_height; y++)
+	{
+		float const *row = &smoothed_gains_[y * grid_width];
+		expand_row(&gains->Y_rows[y * width], row, grid_width, width);
+		for (int x = 0; x < grid_width; x++)
+			colour_gains[x] = std::max((row[x] - 1) * colour_scale + 1, 0.0);
+		expand_row(&gains->UV_rows[y * width2], &colour_gains[0], grid_width, width2);
+	}
+
+	video_gains_ = gains;
+}
+
+void HdrStage::applyVideoGains(uint8_t *image, VideoGains const &gains)
+{
+	int width = video_info_.width, height = video_info_.height, stride = video_info_.stride;
+	int row0, row1, weight;
+	std::vector<uint16_t> row_gains(width);
+
+	for (int y = 0; y < height; y++)
+	{
+		grid_rows(y, height, gains.grid_height, row0, row1, weight);
+		blend_gains(&row_gains[0], &gains.Y_rows[row0 * width], &gains.Y_rows[row1 * width], weight, width);
+		apply_Y_gains(image + y * stride, &row_gains[0], width);
+	}
+
+	int width2 = width / 2, height2 = height / 2, stride2 = stride / 2;
+	uint8_t *U = image + stride * height, *V = U + stride2 * height2;
+	for (int y = 0; y < height2; y++, U += stride2, V += stride2)
+	{
+		grid_rows(y, height2, gains.grid_height, row0, row1, weight);
+		blend_gains(&row_gains[0], &gains.UV_rows[row0 * width2], &gains.UV_rows[row1 * width2], weight, width2);
+		for (int x = 0; x < width2; x++)
+		{
+			U[x] = std::clamp(128 + (((U[x] - 128) * row_gains[x] + 128) >> 8), 0, 255);
+			V[x] = std::clamp(128 + (((V[x] - 128) * row_gains[x] + 128) >> 8), 0, 255);
+		}
+	}
+}
+
 static PostProcessingStage *Create(LibcameraApp *app)
 {
 	return new HdrStage(app);
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * motion_detect.hpp - motion detector result
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <libcamera/geometry.h>
+
+// The lores image is divided into blocks, and the map records which of them show motion.
+// Coordinates are in lores image pixels.
+
+struct MotionDetectMap
+{
+	unsigned int width; // number of blocks across
+	unsigned int height; // number of blocks down
+	unsigned int block_width;
+	unsigned int block_height;
+	std::vector<uint8_t> blocks; // 1 for each block with motion, row by row
+	std::vector<libcamera::Rectangle> boxes; // bounding boxes of groups of touching blocks with motion
+};
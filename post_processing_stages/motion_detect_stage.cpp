@@ -5,12 +5,14 @@
  * motion_detect_stage.cpp - motion detector
  */
 
-// A simple motion detector. It needs to be given a low resolution image and it
-// compares pixels in the current low res image against the value in the corresponding
-// location in the previous one. If it exceeds a threshold it gets counted as
-// "different". If enough pixels are different, that indicates "motion".
-// A low res image of something like 128x96 is probably more than enough, and you
-// can always subsample with hskip and vksip.
+// A simple motion detector. It needs to be given a low resolution image, which it
+// divides into blocks. For each block it adds up the differences between the pixels
+// in the current low res image and a background image, and if they exceed a threshold
+// the block is counted as "moving". If enough blocks in a region are moving, that
+// indicates "motion". A low res image of something like 320x240 is plenty.
+
+// The background is a running average of the frames we've seen, so slow changes (like
+// the light) get absorbed into it, while anything that moves shows up for a few frames.
 
 // Because this gets run in parallel by the post-processing framework, it means
 // the "previous frame" is not totally guaranteed to be the actual previous one,
@@ -19,11 +21,23 @@
 // The stage adds "motion_detect.result" to the metadata. When this claims motion,
 // the application can take that as true immediately. To be sure there's no motion,
 // an application should probably wait for "a few frames" of "no motion".
+// Additionally, "motion_detect.regions" gives the result for each region separately,
+// and "motion_detect.map" gives the moving blocks and boxes around them (see
+// motion_detect.hpp).
+
+#include <cmath>
 
 #include <libcamera/stream.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "core/libcamera_app.hpp"
 
+#include "post_processing_stages/motion_detect.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 using Stream = libcamera::Stream;
@@ -41,27 +55,43 @@ public:
 
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	ReloadFn Reload(boost::property_tree::ptree const &params) override;
+
 private:
 	// In the Config, dimensions are given as fractions of the lores image size.
-	struct Config
+	struct RegionConfig
 	{
 		float roi_x, roi_y;
 		float roi_width, roi_height;
-		int hskip, vskip;
+		float region_threshold; // fraction of the blocks in the region that must be moving
+	};
+	struct Config
+	{
+		std::vector<RegionConfig> regions;
+		unsigned int block_width, block_height;
 		float difference_m;
 		int difference_c;
-		float region_threshold;
+		float background_weight;
 		int frame_period;
 		bool verbose;
 	} config_;
+	// Here we convert each region to a range of blocks.
+	struct Region
+	{
+		unsigned int x0, y0, x1, y1;
+		unsigned int threshold;
+	};
+	void readConfig(Config &config, boost::property_tree::ptree const &params);
+	void setupBlocks();
+	void findBoxes(MotionDetectMap &map) const;
 	Stream *stream_;
-	unsigned lores_stride_;
-	// Here we convert the dimensions to pixel locations in the lores image, as if subsampled
-	// by hskip and vskip.
-	unsigned int roi_x_, roi_y_;
-	unsigned int roi_width_, roi_height_;
-	unsigned int region_threshold_;
-	std::vector<uint8_t> previous_frame_;
+	StreamInfo info_;
+	std::vector<Region> regions_;
+	unsigned int blocks_x_, blocks_y_;
+	// The background image as 8.8 fixed point values, and rounded to 8 bits.
+	std::vector<uint16_t> background_;
+	std::vector<uint8_t> background8_;
+	std::vector<uint32_t> block_sad_, block_sum_;
 	bool first_time_;
 	bool motion_detected_;
 	std::mutex mutex_;
@@ -74,80 +104,221 @@ char const *MotionDetectStage::Name() const
 	return NAME;
 }
 
+static void read_region(boost::property_tree::ptree const &params, float &roi_x, float &roi_y, float &roi_width,
+						float &roi_height, float &region_threshold)
+{
+	roi_x = params.get<float>("roi_x", 0.0);
+	roi_y = params.get<float>("roi_y", 0.0);
+	roi_width = params.get<float>("roi_width", 1.0);
+	roi_height = params.get<float>("roi_height", 1.0);
+	region_threshold = params.get<float>("region_threshold", 0.005);
+}
+
 void MotionDetectStage::Read(boost::property_tree::ptree const &params)
 {
-	config_.roi_x = params.get<float>("roi_x", 0.0);
-	config_.roi_y = params.get<float>("roi_y", 0.0);
-	config_.roi_width = params.get<float>("roi_width", 1.0);
-	config_.roi_height = params.get<float>("roi_height", 1.0);
-	config_.hskip = params.get<int>("hskip", 1);
-	config_.vskip = params.get<int>("vskip", 1);
-	config_.difference_m = params.get<float>("difference_m", 0.1);
-	config_.difference_c = params.get<int>("difference_c", 10);
-	config_.region_threshold = params.get<float>("region_threshold", 0.005);
-	config_.frame_period = params.get<int>("frame_period", 5);
-	config_.verbose = params.get<int>("verbose", 0);
+	readConfig(config_, params);
+}
+
+void MotionDetectStage::readConfig(Config &config, boost::property_tree::ptree const &params)
+{
+	// Either give a list of regions, or just the one region at the top level.
+	config.regions.clear();
+	if (params.get_child_optional("regions"))
+	{
+		for (auto &p : params.get_child("regions"))
+		{
+			RegionConfig r;
+			read_region(p.second, r.roi_x, r.roi_y, r.roi_width, r.roi_height, r.region_threshold);
+			config.regions.push_back(r);
+		}
+	}
+	else
+	{
+		RegionConfig r;
+		read_region(params, r.roi_x, r.roi_y, r.roi_width, r.roi_height, r.region_threshold);
+		config.regions.push_back(r);
+	}
+	config.block_width = params.get<unsigned int>("block_width", 16);
+	config.block_height = params.get<unsigned int>("block_height", 16);
+	config.difference_m = params.get<float>("difference_m", 0.1);
+	config.difference_c = params.get<int>("difference_c", 10);
+	config.background_weight = params.get<float>("background_weight", 0.25);
+	config.frame_period = params.get<int>("frame_period", 5);
+	config.verbose = params.get<int>("verbose", 0);
 }
 
 void MotionDetectStage::Configure()
 {
-	StreamInfo info;
-	stream_ = app_->LoresStream(&info);
+	stream_ = app_->LoresStream(&info_);
 	if (!stream_)
 		return;
 
-	config_.hskip = std::max(config_.hskip, 1);
-	config_.vskip = std::max(config_.vskip, 1);
-	info.width /= config_.hskip;
-	info.height /= config_.vskip;
-	lores_stride_ = info.stride * config_.vskip;
-
-	// Turn fractions of the lores image into actual pixel numbers. Store them as if in
-	// an image subsampled by hskip and vskip.
-	roi_x_ = config_.roi_x * info.width;
-	roi_y_ = config_.roi_y * info.height;
-	roi_width_ = config_.roi_width * info.width;
-	roi_height_ = config_.roi_height * info.height;
-	region_threshold_ = config_.region_threshold * roi_width_ * roi_height_;
-
-	roi_x_ = std::clamp(roi_x_, 0u, info.width);
-	roi_y_ = std::clamp(roi_y_, 0u, info.height);
-	roi_width_ = std::clamp(roi_width_, 0u, info.width - roi_x_);
-	roi_height_ = std::clamp(roi_height_, 0u, info.height - roi_y_);
-	region_threshold_ = std::clamp(region_threshold_, 0u, roi_width_ * roi_height_);
-
-	if (config_.verbose)
-		std::cerr << "Lores: " << info.width << "x" << info.height << " roi: (" << roi_x_ << "," << roi_y_ << ") "
-				  << roi_width_ << "x" << roi_height_ << " threshold: " << region_threshold_ << std::endl;
-
-	previous_frame_.resize(roi_width_ * roi_height_);
+	setupBlocks();
+
+	background_.resize(info_.width * info_.height);
+	background8_.resize(info_.width * info_.height);
 	first_time_ = true;
 	motion_detected_ = false;
 }
 
+// Work out the blocks and regions. The background image doesn't depend on these, so they can
+// change without starting again.
+
+void MotionDetectStage::setupBlocks()
+{
+	config_.block_width = std::clamp(config_.block_width, 1u, info_.width);
+	config_.block_height = std::clamp(config_.block_height, 1u, info_.height);
+	config_.background_weight = std::clamp(config_.background_weight, 0.0f, 1.0f);
+	// Any partial blocks at the right and bottom edges are ignored.
+	blocks_x_ = info_.width / config_.block_width;
+	blocks_y_ = info_.height / config_.block_height;
+
+	// Turn fractions of the lores image into ranges of blocks.
+	regions_.clear();
+	for (auto &r : config_.regions)
+	{
+		Region region;
+		region.x0 = std::clamp<int>(std::lround(r.roi_x * blocks_x_), 0, blocks_x_);
+		region.y0 = std::clamp<int>(std::lround(r.roi_y * blocks_y_), 0, blocks_y_);
+		region.x1 = std::clamp<int>(std::lround((r.roi_x + r.roi_width) * blocks_x_), region.x0, blocks_x_);
+		region.y1 = std::clamp<int>(std::lround((r.roi_y + r.roi_height) * blocks_y_), region.y0, blocks_y_);
+		unsigned int num_blocks = (region.x1 - region.x0) * (region.y1 - region.y0);
+		region.threshold = std::max<unsigned int>(std::ceil(r.region_threshold * num_blocks), 1);
+		regions_.push_back(region);
+
+		if (config_.verbose)
+			std::cerr << "Lores: " << info_.width << "x" << info_.height << " blocks: " << blocks_x_ << "x"
+					  << blocks_y_ << " region: (" << region.x0 << "," << region.y0 << ") to (" << region.x1 << ","
+					  << region.y1 << ") threshold: " << region.threshold << std::endl;
+	}
+
+	block_sad_.resize(blocks_x_ * blocks_y_);
+	block_sum_.resize(blocks_x_ * blocks_y_);
+}
+
+ReloadFn MotionDetectStage::Reload(boost::property_tree::ptree const &params)
+{
+	Config config;
+	readConfig(config, params);
+
+	return [this, config = std::move(config)]() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		config_ = std::move(config);
+		if (stream_)
+			setupBlocks();
+	};
+}
+
+// Return the sum of absolute differences between two rows of pixels, and the sum of
+// the background pixels.
+
+static void row_sad(uint8_t const *cur, uint8_t const *bg, unsigned int n, uint32_t &sad, uint32_t &sum)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	auto add_lanes = [](uint16x8_t v) {
+		uint64x2_t v64 = vpaddlq_u32(vpaddlq_u16(v));
+		return (uint32_t)(vgetq_lane_u64(v64, 0) + vgetq_lane_u64(v64, 1));
+	};
+	uint16x8_t sad16 = vdupq_n_u16(0), sum16 = vdupq_n_u16(0);
+	// Each 16-bit lane gains at most 510 per iteration, so can't overflow within 128 of them.
+	for (unsigned int count = 0; x + 16 <= n; x += 16)
+	{
+		uint8x16_t c = vld1q_u8(cur + x), b = vld1q_u8(bg + x);
+		sad16 = vpadalq_u8(sad16, vabdq_u8(c, b));
+		sum16 = vpadalq_u8(sum16, b);
+		if (++count == 128)
+		{
+			sad += add_lanes(sad16);
+			sum += add_lanes(sum16);
+			sad16 = sum16 = vdupq_n_u16(0);
+			count = 0;
+		}
+	}
+	sad += add_lanes(sad16);
+	sum += add_lanes(sum16);
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128(), sad64 = zero, sum64 = zero;
+	for (; x + 16 <= n; x += 16)
+	{
+		__m128i c = _mm_loadu_si128((__m128i const *)(cur + x)), b = _mm_loadu_si128((__m128i const *)(bg + x));
+		sad64 = _mm_add_epi64(sad64, _mm_sad_epu8(c, b));
+		sum64 = _mm_add_epi64(sum64, _mm_sad_epu8(b, zero));
+	}
+	sad += _mm_cvtsi128_si32(sad64) + _mm_cvtsi128_si32(_mm_srli_si128(sad64, 8));
+	sum += _mm_cvtsi128_si32(sum64) + _mm_cvtsi128_si32(_mm_srli_si128(sum64, 8));
+#endif
+	for (; x < n; x++)
+	{
+		sad += std::abs(cur[x] - bg[x]);
+		sum += bg[x];
+	}
+}
+
+// Group the moving blocks that touch (including diagonally), and record the bounding box of each group.
+
+void MotionDetectStage::findBoxes(MotionDetectMap &map) const
+{
+	std::vector<uint8_t> visited(map.blocks.size());
+	std::vector<unsigned int> stack;
+	for (unsigned int i = 0; i < map.blocks.size(); i++)
+	{
+		if (!map.blocks[i] || visited[i])
+			continue;
+		unsigned int x0 = i % map.width, x1 = x0, y0 = i / map.width, y1 = y0;
+		visited[i] = 1;
+		stack.push_back(i);
+		while (!stack.empty())
+		{
+			unsigned int j = stack.back(), x = j % map.width, y = j / map.width;
+			stack.pop_back();
+			x0 = std::min(x0, x), x1 = std::max(x1, x), y0 = std::min(y0, y), y1 = std::max(y1, y);
+			for (unsigned int ny = y ? y - 1 : 0; ny <= std::min(y + 1, map.height - 1); ny++)
+			{
+				for (unsigned int nx = x ? x - 1 : 0; nx <= std::min(x + 1, map.width - 1); nx++)
+				{
+					unsigned int k = ny * map.width + nx;
+					if (map.blocks[k] && !visited[k])
+					{
+						visited[k] = 1;
+						stack.push_back(k);
+					}
+				}
+			}
+		}
+		map.boxes.emplace_back(x0 * map.block_width, y0 * map.block_height, (x1 - x0 + 1) * map.block_width,
+							   (y1 - y0 + 1) * map.block_height);
+	}
+}
+
 bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 {
 	if (!stream_)
 		return false;
 
+	// We need to protect access to first_time_, the background and motion_detected_, and
+	// the configuration can be reloaded at any time.
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (config_.frame_period && completed_request->sequence % config_.frame_period)
 		return false;
 
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
-	uint8_t *image = buffer.data();
-
-	// We need to protect access to first_time_, previous_frame_ and motion_detected_.
-	std::lock_guard<std::mutex> lock(mutex_);
+	// Other stages may well want the same copy of the lores image, in cached memory.
+	DerivedImagePtr frame = GetDerivedImage(completed_request, stream_, DerivedImages::GREY);
+	uint8_t const *image = frame->data.data();
+	unsigned int width = info_.width, height = info_.height;
 
 	if (first_time_)
 	{
 		first_time_ = false;
-		for (unsigned int y = 0; y < roi_height_; y++)
+		for (unsigned int y = 0; y < height; y++)
 		{
-			uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
-			uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
-			for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
-				*(old_value_ptr++) = *new_value_ptr;
+			uint8_t const *row = image + y * frame->stride;
+			for (unsigned int x = 0; x < width; x++)
+			{
+				background_[y * width + x] = row[x] << 8;
+				background8_[y * width + x] = row[x];
+			}
 		}
 
 		completed_request->post_process_metadata.Set("motion_detect.result", motion_detected_);
@@ -155,22 +326,60 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
+	// Add up the differences from the background over each block.
+	std::fill(block_sad_.begin(), block_sad_.end(), 0);
+	std::fill(block_sum_.begin(), block_sum_.end(), 0);
+	unsigned int bw = config_.block_width, bh = config_.block_height;
+	for (unsigned int y = 0; y < blocks_y_ * bh; y++)
+	{
+		uint8_t const *row = image + y * frame->stride;
+		uint8_t const *bg_row = &background8_[y * width];
+		uint32_t *sad = &block_sad_[(y / bh) * blocks_x_], *sum = &block_sum_[(y / bh) * blocks_x_];
+		for (unsigned int bx = 0; bx < blocks_x_; bx++)
+			row_sad(row + bx * bw, bg_row + bx * bw, bw, sad[bx], sum[bx]);
+	}
+
+	// A block is moving if its pixels differ from the background by more than difference_m
+	// times the background level plus difference_c, on average.
+	MotionDetectMap map;
+	map.width = blocks_x_;
+	map.height = blocks_y_;
+	map.block_width = bw;
+	map.block_height = bh;
+	map.blocks.resize(blocks_x_ * blocks_y_);
+	uint32_t c = config_.difference_c * bw * bh;
+	for (unsigned int i = 0; i < map.blocks.size(); i++)
+		map.blocks[i] = block_sad_[i] > config_.difference_m * block_sum_[i] + c;
+
 	bool motion_detected = false;
-	unsigned int regions = 0;
+	std::vector<bool> region_results;
+	for (auto &r : regions_)
+	{
+		unsigned int moving = 0;
+		for (unsigned int y = r.y0; y < r.y1; y++)
+		{
+			for (unsigned int x = r.x0; x < r.x1; x++)
+				moving += map.blocks[y * blocks_x_ + x];
+		}
+		bool region_motion = r.x1 > r.x0 && r.y1 > r.y0 && moving >= r.threshold;
+		region_results.push_back(region_motion);
+		motion_detected |= region_motion;
+	}
+	findBoxes(map);
 
-	// Count the lores pixels where the difference between the new and previous values
-	// exceeds the threshold. At the same time, update the previous image buffer.
-	for (unsigned int y = 0; y < roi_height_; y++)
+	// Blend the new image into the background, with a weight of background_weight (in
+	// 8.8 fixed point, like the background itself).
+	int weight = std::lround(config_.background_weight * 256);
+	for (unsigned int y = 0; y < height; y++)
 	{
-		uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
-		uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
-		for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
+		uint8_t const *row = image + y * frame->stride;
+		uint16_t *bg = &background_[y * width];
+		uint8_t *bg8 = &background8_[y * width];
+		for (unsigned int x = 0; x < width; x++)
 		{
-			int new_value = *new_value_ptr;
-			int old_value = *old_value_ptr;
-			*(old_value_ptr++) = new_value;
-			regions += std::abs(new_value - old_value) > config_.difference_m * old_value + config_.difference_c;
-			motion_detected = regions >= region_threshold_;
+			int value = bg[x] + ((((int)row[x] << 8) - bg[x]) * weight >> 8);
+			bg[x] = value;
+			bg8[x] = (value + 128) >> 8;
 		}
 	}
 
@@ -179,6 +388,8 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 
 	motion_detected_ = motion_detected;
 	completed_request->post_process_metadata.Set("motion_detect.result", motion_detected);
+	completed_request->post_process_metadata.Set("motion_detect.regions", region_results);
+	completed_request->post_process_metadata.Set("motion_detect.map", std::move(map));
 
 	return false;
 }
@@ -5,6 +5,7 @@
  * negate_stage.cpp - image negate effect
  */
 
+#include <libcamera/formats.h>
 #include <libcamera/stream.h>
 
 #include "core/libcamera_app.hpp"
@@ -26,8 +27,13 @@ public:
 
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	bool HasRowKernel() const override;
+
+	RowKernel GetRowKernel(CompletedRequestPtr &completed_request) override;
+
 private:
 	Stream *stream_;
+	bool yuv420_;
 };
 
 #define NAME "negate"
@@ -40,6 +46,7 @@ char const *NegateStage::Name() const
 void NegateStage::Configure()
 {
 	stream_ = app_->GetMainStream();
+	yuv420_ = stream_ && app_->GetStreamInfo(stream_).pixel_format == libcamera::formats::YUV420;
 }
 
 bool NegateStage::Process(CompletedRequestPtr &completed_request)
@@ -54,6 +61,32 @@ bool NegateStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
+bool NegateStage::HasRowKernel() const
+{
+	return yuv420_;
+}
+
+static void negate_row(uint8_t *ptr, unsigned int n)
+{
+	unsigned int x = 0;
+	for (; x + 4 <= n; x += 4)
+		*(uint32_t *)(ptr + x) ^= 0xffffffff;
+	for (; x < n; x++)
+		ptr[x] ^= 0xff;
+}
+
+RowKernel NegateStage::GetRowKernel(CompletedRequestPtr &)
+{
+	return [](ImageRow &row) {
+		negate_row(row.Y, row.width);
+		if (row.U)
+		{
+			negate_row(row.U, row.width / 2);
+			negate_row(row.V, row.width / 2);
+		}
+	};
+}
+
 static PostProcessingStage *Create(LibcameraApp *app)
 {
 	return new NegateStage(app);
@@ -0,0 +1,240 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * object_cascade_tf_stage.cpp - classify detected objects at full resolution
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "image/image_kernels.hpp"
+
+#include "object_detect.hpp"
+#include "tf_stage.hpp"
+
+using Rectangle = libcamera::Rectangle;
+
+// This stage runs after the object_detect_tf stage. Rather than classifying the whole lores
+// image, it takes each object the detector found, crops it from the main image where it has
+// plenty of pixels, and classifies all the crops together in a single batch.
+
+constexpr int WIDTH = 224;
+constexpr int HEIGHT = 224;
+
+struct ObjectCascadeTfConfig : public TfConfig
+{
+	unsigned int max_objects;
+	float padding;
+	float threshold;
+};
+
+#define NAME "object_cascade_tf"
+
+class ObjectCascadeTfStage : public TfStage
+{
+public:
+	ObjectCascadeTfStage(LibcameraApp *app) : TfStage(app, WIDTH, HEIGHT), batch_size_(1)
+	{
+		config_ = std::make_unique<ObjectCascadeTfConfig>();
+	}
+	char const *Name() const override { return NAME; }
+
+protected:
+	ObjectCascadeTfConfig *config() const { return static_cast<ObjectCascadeTfConfig *>(config_.get()); }
+
+	// Read the label file and the cropping parameters.
+	void readExtras(boost::property_tree::ptree const &params) override;
+
+	ReloadFn reloadExtras(boost::property_tree::ptree const &params) override;
+
+	void checkConfiguration() override;
+
+	bool needsLores() const override { return false; }
+
+	// Crop the detected objects from the main image.
+	bool copyInput(CompletedRequestPtr &completed_request, Input &input) override;
+
+	// Put the crops into the input tensor as a batch.
+	void fillInput(Input const &input) override;
+
+	// Find the most likely class for each object.
+	void interpretOutputs() override;
+
+	// Attach the results as metadata.
+	void applyResults(CompletedRequestPtr &completed_request) override;
+
+private:
+	void readLabelsFile(const std::string &file_name);
+
+	std::vector<std::string> labels_;
+	std::vector<Detection> batch_; // the objects being classified
+	unsigned int batch_size_;
+	std::vector<Detection> output_results_;
+};
+
+void ObjectCascadeTfStage::readExtras(boost::property_tree::ptree const &params)
+{
+	config()->max_objects = params.get<unsigned int>("max_objects", 4);
+	config()->padding = params.get<float>("padding", 0.1);
+	config()->threshold = params.get<float>("threshold", 0.2);
+	if (config()->max_objects == 0)
+		throw std::runtime_error("ObjectCascadeTfStage: max_objects must be at least 1");
+
+	std::string labels_file = params.get<std::string>("labels_file", "/home/pi/models/labels.txt");
+	readLabelsFile(labels_file);
+
+	int output = interpreter_->outputs()[0];
+	TfLiteIntArray *output_dims = interpreter_->tensor(output)->dims;
+	// Causes might include loading the wrong model, or the wrong labels file.
+	if (output_dims->data[output_dims->size - 1] != static_cast<int>(labels_.size()))
+		throw std::runtime_error("ObjectCascadeTfStage: Label count mismatch");
+}
+
+ReloadFn ObjectCascadeTfStage::reloadExtras(boost::property_tree::ptree const &params)
+{
+	// The crops are cut out on the camera's threads without the output lock, so only the
+	// threshold can change here.
+	if (params.get<unsigned int>("max_objects", 4) != config()->max_objects ||
+		params.get<float>("padding", 0.1) != config()->padding)
+		return {};
+	float threshold = params.get<float>("threshold", 0.2);
+	return [this, threshold]() { config()->threshold = threshold; };
+}
+
+void ObjectCascadeTfStage::readLabelsFile(const std::string &file_name)
+{
+	std::ifstream file(file_name);
+	if (!file)
+		throw std::runtime_error("ObjectCascadeTfStage: Failed to load labels file");
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		// As for object_classify_tf, keep just the name between any ':' and the first ','.
+		size_t start = line.find(':');
+		start = start == std::string::npos ? 0 : start + 1;
+		labels_.push_back(line.substr(start, line.find(',') - start));
+	}
+}
+
+void ObjectCascadeTfStage::checkConfiguration()
+{
+	if (!main_stream_)
+		throw std::runtime_error("ObjectCascadeTfStage: Main stream is required");
+	if (main_stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("ObjectCascadeTfStage: Main stream must be YUV420");
+}
+
+bool ObjectCascadeTfStage::copyInput(CompletedRequestPtr &completed_request, Input &input)
+{
+	std::vector<Detection> detections;
+	if (completed_request->post_process_metadata.Get("object_detect.results", detections) || detections.empty())
+		return false;
+
+	// Classify the most confident objects if there are too many.
+	std::sort(detections.begin(), detections.end(),
+			  [](Detection const &a, Detection const &b) { return a.confidence > b.confidence; });
+	if (detections.size() > config()->max_objects)
+		detections.erase(detections.begin() + config()->max_objects, detections.end());
+
+	// Each crop is stored as a WIDTH x HEIGHT YUV420 image.
+	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[main_stream_])[0];
+	StreamInfo const &info = main_stream_info_;
+	uint8_t const *Y = buffer.data();
+	uint8_t const *U = Y + info.height * info.stride;
+	uint8_t const *V = U + (info.height / 2) * (info.stride / 2);
+	size_t crop_size = WIDTH * HEIGHT * 3 / 2;
+	input.image.resize(detections.size() * crop_size);
+
+	for (unsigned int i = 0; i < detections.size(); i++)
+	{
+		// Take a square around the object with some room to spare, as the classifier expects,
+		// keeping it inside the image where we can.
+		Rectangle const &box = detections[i].box;
+		double size = std::max(box.width, box.height) * (1 + 2 * config()->padding);
+		size = std::min<double>({ size, (double)info.width, (double)info.height });
+		double x0 = std::clamp(box.x + box.width / 2.0 - size / 2, 0.0, info.width - size);
+		double y0 = std::clamp(box.y + box.height / 2.0 - size / 2, 0.0, info.height - size);
+
+		uint8_t *dst = &input.image[i * crop_size];
+		resize_plane_bilinear(Y, info.stride, info.width, info.height, x0, y0, size, size, dst, WIDTH, WIDTH, HEIGHT);
+		dst += WIDTH * HEIGHT;
+		resize_plane_bilinear(U, info.stride / 2, info.width / 2, info.height / 2, x0 / 2, y0 / 2, size / 2, size / 2,
+							  dst, WIDTH / 2, WIDTH / 2, HEIGHT / 2);
+		dst += WIDTH * HEIGHT / 4;
+		resize_plane_bilinear(V, info.stride / 2, info.width / 2, info.height / 2, x0 / 2, y0 / 2, size / 2, size / 2,
+							  dst, WIDTH / 2, WIDTH / 2, HEIGHT / 2);
+	}
+
+	input.context = detections;
+	return true;
+}
+
+void ObjectCascadeTfStage::fillInput(Input const &input)
+{
+	batch_ = std::any_cast<std::vector<Detection>>(input.context);
+
+	// Resizing the input means reallocating all the tensors, so only do it when the number
+	// of objects changes.
+	if (batch_.size() != batch_size_)
+	{
+		int tensor = interpreter_->inputs()[0];
+		if (interpreter_->ResizeInputTensor(tensor, { (int)batch_.size(), HEIGHT, WIDTH, 3 }) != kTfLiteOk ||
+			interpreter_->AllocateTensors() != kTfLiteOk)
+			throw std::runtime_error("ObjectCascadeTfStage: Failed to resize input, model may not support batches");
+		batch_size_ = batch_.size();
+	}
+
+	StreamInfo crop_info;
+	crop_info.width = WIDTH, crop_info.height = HEIGHT, crop_info.stride = WIDTH;
+	for (unsigned int i = 0; i < batch_.size(); i++)
+		yuv420ToInput(&input.image[i * WIDTH * HEIGHT * 3 / 2], crop_info, i);
+}
+
+void ObjectCascadeTfStage::interpretOutputs()
+{
+	int num_labels = labels_.size();
+	Quantisation quantisation = outputQuantisation(0);
+	float threshold = quantisation.Threshold(config()->threshold);
+
+	output_results_.clear();
+	withOutput(0, [&](auto const *scores) {
+		for (unsigned int i = 0; i < batch_.size(); i++, scores += num_labels)
+		{
+			// Compare raw scores, and only dequantise the winner.
+			int best = std::max_element(scores, scores + num_labels) - scores;
+			if (scores[best] < threshold)
+				continue;
+			Detection result = batch_[i];
+			result.category = best;
+			result.name = labels_[best];
+			result.confidence = quantisation.Dequantise(scores[best]);
+			output_results_.push_back(result);
+		}
+	});
+
+	if (config()->verbose)
+	{
+		for (auto &result : output_results_)
+			std::cerr << result.toString() << std::endl;
+	}
+}
+
+void ObjectCascadeTfStage::applyResults(CompletedRequestPtr &completed_request)
+{
+	// The classifications belong to objects found on an earlier frame. If nothing is detected
+	// on this one, don't carry them forward.
+	std::vector<Detection> detections;
+	if (completed_request->post_process_metadata.Get("object_detect.results", detections) || detections.empty())
+		completed_request->post_process_metadata.Set("object_cascade.results", std::vector<Detection>());
+	else
+		completed_request->post_process_metadata.Set("object_cascade.results", output_results_);
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new ObjectCascadeTfStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -34,6 +34,8 @@ protected:
 	// Read the label file, plus some confidence thresholds.
 	void readExtras(boost::property_tree::ptree const &params) override;
 
+	ReloadFn reloadExtras(boost::property_tree::ptree const &params) override;
+
 	// Retrieve the top-n most likely results.
 	void interpretOutputs() override;
 
@@ -43,7 +45,8 @@ protected:
 
 private:
 	void readLabelsFile(const std::string &file_name);
-	void getTopResults(uint8_t *prediction, int prediction_size, size_t num_results);
+	template <typename T>
+	void getTopResults(T const *prediction, int prediction_size, size_t num_results);
 
 	std::vector<std::pair<std::string, float>> output_results_;
 	std::vector<std::string> labels_;
@@ -53,10 +56,7 @@ private:
 
 void ObjectClassifyTfStage::readExtras(boost::property_tree::ptree const &params)
 {
-	config()->number_of_results = params.get<int>("number_of_results", 3);
-	config()->threshold_high = params.get<float>("threshold_high", 0.2f);
-	config()->threshold_low = params.get<float>("threshold_low", 0.1f);
-	config()->display_labels = params.get<int>("display_labels", 1);
+	reloadExtras(params)();
 
 	std::string labels_file = params.get<std::string>("labels_file", "/home/pi/models/labels.txt");
 	readLabelsFile(labels_file);
@@ -69,6 +69,20 @@ void ObjectClassifyTfStage::readExtras(boost::property_tree::ptree const &params
 		throw std::runtime_error("ObjectClassifyTfStage: Label count mismatch");
 }
 
+ReloadFn ObjectClassifyTfStage::reloadExtras(boost::property_tree::ptree const &params)
+{
+	int number_of_results = params.get<int>("number_of_results", 3);
+	float threshold_high = params.get<float>("threshold_high", 0.2f);
+	float threshold_low = params.get<float>("threshold_low", 0.1f);
+	int display_labels = params.get<int>("display_labels", 1);
+	return [=]() {
+		config()->number_of_results = number_of_results;
+		config()->threshold_high = threshold_high;
+		config()->threshold_low = threshold_low;
+		config()->display_labels = display_labels;
+	};
+}
+
 void ObjectClassifyTfStage::readLabelsFile(const std::string &file_name)
 {
 	std::ifstream file(file_name);
@@ -120,7 +134,9 @@ void ObjectClassifyTfStage::interpretOutputs()
 	// assume output dims to be something like (1, 1, ... ,size)
 	auto output_size = output_dims->data[output_dims->size - 1];
 
-	getTopResults(interpreter_->typed_output_tensor<uint8_t>(0), output_size, config()->number_of_results);
+	withOutput(0, [this, output_size](auto const *prediction) {
+		getTopResults(prediction, output_size, config()->number_of_results);
+	});
 
 	output_results_.clear();
 
@@ -139,8 +155,14 @@ void ObjectClassifyTfStage::interpretOutputs()
 	}
 }
 
-void ObjectClassifyTfStage::getTopResults(uint8_t *prediction, int prediction_size, size_t num_results)
+template <typename T>
+void ObjectClassifyTfStage::getTopResults(T const *prediction, int prediction_size, size_t num_results)
 {
+	// Compare the raw outputs against the thresholds, and only dequantise the ones that pass.
+	Quantisation quantisation = outputQuantisation(0);
+	float threshold_low = quantisation.Threshold(config()->threshold_low);
+	float threshold_high = quantisation.Threshold(config()->threshold_high);
+
 	// Will contain top N results in ascending order.
 	std::priority_queue<std::pair<float, int>, std::vector<std::pair<float, int>>, std::greater<std::pair<float, int>>>
 		top_result_pq;
@@ -149,13 +171,12 @@ void ObjectClassifyTfStage::getTopResults(uint8_t *prediction, int prediction_si
 
 	for (int i = 0; i < prediction_size; ++i)
 	{
-		float confidence = prediction[i] / 255.0;
-
-		if (confidence < config()->threshold_low)
+		if (prediction[i] < threshold_low)
 			continue;
+		float confidence = quantisation.Dequantise(prediction[i]);
 
 		// Consider keeping if above the high threshold or it was in the old list.
-		if (confidence >= config()->threshold_high ||
+		if (prediction[i] >= threshold_high ||
 			std::find_if(top_results_old.begin(), top_results_old.end(),
 						 [i] (auto &p) { return p.second == i; }) != top_results_old.end())
 		{
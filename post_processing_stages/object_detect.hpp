@@ -21,11 +21,15 @@ struct Detection
 	std::string name;
 	float confidence;
 	libcamera::Rectangle box;
+	unsigned int track_id = 0; // non-zero when the detection is being tracked
 	std::string toString() const
 	{
 		std::stringstream output;
 		output.precision(2);
-		output << name << "[" << category << "] (" << confidence << ") @ " << box.x << "," << box.y << " " << box.width
+		output << name << "[" << category << "]";
+		if (track_id)
+			output << " #" << track_id;
+		output << " (" << confidence << ") @ " << box.x << "," << box.y << " " << box.width
 			   << "x" << box.height;
 		return output.str();
 	}
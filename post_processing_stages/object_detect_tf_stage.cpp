@@ -7,6 +7,7 @@
 
 #include "object_detect.hpp"
 #include "tf_stage.hpp"
+#include "tracker.hpp"
 
 using Rectangle = libcamera::Rectangle;
 
@@ -37,27 +38,31 @@ protected:
 	// Read the label file, plus some thresholds.
 	void readExtras(boost::property_tree::ptree const &params) override;
 
+	ReloadFn reloadExtras(boost::property_tree::ptree const &params) override;
+
 	void checkConfiguration() override;
 
 	// Retrieve the top-n most likely results.
 	void interpretOutputs() override;
 
 	// Attach the results as metadata; optionally write the labels too for the annotate_cv
-	// stage to pick up.
+	// stage to pick up. When tracking, the boxes are moved on every frame and carry a track id.
 	void applyResults(CompletedRequestPtr &completed_request) override;
 
 private:
 	void readLabelsFile(const std::string &file_name);
 
 	std::vector<Detection> output_results_;
+	bool new_results_ = false;
 	std::vector<std::string> labels_;
 	size_t label_count_;
+	Tracker tracker_;
 };
 
 void ObjectDetectTfStage::readExtras(boost::property_tree::ptree const &params)
 {
-	config()->confidence_threshold = params.get<float>("confidence_threshold", 0.5f);
-	config()->overlap_threshold = params.get<float>("overlap_threshold", 0.5f);
+	tracker_.Read(params);
+	reloadExtras(params)();
 
 	std::string labels_file = params.get<std::string>("labels_file", "");
 	readLabelsFile(labels_file);
@@ -72,6 +77,21 @@ void ObjectDetectTfStage::readExtras(boost::property_tree::ptree const &params)
 		throw std::runtime_error("ObjectDetectTfStage: unexpected output dimensions");
 }
 
+ReloadFn ObjectDetectTfStage::reloadExtras(boost::property_tree::ptree const &params)
+{
+	// Turning tracking on or off changes what we publish, so is left to a new stage.
+	if (params.get<int>("tracking", 0) != tracker_.Enabled())
+		return {};
+	float confidence_threshold = params.get<float>("confidence_threshold", 0.5f);
+	float overlap_threshold = params.get<float>("overlap_threshold", 0.5f);
+	Tracker().Read(params); // just to check the parameters
+	return [this, params, confidence_threshold, overlap_threshold]() {
+		config()->confidence_threshold = confidence_threshold;
+		config()->overlap_threshold = overlap_threshold;
+		tracker_.Read(params);
+	};
+}
+
 void ObjectDetectTfStage::readLabelsFile(const std::string &file_name)
 {
 	std::ifstream file(file_name);
@@ -90,11 +110,38 @@ void ObjectDetectTfStage::checkConfiguration()
 {
 	if (!main_stream_)
 		throw std::runtime_error("ObjectDetectTfStage: Main stream is required");
+	tracker_.Configure(main_stream_info_, lores_info_);
 }
 
 void ObjectDetectTfStage::applyResults(CompletedRequestPtr &completed_request)
 {
-	completed_request->post_process_metadata.Set("object_detect.results", output_results_);
+	if (!tracker_.Enabled())
+	{
+		completed_request->post_process_metadata.Set("object_detect.results", output_results_);
+		return;
+	}
+
+	if (new_results_)
+	{
+		std::vector<Tracker::Object> objects;
+		for (auto const &detection : output_results_)
+			objects.push_back({ 0, detection.category, detection.confidence, detection.box });
+		tracker_.Update(objects);
+		new_results_ = false;
+	}
+
+	DerivedImagePtr lores = GetDerivedImage(completed_request, lores_stream_, DerivedImages::GREY);
+	tracker_.Advance(completed_request->sequence, lores->data.data());
+
+	std::vector<Detection> results;
+	for (auto const &object : tracker_.Objects())
+	{
+		Rectangle const &box = object.box;
+		results.emplace_back(object.category, labels_[object.category], object.confidence, box.x, box.y, box.width,
+							 box.height);
+		results.back().track_id = object.id;
+	}
+	completed_request->post_process_metadata.Set("object_detect.results", results);
 }
 
 static unsigned int area(const Rectangle &r)
@@ -104,26 +151,33 @@ static unsigned int area(const Rectangle &r)
 
 void ObjectDetectTfStage::interpretOutputs()
 {
-	int box_index = interpreter_->outputs()[0];
-	int class_index = interpreter_->outputs()[1];
-	int score_index = interpreter_->outputs()[2];
-	int num_detections = interpreter_->tensor(box_index)->dims->data[1];
-	float *boxes = interpreter_->tensor(box_index)->data.f;
-	float *scores = interpreter_->tensor(score_index)->data.f;
-	float *classes = interpreter_->tensor(class_index)->data.f;
+	// The outputs may be float or quantised. Scores are compared with the threshold without
+	// dequantising them, and we dequantise the other outputs only for the detections we keep.
+	int num_detections = interpreter_->output_tensor(0)->dims->data[1];
+	std::vector<int> candidates;
+	float threshold = outputQuantisation(2).Threshold(config()->confidence_threshold);
+	withOutput(2, [&](auto const *scores) {
+		for (int i = 0; i < num_detections; i++)
+		{
+			if (scores[i] >= threshold)
+				candidates.push_back(i);
+		}
+	});
 
 	output_results_.clear();
 
-	for (int i = 0; i < num_detections; i++)
+	for (int i : candidates)
 	{
-		if (scores[i] < config()->confidence_threshold)
-			continue;
+		float box[4];
+		for (int j = 0; j < 4; j++)
+			box[j] = outputValue(0, i * 4 + j);
+		float score = outputValue(2, i);
 
 		// The coords in the WIDTH x HEIGHT image fed to the network are:
-		int y = std::clamp<int>(HEIGHT * boxes[i * 4 + 0], 0, HEIGHT);
-		int x = std::clamp<int>(WIDTH * boxes[i * 4 + 1], 0, WIDTH);
-		int h = std::clamp<int>(HEIGHT * boxes[i * 4 + 2] - y, 0, HEIGHT);
-		int w = std::clamp<int>(WIDTH * boxes[i * 4 + 3] - x, 0, WIDTH);
+		int y = std::clamp<int>(HEIGHT * box[0], 0, HEIGHT);
+		int x = std::clamp<int>(WIDTH * box[1], 0, WIDTH);
+		int h = std::clamp<int>(HEIGHT * box[2] - y, 0, HEIGHT);
+		int w = std::clamp<int>(WIDTH * box[3] - x, 0, WIDTH);
 		// The network is fed a crop from the lores (if that was too large), so the coords
 		// in the full lores image are:
 		y += (lores_info_.height - HEIGHT) / 2;
@@ -135,8 +189,10 @@ void ObjectDetectTfStage::interpretOutputs()
 		h = h * main_stream_info_.height / lores_info_.height;
 		w = w * main_stream_info_.width / lores_info_.width;
 
-		int c = classes[i];
-		Detection detection(c, labels_[c], scores[i], x, y, w, h);
+		int c = std::lround(outputValue(1, i));
+		if (c < 0 || c >= (int)labels_.size())
+			continue;
+		Detection detection(c, labels_[c], score, x, y, w, h);
 
 		// Before adding this detection to the results, see if it overlaps an existing one.
 		bool overlapped = false;
@@ -161,6 +217,7 @@ void ObjectDetectTfStage::interpretOutputs()
 		if (!overlapped)
 			output_results_.push_back(detection);
 	}
+	new_results_ = true;
 
 	if (config()->verbose)
 	{
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * parallel_for.hpp - spread a loop across the cores
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Split the rows (or whatever) 0 to n - 1 into a contiguous chunk for each core, and
+// call fn(begin, end) on each chunk from a thread of its own.
+
+template <typename Fn>
+void parallel_for(int n, Fn const &fn)
+{
+	int num_threads = std::clamp<int>(std::thread::hardware_concurrency(), 1, std::max(n, 1));
+	std::vector<std::thread> threads;
+	for (int i = 1; i < num_threads; i++)
+		threads.emplace_back(fn, (int64_t)n * i / num_threads, (int64_t)n * (i + 1) / num_threads);
+	fn(0, n / num_threads);
+	for (auto &thread : threads)
+		thread.join();
+}
@@ -22,6 +22,9 @@ public:
 protected:
 	void readExtras(boost::property_tree::ptree const &params) override;
 
+	// There are no parameters of our own, so any reload we get is fine.
+	ReloadFn reloadExtras(boost::property_tree::ptree const &params) override { return [] {}; }
+
 	void checkConfiguration() override;
 
 	// Retrieve the various joint coordinates and confidences from the model.
@@ -63,41 +66,41 @@ void PoseEstimationTfStage::interpretOutputs()
 {
 	// This code has been adapted from the "Qengineering/TensorFlow_Lite_Pose_RPi_32-bits" repository and can be
 	// found here: "https://github.com/Qengineering/TensorFlow_Lite_Pose_RPi_32-bits/blob/master/Pose_single.cpp"
-	float *heatmaps = interpreter_->tensor(interpreter_->outputs()[0])->data.f;
-	float *offsets = interpreter_->tensor(interpreter_->outputs()[1])->data.f;
-
 	heats_.clear();
 	confidences_.clear();
 	locations_.clear();
 
-	for (int i = 0; i < FEATURE_SIZE; i++)
-	{
-		float confidence_temp = heatmaps[i];
-		libcamera::Point heat_coord;
-		for (int y = 0; y < HEATMAP_DIMS; y++)
+	// The heatmaps may be quantised, but that doesn't change where the peaks are.
+	withOutput(0, [this](auto const *heatmaps) {
+		for (int i = 0; i < FEATURE_SIZE; i++)
 		{
-			for (int x = 0; x < HEATMAP_DIMS; x++)
+			auto confidence_temp = heatmaps[i];
+			libcamera::Point heat_coord;
+			for (int y = 0; y < HEATMAP_DIMS; y++)
 			{
-				int j = FEATURE_SIZE * (HEATMAP_DIMS * y + x) + i;
-				if (heatmaps[j] > confidence_temp)
+				for (int x = 0; x < HEATMAP_DIMS; x++)
 				{
-					confidence_temp = heatmaps[j];
-					heat_coord.x = x;
-					heat_coord.y = y;
+					int j = FEATURE_SIZE * (HEATMAP_DIMS * y + x) + i;
+					if (heatmaps[j] > confidence_temp)
+					{
+						confidence_temp = heatmaps[j];
+						heat_coord.x = x;
+						heat_coord.y = y;
+					}
 				}
 			}
+			heats_.push_back(heat_coord);
+			confidences_.push_back(outputQuantisation(0).Dequantise(confidence_temp));
 		}
-		heats_.push_back(heat_coord);
-		confidences_.push_back(confidence_temp);
-	}
+	});
 
 	for (int i = 0; i < FEATURE_SIZE; i++)
 	{
 		libcamera::Point location_coord;
 		int x = heats_[i].x, y = heats_[i].y, j = (FEATURE_SIZE * 2) * (HEATMAP_DIMS * y + x) + i;
 
-		location_coord.y = (y * main_stream_info_.height) / (HEATMAP_DIMS - 1) + offsets[j];
-		location_coord.x = (x * main_stream_info_.width) / (HEATMAP_DIMS - 1) + offsets[j + FEATURE_SIZE];
+		location_coord.y = (y * main_stream_info_.height) / (HEATMAP_DIMS - 1) + outputValue(1, j);
+		location_coord.x = (x * main_stream_info_.width) / (HEATMAP_DIMS - 1) + outputValue(1, j + FEATURE_SIZE);
 
 		locations_.push_back(location_coord);
 	}
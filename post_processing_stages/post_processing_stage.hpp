@@ -6,6 +6,7 @@
  */
 
 #include <chrono>
+#include <functional>
 #include <map>
 #include <string>
 
@@ -27,6 +28,21 @@ class LibcameraApp;
 
 using StreamConfiguration = libcamera::StreamConfiguration;
 
+// One row of a YUV420 image, as handed to a row kernel. The U and V rows are given only with
+// the even rows of luma, and are half as wide.
+struct ImageRow
+{
+	unsigned int y;
+	unsigned int width;
+	uint8_t *Y;
+	uint8_t *U;
+	uint8_t *V;
+};
+
+using RowKernel = std::function<void(ImageRow &row)>;
+
+using ReloadFn = std::function<void()>;
+
 class PostProcessingStage
 {
 public:
@@ -51,6 +67,23 @@ public:
 
 	virtual void Teardown();
 
+	// Take new parameters while running, keeping whatever the stage has built up (accumulated
+	// images, loaded models and so on). This only checks the parameters, throwing if they're
+	// bad, and returns a function to put them into effect, so that all the stages change
+	// together. That function mustn't throw, and may be called at any time from another
+	// thread. Return an empty one if the stage can't do this, and a new one will be created.
+	virtual ReloadFn Reload(boost::property_tree::ptree const &params);
+
+	// Stages that change each pixel of the main stream (which must be YUV420) without looking
+	// at its neighbours can say so here. Two or more of these in a row then have their row
+	// kernels run together, in a single pass over the image, instead of their Process methods.
+	virtual bool HasRowKernel() const;
+
+	// Return the kernel for this request, or an empty one if there's nothing to do. Anything
+	// it needs from the stage should be copied into it, as it gets called for every row, from
+	// several threads at once.
+	virtual RowKernel GetRowKernel(CompletedRequestPtr &completed_request);
+
 	// Below here are some helpers provided for the convenience of derived classes.
 
 	// Convert YUV420 image to RGB. We crop from the centre of the image if the src
@@ -70,6 +103,13 @@ protected:
 		return std::chrono::duration<double, R>(t2 - t1);
 	}
 
+	// Return an image made from one of the request's streams, which must be YUV420. It gets
+	// made only once per request, however many stages ask for it (see core/derived_images.hpp).
+	// YUV420 images are always the full size of the stream. GREY images are scaled down to the
+	// given size, and RGB ones cropped from the centre. A size of zero means the stream's size.
+	DerivedImagePtr GetDerivedImage(CompletedRequestPtr &completed_request, libcamera::Stream const *stream,
+									DerivedImages::Format format, unsigned int width = 0, unsigned int height = 0);
+
 	LibcameraApp *app_;
 };
 
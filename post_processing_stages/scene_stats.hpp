@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * scene_stats.hpp - scene statistics result
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Statistics over a region of the image, which is divided into a grid of cells. Histograms
+// cover the whole region; everything else is given for each cell. Pixel values are 8-bit.
+
+struct SceneStats
+{
+	struct Cell
+	{
+		uint32_t pixels; // number of luma pixels in the cell
+		float mean; // average luma
+		uint32_t clipped_low; // pixels at or below the low clipping level
+		uint32_t clipped_high; // pixels at or above the high clipping level
+		// Focus measures: the variance of the Laplacian, and the mean squared Sobel gradient
+		// ("Tenengrad"). Both grow as the image gets sharper, but depend on the scene too, so
+		// compare them only between frames of the same thing.
+		float laplacian_variance;
+		float tenengrad;
+	};
+
+	unsigned int width; // number of cells across
+	unsigned int height; // number of cells down
+	std::vector<Cell> cells; // row by row
+	// Histograms, each with the same number of bins spread evenly over 0 to 255.
+	std::vector<uint32_t> y_histogram;
+	std::vector<uint32_t> u_histogram;
+	std::vector<uint32_t> v_histogram;
+};
@@ -0,0 +1,448 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * scene_stats_stage.cpp - histograms, clipping and sharpness measures
+ */
+
+// Measures the image for exposure and focus tools. Over a region of interest, divided into a
+// grid of cells, we count luma and chroma histograms and the pixels near black or white, and
+// measure the sharpness in two ways: the variance of the Laplacian, and the mean squared Sobel
+// gradient (often called "Tenengrad").
+
+// Normally we use the lores image. Alternatively we can use the main image, only looking at
+// every "subsample"th row and column so as to read as little of the (uncached) buffer as we
+// can. Pixels are then picked, not averaged, so the sharpness measures aren't comparable
+// between the two, nor between different amounts of subsampling.
+
+// The stage adds "scene_stats" to the metadata (see scene_stats.hpp).
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include <libcamera/formats.h>
+#include <libcamera/stream.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "core/libcamera_app.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+#include "post_processing_stages/scene_stats.hpp"
+
+using Stream = libcamera::Stream;
+
+class SceneStatsStage : public PostProcessingStage
+{
+public:
+	SceneStatsStage(LibcameraApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	ReloadFn Reload(boost::property_tree::ptree const &params) override;
+
+private:
+	struct Config
+	{
+		bool use_main;
+		unsigned int subsample;
+		float roi_x, roi_y;
+		float roi_width, roi_height;
+		unsigned int grid_x, grid_y;
+		unsigned int histogram_bins;
+		unsigned int clip_low, clip_high;
+		int frame_period;
+		bool verbose;
+	} config_;
+	void readConfig(Config &config, boost::property_tree::ptree const &params);
+	void setupGrid();
+	Stream *stream_;
+	StreamInfo info_;
+	// Size of the image we measure, which is smaller than the stream when subsampling.
+	unsigned int subsample_, width_, height_;
+	// Cell boundaries, in pixels of that image.
+	std::vector<unsigned int> cell_x_, cell_y_;
+	std::mutex mutex_;
+};
+
+#define NAME "scene_stats"
+
+char const *SceneStatsStage::Name() const
+{
+	return NAME;
+}
+
+void SceneStatsStage::Read(boost::property_tree::ptree const &params)
+{
+	readConfig(config_, params);
+}
+
+void SceneStatsStage::readConfig(Config &config, boost::property_tree::ptree const &params)
+{
+	std::string stream = params.get<std::string>("stream", "lores");
+	if (stream != "lores" && stream != "main")
+		throw std::runtime_error("SceneStatsStage: stream must be \"lores\" or \"main\"");
+	config.use_main = stream == "main";
+	config.subsample = std::max(params.get<unsigned int>("subsample", 4), 1u);
+	config.roi_x = params.get<float>("roi_x", 0.0);
+	config.roi_y = params.get<float>("roi_y", 0.0);
+	config.roi_width = params.get<float>("roi_width", 1.0);
+	config.roi_height = params.get<float>("roi_height", 1.0);
+	config.grid_x = std::max(params.get<unsigned int>("grid_x", 1), 1u);
+	config.grid_y = std::max(params.get<unsigned int>("grid_y", 1), 1u);
+	// Histogram bins must divide the 256 pixel values evenly.
+	unsigned int bins = std::clamp(params.get<unsigned int>("histogram_bins", 64), 1u, 256u);
+	for (config.histogram_bins = 1; config.histogram_bins * 2 <= bins;)
+		config.histogram_bins *= 2;
+	config.clip_low = params.get<unsigned int>("clip_low", 4);
+	config.clip_high = std::min(params.get<unsigned int>("clip_high", 251), 255u);
+	config.frame_period = params.get<int>("frame_period", 1);
+	config.verbose = params.get<int>("verbose", 0);
+}
+
+void SceneStatsStage::Configure()
+{
+	if (config_.use_main)
+	{
+		stream_ = app_->GetMainStream();
+		if (stream_)
+		{
+			info_ = app_->GetStreamInfo(stream_);
+			if (info_.pixel_format != libcamera::formats::YUV420)
+				throw std::runtime_error("SceneStatsStage: main stream must be YUV420");
+		}
+	}
+	else
+		stream_ = app_->LoresStream(&info_);
+	if (!stream_)
+	{
+		if (config_.verbose)
+			std::cerr << "SceneStatsStage: no " << (config_.use_main ? "main" : "low resolution") << " stream"
+					  << std::endl;
+		return;
+	}
+
+	setupGrid();
+}
+
+// Work out the size of the image we measure and where the cells lie in it. Nothing is kept
+// between frames, so these can change at any time.
+
+void SceneStatsStage::setupGrid()
+{
+	subsample_ = config_.use_main ? std::min({ config_.subsample, info_.width, info_.height }) : 1;
+	width_ = info_.width / subsample_;
+	height_ = info_.height / subsample_;
+
+	auto boundaries = [](std::vector<unsigned int> &cells, float start, float size, unsigned int n,
+						 unsigned int length) {
+		unsigned int x0 = std::clamp<int>(std::lround(start * length), 0, length);
+		unsigned int x1 = std::clamp<int>(std::lround((start + size) * length), x0, length);
+		n = std::clamp(n, 1u, std::max(x1 - x0, 1u));
+		cells.resize(n + 1);
+		for (unsigned int i = 0; i <= n; i++)
+			cells[i] = x0 + i * (x1 - x0) / n;
+	};
+	boundaries(cell_x_, config_.roi_x, config_.roi_width, config_.grid_x, width_);
+	boundaries(cell_y_, config_.roi_y, config_.roi_height, config_.grid_y, height_);
+
+	if (config_.verbose)
+		std::cerr << "SceneStatsStage: measuring " << width_ << "x" << height_ << " region: (" << cell_x_.front()
+				  << "," << cell_y_.front() << ") to (" << cell_x_.back() << "," << cell_y_.back()
+				  << ") grid: " << cell_x_.size() - 1 << "x" << cell_y_.size() - 1 << std::endl;
+}
+
+ReloadFn SceneStatsStage::Reload(boost::property_tree::ptree const &params)
+{
+	Config config;
+	readConfig(config, params);
+
+	// Changing stream means configuring again.
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (config.use_main != config_.use_main)
+			return {};
+	}
+
+	return [this, config = std::move(config)]() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		config_ = std::move(config);
+		if (stream_)
+			setupGrid();
+	};
+}
+
+// Add a 256 bin histogram of part of a plane into hist. Successive pixels are often the same,
+// so counting them into separate histograms avoids waiting on the previous increment. There's
+// no useful SIMD for this.
+
+static void histogram_plane(uint8_t const *src, unsigned int stride, unsigned int w, unsigned int h,
+							uint32_t *hist)
+{
+	uint32_t sub[4][256] = {};
+	for (unsigned int y = 0; y < h; y++, src += stride)
+	{
+		unsigned int x = 0;
+		for (; x + 4 <= w; x += 4)
+		{
+			sub[0][src[x]]++;
+			sub[1][src[x + 1]]++;
+			sub[2][src[x + 2]]++;
+			sub[3][src[x + 3]]++;
+		}
+		for (; x < w; x++)
+			sub[0][src[x]]++;
+	}
+	for (unsigned int i = 0; i < 256; i++)
+		hist[i] += sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+}
+
+struct Sharpness
+{
+	int64_t laplacian_sum = 0;
+	uint64_t laplacian_sum_sq = 0;
+	uint64_t gradient_sum_sq = 0;
+};
+
+// Accumulate the Laplacian and Sobel gradients for n pixels of a row. The pixels either side,
+// and in the rows above and below, must all exist.
+
+static void sharpness_row(uint8_t const *above, uint8_t const *row, uint8_t const *below, unsigned int n,
+						  Sharpness &sharpness)
+{
+	unsigned int x = 0;
+	// The Laplacian and the gradients are at most 1020 in size, so their squares summed in
+	// pairs or fours fit in 32-bit lanes for 256 iterations.
+#if defined(__ARM_NEON)
+	auto load = [](uint8_t const *p) { return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p))); };
+	auto add_lanes = [](int32x4_t v) {
+		return (int64_t)vgetq_lane_s32(v, 0) + vgetq_lane_s32(v, 1) + vgetq_lane_s32(v, 2) + vgetq_lane_s32(v, 3);
+	};
+	int32x4_t sum = vdupq_n_s32(0), sum_sq = sum, grad_sq = sum;
+	for (unsigned int count = 0; x + 8 <= n; x += 8)
+	{
+		int16x8_t ul = load(above + x - 1), u = load(above + x), ur = load(above + x + 1);
+		int16x8_t l = load(row + x - 1), c = load(row + x), r = load(row + x + 1);
+		int16x8_t dl = load(below + x - 1), d = load(below + x), dr = load(below + x + 1);
+		int16x8_t lap = vsubq_s16(vshlq_n_s16(c, 2), vaddq_s16(vaddq_s16(l, r), vaddq_s16(u, d)));
+		int16x8_t gx = vsubq_s16(vaddq_s16(vaddq_s16(ur, dr), vshlq_n_s16(r, 1)),
+								 vaddq_s16(vaddq_s16(ul, dl), vshlq_n_s16(l, 1)));
+		int16x8_t gy = vsubq_s16(vaddq_s16(vaddq_s16(dl, dr), vshlq_n_s16(d, 1)),
+								 vaddq_s16(vaddq_s16(ul, ur), vshlq_n_s16(u, 1)));
+		sum = vpadalq_s16(sum, lap);
+		sum_sq = vmlal_s16(sum_sq, vget_low_s16(lap), vget_low_s16(lap));
+		sum_sq = vmlal_s16(sum_sq, vget_high_s16(lap), vget_high_s16(lap));
+		grad_sq = vmlal_s16(grad_sq, vget_low_s16(gx), vget_low_s16(gx));
+		grad_sq = vmlal_s16(grad_sq, vget_high_s16(gx), vget_high_s16(gx));
+		grad_sq = vmlal_s16(grad_sq, vget_low_s16(gy), vget_low_s16(gy));
+		grad_sq = vmlal_s16(grad_sq, vget_high_s16(gy), vget_high_s16(gy));
+		if (++count == 256 || x + 16 > n)
+		{
+			sharpness.laplacian_sum += add_lanes(sum);
+			sharpness.laplacian_sum_sq += add_lanes(sum_sq);
+			sharpness.gradient_sum_sq += add_lanes(grad_sq);
+			sum = sum_sq = grad_sq = vdupq_n_s32(0);
+			count = 0;
+		}
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+	auto load = [zero](uint8_t const *p) { return _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *)p), zero); };
+	auto add_lanes = [](__m128i v) {
+		int32_t lanes[4];
+		_mm_storeu_si128((__m128i *)lanes, v);
+		return (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	};
+	__m128i sum = zero, sum_sq = zero, grad_sq = zero;
+	for (unsigned int count = 0; x + 8 <= n; x += 8)
+	{
+		__m128i ul = load(above + x - 1), u = load(above + x), ur = load(above + x + 1);
+		__m128i l = load(row + x - 1), c = load(row + x), r = load(row + x + 1);
+		__m128i dl = load(below + x - 1), d = load(below + x), dr = load(below + x + 1);
+		__m128i lap = _mm_sub_epi16(_mm_slli_epi16(c, 2), _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)));
+		__m128i gx = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(ur, dr), _mm_slli_epi16(r, 1)),
+								   _mm_add_epi16(_mm_add_epi16(ul, dl), _mm_slli_epi16(l, 1)));
+		__m128i gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(dl, dr), _mm_slli_epi16(d, 1)),
+								   _mm_add_epi16(_mm_add_epi16(ul, ur), _mm_slli_epi16(u, 1)));
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(lap, ones));
+		sum_sq = _mm_add_epi32(sum_sq, _mm_madd_epi16(lap, lap));
+		grad_sq = _mm_add_epi32(grad_sq, _mm_add_epi32(_mm_madd_epi16(gx, gx), _mm_madd_epi16(gy, gy)));
+		if (++count == 256 || x + 16 > n)
+		{
+			sharpness.laplacian_sum += add_lanes(sum);
+			sharpness.laplacian_sum_sq += add_lanes(sum_sq);
+			sharpness.gradient_sum_sq += add_lanes(grad_sq);
+			sum = sum_sq = grad_sq = zero;
+			count = 0;
+		}
+	}
+#endif
+	for (; x < n; x++)
+	{
+		uint8_t const *u = above + x, *c = row + x, *d = below + x;
+		int lap = 4 * c[0] - c[-1] - c[1] - u[0] - d[0];
+		int gx = u[1] + 2 * c[1] + d[1] - u[-1] - 2 * c[-1] - d[-1];
+		int gy = d[-1] + 2 * d[0] + d[1] - u[-1] - 2 * u[0] - u[1];
+		sharpness.laplacian_sum += lap;
+		sharpness.laplacian_sum_sq += lap * lap;
+		sharpness.gradient_sum_sq += gx * gx + gy * gy;
+	}
+}
+
+bool SceneStatsStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	// Only the configuration is shared between frames, so take a copy and let frames that are
+	// processed at the same time get on with it.
+	Config config;
+	unsigned int subsample, width, height;
+	std::vector<unsigned int> cell_x, cell_y;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		config = config_;
+		subsample = subsample_, width = width_, height = height_;
+		cell_x = cell_x_, cell_y = cell_y_;
+	}
+
+	if (config.frame_period && completed_request->sequence % config.frame_period)
+		return false;
+
+	auto time_taken = ExecutionTime<std::micro>([&]() {
+		// Find the three planes, each with its own stride.
+		DerivedImagePtr frame;
+		std::vector<uint8_t> sampled;
+		uint8_t const *Y, *U, *V;
+		unsigned int y_stride, uv_stride;
+		if (subsample == 1)
+		{
+			// Other stages may well want the same copy of the image, in cached memory.
+			frame = GetDerivedImage(completed_request, stream_, DerivedImages::YUV420);
+			Y = frame->data.data();
+			y_stride = frame->stride;
+			uv_stride = y_stride / 2;
+			U = Y + y_stride * info_.height;
+			V = U + uv_stride * (info_.height / 2);
+		}
+		else
+		{
+			// Copy each row we want out of the buffer in one go, as reading single pixels from
+			// uncached memory is very slow, then pick the pixels from that.
+			uint8_t const *buffer = app_->Mmap(completed_request->buffers[stream_])[0].data();
+			y_stride = width, uv_stride = width / 2;
+			sampled.resize(y_stride * height + 2 * uv_stride * (height / 2));
+			std::vector<uint8_t> row(info_.width);
+			auto sample = [&](uint8_t const *src, unsigned int src_stride, uint8_t *dst, unsigned int dst_stride,
+							  unsigned int w, unsigned int h) {
+				for (unsigned int y = 0; y < h; y++, dst += dst_stride)
+				{
+					memcpy(row.data(), src + y * subsample * src_stride, std::min(w * subsample, src_stride));
+					for (unsigned int x = 0; x < w; x++)
+						dst[x] = row[x * subsample];
+				}
+			};
+			uint8_t const *src_u = buffer + info_.stride * info_.height;
+			uint8_t const *src_v = src_u + (info_.stride / 2) * (info_.height / 2);
+			uint8_t *dst = sampled.data();
+			sample(buffer, info_.stride, dst, y_stride, width, height);
+			sample(src_u, info_.stride / 2, dst + y_stride * height, uv_stride, width / 2, height / 2);
+			sample(src_v, info_.stride / 2, dst + y_stride * height + uv_stride * (height / 2), uv_stride, width / 2,
+				   height / 2);
+			Y = dst;
+			U = Y + y_stride * height;
+			V = U + uv_stride * (height / 2);
+		}
+
+		SceneStats stats;
+		stats.width = cell_x.size() - 1;
+		stats.height = cell_y.size() - 1;
+		uint32_t y_hist[256] = {}, u_hist[256] = {}, v_hist[256] = {};
+		for (unsigned int j = 0; j < stats.height; j++)
+		{
+			for (unsigned int i = 0; i < stats.width; i++)
+			{
+				unsigned int x0 = cell_x[i], x1 = cell_x[i + 1], y0 = cell_y[j], y1 = cell_y[j + 1];
+				SceneStats::Cell cell = {};
+
+				uint32_t hist[256] = {};
+				histogram_plane(Y + y0 * y_stride + x0, y_stride, x1 - x0, y1 - y0, hist);
+				uint64_t total = 0;
+				for (unsigned int v = 0; v < 256; v++)
+				{
+					cell.pixels += hist[v];
+					total += (uint64_t)v * hist[v];
+					cell.clipped_low += v <= config.clip_low ? hist[v] : 0;
+					cell.clipped_high += v >= config.clip_high ? hist[v] : 0;
+					y_hist[v] += hist[v];
+				}
+				if (cell.pixels)
+					cell.mean = total / (double)cell.pixels;
+
+				// Filters need the pixels all round, so leave out the edges of the image.
+				unsigned int sx0 = std::max(x0, 1u), sx1 = std::max(std::min(x1, width - 1), sx0);
+				unsigned int sy0 = std::max(y0, 1u), sy1 = std::max(std::min(y1, height - 1), sy0);
+				Sharpness sharpness;
+				for (unsigned int y = sy0; y < sy1; y++)
+				{
+					uint8_t const *row = Y + y * y_stride + sx0;
+					sharpness_row(row - y_stride, row, row + y_stride, sx1 - sx0, sharpness);
+				}
+				double n = (sx1 - sx0) * (sy1 - sy0);
+				if (n)
+				{
+					double mean = sharpness.laplacian_sum / n;
+					cell.laplacian_variance = sharpness.laplacian_sum_sq / n - mean * mean;
+					cell.tenengrad = sharpness.gradient_sum_sq / n;
+				}
+
+				stats.cells.push_back(cell);
+			}
+		}
+
+		unsigned int cx0 = cell_x.front() / 2, cx1 = cell_x.back() / 2;
+		unsigned int cy0 = cell_y.front() / 2, cy1 = cell_y.back() / 2;
+		histogram_plane(U + cy0 * uv_stride + cx0, uv_stride, cx1 - cx0, cy1 - cy0, u_hist);
+		histogram_plane(V + cy0 * uv_stride + cx0, uv_stride, cx1 - cx0, cy1 - cy0, v_hist);
+
+		unsigned int shift = 0;
+		while ((256u >> shift) > config.histogram_bins)
+			shift++;
+		stats.y_histogram.resize(config.histogram_bins);
+		stats.u_histogram.resize(config.histogram_bins);
+		stats.v_histogram.resize(config.histogram_bins);
+		for (unsigned int v = 0; v < 256; v++)
+		{
+			stats.y_histogram[v >> shift] += y_hist[v];
+			stats.u_histogram[v >> shift] += u_hist[v];
+			stats.v_histogram[v >> shift] += v_hist[v];
+		}
+
+		completed_request->post_process_metadata.Set("scene_stats", std::move(stats));
+	});
+
+	if (config.verbose)
+		std::cerr << "SceneStatsStage: frame " << completed_request->sequence << " took " << time_taken.count()
+				  << " us" << std::endl;
+
+	return false;
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new SceneStatsStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
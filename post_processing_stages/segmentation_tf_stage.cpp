@@ -35,6 +35,8 @@ protected:
 
 	void readExtras(boost::property_tree::ptree const &params) override;
 
+	ReloadFn reloadExtras(boost::property_tree::ptree const &params) override;
+
 	void checkConfiguration() override;
 
 	// Read out the segmentation map.
@@ -75,6 +77,18 @@ void SegmentationTfStage::readExtras([[maybe_unused]] boost::property_tree::ptre
 		throw std::runtime_error("SegmentationTfStage: Unexpected output tensor size");
 }
 
+ReloadFn SegmentationTfStage::reloadExtras(boost::property_tree::ptree const &params)
+{
+	bool draw = params.get<int>("draw", 1);
+	if (draw && !main_stream_)
+		return {};
+	uint32_t threshold = params.get<uint32_t>("threshold", 5000);
+	return [this, draw, threshold]() {
+		config()->draw = draw;
+		config()->threshold = threshold;
+	};
+}
+
 void SegmentationTfStage::checkConfiguration()
 {
 	if (!main_stream_ && config()->draw)
@@ -120,24 +134,26 @@ void SegmentationTfStage::applyResults(CompletedRequestPtr &completed_request)
 
 void SegmentationTfStage::interpretOutputs()
 {
-	float *output = interpreter_->tensor(interpreter_->outputs()[0])->data.f;
 	uint8_t *seg_ptr = &segmentation_[0];
 	int num_categories = labels_.size();
 	std::vector<std::pair<size_t, int>> hist(num_categories);
 	std::generate(hist.begin(), hist.end(), [i = 0]() mutable { return std::pair<size_t, int>(0, i++); });
 
-	// Extract the segmentation from the output tensor. Also accumulate a histogram.
+	// Extract the segmentation from the output tensor. Also accumulate a histogram. Quantised
+	// outputs keep their order, so we can find the largest without dequantising.
 
-	for (int y = 0; y < HEIGHT; y++)
-	{
-		for (int x = 0; x < WIDTH; x++, output += num_categories)
+	withOutput(0, [&](auto const *output) {
+		for (int y = 0; y < HEIGHT; y++)
 		{
-			// For each pixel we get a "confidence" value for every category - pick the largest.
-			int index = std::max_element(output, output + num_categories) - output;
-			*(seg_ptr++) = index;
-			hist[index].first++;
+			for (int x = 0; x < WIDTH; x++, output += num_categories)
+			{
+				// For each pixel we get a "confidence" value for every category - pick the largest.
+				int index = std::max_element(output, output + num_categories) - output;
+				*(seg_ptr++) = index;
+				hist[index].first++;
+			}
 		}
-	}
+	});
 
 	if (config()->verbose)
 	{
@@ -0,0 +1,304 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * temporal_denoise_stage.cpp - motion-adaptive temporal denoise
+ */
+
+// Averages each frame of video with the ones before it, where nothing is moving. We keep
+// the previous output frame, and blend each new frame towards it:
+//     out = cur + k * (prev - cur)
+// The frame is divided into blocks, and k is chosen for each one from the mean absolute
+// difference between the block in this frame and the previous output. Where that is zero,
+// k is the "strength"; it falls to zero as the difference reaches the "threshold", so that
+// anything that moves isn't smeared. The chroma in a block is treated the same as the luma.
+
+// The main stream (which must be YUV420) is changed in place, so put this before any other
+// stages that draw on the image, and it will run before the frame gets to the encoder. Noise
+// costs the encoder a great many bits, so this reduces the output size (at a given quality)
+// a lot in low light. For example:
+// libcamera-vid -o test.h264 --post-process-file temporal_denoise.json
+
+// Each frame depends on the one before, so frames are filtered one at a time, though each
+// frame is split across all the cores. The post-processing framework may run requests in
+// parallel, which might rarely swap the order of two frames; in practice this does no harm.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+
+#include <libcamera/formats.h>
+#include <libcamera/stream.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "core/libcamera_app.hpp"
+
+#include "post_processing_stages/parallel_for.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+class TemporalDenoiseStage : public PostProcessingStage
+{
+public:
+	TemporalDenoiseStage(LibcameraApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	ReloadFn Reload(boost::property_tree::ptree const &params) override;
+
+private:
+	struct Config
+	{
+		float strength; // how much of the previous frame to keep where there's no motion
+		float threshold; // mean absolute difference per pixel above which there's no filtering
+		unsigned int block_size; // in luma pixels, always even
+		bool verbose;
+	} config_;
+	void readConfig(Config &config, boost::property_tree::ptree const &params);
+	Stream *stream_;
+	StreamInfo info_;
+	// The previous output frame, laid out the same as the buffers.
+	std::vector<uint8_t> previous_;
+	bool first_time_;
+	std::mutex mutex_;
+};
+
+#define NAME "temporal_denoise"
+
+char const *TemporalDenoiseStage::Name() const
+{
+	return NAME;
+}
+
+void TemporalDenoiseStage::Read(boost::property_tree::ptree const &params)
+{
+	readConfig(config_, params);
+}
+
+void TemporalDenoiseStage::readConfig(Config &config, boost::property_tree::ptree const &params)
+{
+	config.strength = std::clamp(params.get<float>("strength", 0.75), 0.0f, 1.0f);
+	config.threshold = std::max(params.get<float>("threshold", 8.0), 0.0f);
+	config.block_size = std::max(params.get<unsigned int>("block_size", 16), 2u) & ~1u;
+	config.verbose = params.get<int>("verbose", 0);
+}
+
+void TemporalDenoiseStage::Configure()
+{
+	stream_ = app_->GetMainStream();
+	if (!stream_)
+		return;
+	info_ = app_->GetStreamInfo(stream_);
+	if (info_.pixel_format != libcamera::formats::YUV420)
+		throw std::runtime_error("TemporalDenoiseStage: only YUV420 supported");
+
+	previous_.clear();
+	first_time_ = true;
+}
+
+ReloadFn TemporalDenoiseStage::Reload(boost::property_tree::ptree const &params)
+{
+	Config config;
+	readConfig(config, params);
+
+	return [this, config]() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		config_ = config;
+	};
+}
+
+// Return the sum of absolute differences between two rows of pixels.
+
+static uint32_t row_sad(uint8_t const *a, uint8_t const *b, unsigned int n)
+{
+	uint32_t sad = 0;
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	uint16x8_t sad16 = vdupq_n_u16(0);
+	// Each 16-bit lane gains at most 510 per iteration, so can't overflow within 128 of them.
+	for (unsigned int count = 0; x + 16 <= n; x += 16)
+	{
+		sad16 = vpadalq_u8(sad16, vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x)));
+		if (++count == 128 || x + 32 > n)
+		{
+			uint64x2_t sad64 = vpaddlq_u32(vpaddlq_u16(sad16));
+			sad += vgetq_lane_u64(sad64, 0) + vgetq_lane_u64(sad64, 1);
+			sad16 = vdupq_n_u16(0);
+			count = 0;
+		}
+	}
+#elif defined(__SSE2__)
+	__m128i sad64 = _mm_setzero_si128();
+	for (; x + 16 <= n; x += 16)
+		sad64 = _mm_add_epi64(sad64, _mm_sad_epu8(_mm_loadu_si128((__m128i const *)(a + x)),
+												  _mm_loadu_si128((__m128i const *)(b + x))));
+	sad += _mm_cvtsi128_si32(sad64) + _mm_cvtsi128_si32(_mm_srli_si128(sad64, 8));
+#endif
+	for (; x < n; x++)
+		sad += std::abs(a[x] - b[x]);
+	return sad;
+}
+
+// Blend a row of the current frame towards the previous one, by k in 7-bit fixed point, and
+// write the result both to the output (which may be the current row) and over the previous
+// frame. The difference times k fits in 16 bits.
+
+static void blend_row(uint8_t const *cur, uint8_t *prev, uint8_t *out, unsigned int n, int k)
+{
+	if (!k)
+	{
+		memcpy(prev, cur, n);
+		if (out != cur)
+			memcpy(out, cur, n);
+		return;
+	}
+
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	int16x8_t kv = vdupq_n_s16(k);
+	auto blend = [kv](uint8x8_t c8, uint8x8_t p8) {
+		int16x8_t c = vreinterpretq_s16_u16(vmovl_u8(c8)), p = vreinterpretq_s16_u16(vmovl_u8(p8));
+		return vqmovun_s16(vaddq_s16(c, vrshrq_n_s16(vmulq_s16(vsubq_s16(p, c), kv), 7)));
+	};
+	for (; x + 16 <= n; x += 16)
+	{
+		uint8x16_t c = vld1q_u8(cur + x), p = vld1q_u8(prev + x);
+		uint8x16_t result =
+			vcombine_u8(blend(vget_low_u8(c), vget_low_u8(p)), blend(vget_high_u8(c), vget_high_u8(p)));
+		vst1q_u8(prev + x, result);
+		vst1q_u8(out + x, result);
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128(), kv = _mm_set1_epi16(k), round = _mm_set1_epi16(64);
+	auto blend = [kv, round](__m128i c, __m128i p) {
+		__m128i d = _mm_mullo_epi16(_mm_sub_epi16(p, c), kv);
+		return _mm_add_epi16(c, _mm_srai_epi16(_mm_add_epi16(d, round), 7));
+	};
+	for (; x + 16 <= n; x += 16)
+	{
+		__m128i c = _mm_loadu_si128((__m128i const *)(cur + x)), p = _mm_loadu_si128((__m128i const *)(prev + x));
+		__m128i lo = blend(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(p, zero));
+		__m128i hi = blend(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(p, zero));
+		__m128i result = _mm_packus_epi16(lo, hi);
+		_mm_storeu_si128((__m128i *)(prev + x), result);
+		_mm_storeu_si128((__m128i *)(out + x), result);
+	}
+#endif
+	for (; x < n; x++)
+	{
+		int value = cur[x] + (((prev[x] - cur[x]) * k + 64) >> 7);
+		prev[x] = value;
+		out[x] = value;
+	}
+}
+
+bool TemporalDenoiseStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	if (first_time_)
+	{
+		previous_.assign(buffer.data(), buffer.data() + buffer.size());
+		first_time_ = false;
+		return false;
+	}
+
+	unsigned int width = info_.width, height = info_.height, stride = info_.stride;
+	unsigned int uv_width = width / 2, uv_height = height / 2, uv_stride = stride / 2;
+	unsigned int bs = config_.block_size;
+	unsigned int blocks_x = (width + bs - 1) / bs, blocks_y = (height + bs - 1) / bs;
+	int k_max = std::lround(config_.strength * 128);
+	float threshold = config_.threshold;
+	std::atomic<unsigned int> filtered = 0;
+
+	auto time_taken = ExecutionTime<std::micro>([&]() {
+		parallel_for(blocks_y, [&](int begin, int end) {
+			// The buffer is uncached, so read each band of rows into a copy we can go over twice.
+			std::vector<uint8_t> band(bs * width);
+			std::vector<int> ks(blocks_x);
+			unsigned int num_filtered = 0;
+			for (int by = begin; by < end; by++)
+			{
+				unsigned int y0 = by * bs, y1 = std::min(y0 + bs, height);
+				for (unsigned int y = y0; y < y1; y++)
+					memcpy(&band[(y - y0) * width], buffer.data() + y * stride, width);
+
+				// Choose how much to filter each block.
+				for (unsigned int bx = 0; bx < blocks_x; bx++)
+				{
+					unsigned int x0 = bx * bs, x1 = std::min(x0 + bs, width);
+					uint32_t sad = 0;
+					for (unsigned int y = y0; y < y1; y++)
+						sad += row_sad(&band[(y - y0) * width + x0], &previous_[y * stride + x0], x1 - x0);
+					float mad = sad / (float)((x1 - x0) * (y1 - y0));
+					ks[bx] = mad < threshold ? std::lround(k_max * (1 - mad / threshold)) : 0;
+					num_filtered += ks[bx] != 0;
+				}
+
+				for (unsigned int y = y0; y < y1; y++)
+				{
+					for (unsigned int bx = 0; bx < blocks_x; bx++)
+					{
+						unsigned int x0 = bx * bs, x1 = std::min(x0 + bs, width);
+						blend_row(&band[(y - y0) * width + x0], &previous_[y * stride + x0],
+								  buffer.data() + y * stride + x0, x1 - x0, ks[bx]);
+					}
+				}
+
+				// Chroma is read straight from the buffer, as we only look at it once. The last
+				// band takes any odd row at the bottom.
+				unsigned int cy0 = y0 / 2, cy1 = by == (int)blocks_y - 1 ? uv_height : y1 / 2;
+				for (unsigned int plane = 0; plane < 2; plane++)
+				{
+					unsigned int offset = stride * height + plane * uv_stride * uv_height;
+					for (unsigned int y = cy0; y < cy1; y++)
+					{
+						uint8_t *row = buffer.data() + offset + y * uv_stride;
+						uint8_t *prev_row = &previous_[offset + y * uv_stride];
+						for (unsigned int bx = 0; bx < blocks_x; bx++)
+						{
+							unsigned int x0 = bx * bs / 2, x1 = bx == blocks_x - 1 ? uv_width : x0 + bs / 2;
+							blend_row(row + x0, prev_row + x0, row + x0, x1 - x0, ks[bx]);
+						}
+					}
+				}
+			}
+			filtered += num_filtered;
+		});
+	});
+
+	if (config_.verbose)
+		std::cerr << "TemporalDenoiseStage: filtered " << filtered << " of " << blocks_x * blocks_y
+				  << " blocks in " << time_taken.count() << " us" << std::endl;
+
+	completed_request->post_process_metadata.Set("temporal_denoise.filtered",
+												 filtered / (float)(blocks_x * blocks_y));
+
+	return false;
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new TemporalDenoiseStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
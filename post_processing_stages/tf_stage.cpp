@@ -4,18 +4,90 @@
  *
  * tf_stage.hpp - base class for TensorFlowLite stages
  */
+#include <algorithm>
+#include <cmath>
+
+#include "image/image_kernels.hpp"
+
 #include "tf_stage.hpp"
 
-TfStage::TfStage(LibcameraApp *app, int tf_w, int tf_h) : PostProcessingStage(app), tf_w_(tf_w), tf_h_(tf_h)
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Flip a row of 8-bit values between uint8 and int8 (that is, subtract 128).
+static void flip_row(uint8_t *row, unsigned int n)
+{
+	unsigned int i = 0;
+#if defined(__ARM_NEON)
+	for (; i + 16 <= n; i += 16)
+		vst1q_u8(row + i, veorq_u8(vld1q_u8(row + i), vdupq_n_u8(0x80)));
+#elif defined(__SSE2__)
+	for (; i + 16 <= n; i += 16)
+		_mm_storeu_si128((__m128i *)(row + i),
+						 _mm_xor_si128(_mm_loadu_si128((__m128i const *)(row + i)), _mm_set1_epi8((char)0x80)));
+#endif
+	for (; i < n; i++)
+		row[i] ^= 0x80;
+}
+
+// Replace each of a row of 8-bit values by its entry in a 256 entry table.
+static void map_row(uint8_t *row, unsigned int n, uint8_t const *lut)
+{
+	for (unsigned int i = 0; i < n; i++)
+		row[i] = lut[row[i]];
+}
+
+// Normalise a row of 8-bit values into floats, as dst = src * scale + offset.
+static void normalise_row(uint8_t const *src, float *dst, unsigned int n, float scale, float offset)
+{
+	unsigned int i = 0;
+#if defined(__ARM_NEON)
+	float32x4_t off = vdupq_n_f32(offset);
+	for (; i + 16 <= n; i += 16)
+	{
+		uint8x16_t v = vld1q_u8(src + i);
+		uint16x8_t lo = vmovl_u8(vget_low_u8(v)), hi = vmovl_u8(vget_high_u8(v));
+		vst1q_f32(dst + i, vmlaq_n_f32(off, vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), scale));
+		vst1q_f32(dst + i + 4, vmlaq_n_f32(off, vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), scale));
+		vst1q_f32(dst + i + 8, vmlaq_n_f32(off, vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), scale));
+		vst1q_f32(dst + i + 12, vmlaq_n_f32(off, vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), scale));
+	}
+#elif defined(__SSE2__)
+	__m128 sc = _mm_set1_ps(scale), off = _mm_set1_ps(offset);
+	__m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i const *)(src + i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+		__m128i w[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero),
+						 _mm_unpackhi_epi16(hi, zero) };
+		for (int j = 0; j < 4; j++)
+			_mm_storeu_ps(dst + i + 4 * j, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(w[j]), sc), off));
+	}
+#endif
+	for (; i < n; i++)
+		dst[i] = src[i] * scale + offset;
+}
+
+TfStage::TfStage(LibcameraApp *app, int tf_w, int tf_h)
+	: PostProcessingStage(app), tf_w_(tf_w), tf_h_(tf_h), pending_(-1), busy_(-1), abort_(false),
+	  inference_time_us_(0), latency_us_(0)
 {
 	if (tf_w_ <= 0 || tf_h_ <= 0)
 		throw std::runtime_error("TfStage: Bad TFLite input dimensions");
 }
 
+TfStage::~TfStage()
+{
+	Stop();
+}
+
 void TfStage::Read(boost::property_tree::ptree const &params)
 {
 	config_->number_of_threads = params.get<int>("number_of_threads", 2);
-	config_->refresh_rate = params.get<int>("refresh_rate", 5);
 	config_->model_file = params.get<std::string>("model_file", "");
 	config_->verbose = params.get<int>("verbose", 0);
 	config_->normalisation_offset = params.get<float>("normalisation_offset", 127.5);
@@ -23,7 +95,33 @@ void TfStage::Read(boost::property_tree::ptree const &params)
 
 	initialise();
 
+	cadence_.Read(params);
 	readExtras(params);
+	params_ = params;
+}
+
+ReloadFn TfStage::Reload(boost::property_tree::ptree const &params)
+{
+	for (char const *key : { "model_file", "labels_file", "number_of_threads", "normalisation_offset",
+							 "normalisation_scale" })
+	{
+		if (params.get<std::string>(key, "") != params_.get<std::string>(key, ""))
+			return {};
+	}
+
+	ReloadFn reload_extras = reloadExtras(params);
+	if (!reload_extras)
+		return {};
+	int verbose = params.get<int>("verbose", 0);
+	Cadence().Read(params); // just to check the parameters
+
+	return [this, params, reload_extras, verbose]() {
+		std::unique_lock<std::mutex> lock(output_mutex_);
+		reload_extras();
+		config_->verbose = verbose;
+		cadence_.Read(params);
+		params_ = params;
+	};
 }
 
 void TfStage::initialise()
@@ -48,7 +146,7 @@ void TfStage::initialise()
 	int input = interpreter_->inputs()[0];
 	size_t size = interpreter_->tensor(input)->bytes;
 	size_t check = tf_w_ * tf_h_ * 3; // assume RGB
-	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
+	if (interpreter_->tensor(input)->type == kTfLiteUInt8 || interpreter_->tensor(input)->type == kTfLiteInt8)
 		check *= sizeof(uint8_t);
 	else if (interpreter_->tensor(input)->type == kTfLiteFloat32)
 		check *= sizeof(float);
@@ -58,6 +156,33 @@ void TfStage::initialise()
 	// Causes might include loading the wrong model.
 	if (check != size)
 		throw std::runtime_error("TfStage: Input tensor size mismatch");
+
+	// Quantised inputs say what real value each step stands for, so work out the step that our
+	// normalisation makes of each pixel value. Where that's always within a step of the pixel
+	// value itself (shifted down by 128 for int8, as the converter does when it turns a uint8
+	// model into an int8 one) we pass the pixels straight in, otherwise we look each one up.
+	// Models without quantisation parameters just get the pixels.
+	TfLiteTensor const *tensor = interpreter_->tensor(input);
+	input_lut_.clear();
+	if (tensor->type != kTfLiteFloat32 && tensor->params.scale > 0)
+	{
+		int lo = tensor->type == kTfLiteInt8 ? -128 : 0, hi = lo + 255;
+		std::vector<uint8_t> lut(256);
+		bool as_is = true;
+		for (int pixel = 0; pixel < 256; pixel++)
+		{
+			float real = (pixel - config_->normalisation_offset) / config_->normalisation_scale;
+			float step = std::clamp<float>(real / tensor->params.scale + tensor->params.zero_point, lo, hi);
+			as_is &= std::abs(step - (pixel + lo)) <= 1;
+			lut[pixel] = static_cast<uint8_t>(std::lround(step));
+		}
+		if (!as_is)
+			input_lut_ = std::move(lut);
+		if (config_->verbose)
+			std::cerr << "TfStage: input scale " << tensor->params.scale << " zero point "
+					  << tensor->params.zero_point << (as_is ? ", using pixels as they are" : ", using a table")
+					  << std::endl;
+	}
 }
 
 void TfStage::Configure()
@@ -69,7 +194,7 @@ void TfStage::Configure()
 		if (config_->verbose)
 			std::cerr << "TfStage: Low resolution stream is " << lores_info_.width << "x"
 					  << lores_info_.height << std::endl;
-		if (tf_w_ > lores_info_.width || tf_h_ > lores_info_.height)
+		if (needsLores() && (tf_w_ > lores_info_.width || tf_h_ > lores_info_.height))
 		{
 			std::cerr << "TfStage: WARNING: Low resolution image too small" << std::endl;
 			lores_stream_ = nullptr;
@@ -89,71 +214,206 @@ void TfStage::Configure()
 	else if (config_->verbose)
 		std::cerr << "TfStage: No main stream" << std::endl;
 
+	cadence_.Reset();
 	checkConfiguration();
 }
 
+void TfStage::Start()
+{
+	if (inference_thread_.joinable())
+		return;
+
+	pending_ = busy_ = -1;
+	abort_ = false;
+	error_ = nullptr;
+	inference_thread_ = std::thread(&TfStage::inferenceThread, this);
+}
+
 bool TfStage::Process(CompletedRequestPtr &completed_request)
 {
-	if (!lores_stream_)
+	if (needsLores() && !lores_stream_)
 		return false;
 
+	if (cadence_.Due(completed_request->sequence))
 	{
-		std::unique_lock<std::mutex> lck(future_mutex_);
-		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
-			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
-		{
-			libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[lores_stream_])[0];
+		// Requests may be processed concurrently, so only one of them gets to hand over a frame
+		// at a time.
+		std::unique_lock<std::mutex> submit_lock(submit_mutex_);
 
-			// Copy the lores image here and let the asynchronous thread convert it to RGB.
-			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
-			// memory into cached memory, which is then *much* quicker.
-			lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
-
-			future_ = std::make_unique<std::future<void>>();
-			*future_ = std::async(std::launch::async, [this] {
-				auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this).count();
+		// Claim whichever input the inference thread isn't using. If it holds a frame that
+		// hasn't been run yet, that frame is simply replaced by this newer one.
+		int index;
+		{
+			std::unique_lock<std::mutex> lock(input_mutex_);
+			if (error_)
+				std::rethrow_exception(error_);
+			index = busy_ == 0 || (busy_ == -1 && pending_ == 0) ? 1 : 0;
+			if (pending_ == index)
+				pending_ = -1;
+		}
 
-				if (config_->verbose)
-					std::cerr << "TfStage: Inference time: " << time_taken << " ms" << std::endl;
-			});
+		if (copyInput(completed_request, inputs_[index]))
+		{
+			inputs_[index].time = std::chrono::steady_clock::now();
+			std::unique_lock<std::mutex> lock(input_mutex_);
+			pending_ = index;
+			input_cond_var_.notify_one();
 		}
 	}
 
 	std::unique_lock<std::mutex> lock(output_mutex_);
 	applyResults(completed_request);
+	if (latency_us_)
+	{
+		completed_request->post_process_metadata.Set(std::string(Name()) + ".inference_time", inference_time_us_);
+		completed_request->post_process_metadata.Set(std::string(Name()) + ".latency", latency_us_);
+	}
+	completed_request->post_process_metadata.Set(std::string(Name()) + ".refresh_rate", cadence_.RefreshRate());
 
 	return false;
 }
 
-void TfStage::runInference()
+bool TfStage::copyInput(CompletedRequestPtr &completed_request, Input &input)
 {
-	int input = interpreter_->inputs()[0];
-	StreamInfo tf_info;
-	tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
-	std::vector<uint8_t> rgb_image = Yuv420ToRgb(lores_copy_.data(), lores_info_, tf_info);
+	// Take a copy of the lores image here and let the inference thread convert it to RGB.
+	// Doing the "extra" copy is in fact hugely beneficial because it turns uncached memory
+	// into cached memory, which is then *much* quicker. Other stages running on this frame
+	// share the same copy.
+	input.frame = GetDerivedImage(completed_request, lores_stream_, DerivedImages::YUV420);
+	return true;
+}
 
-	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
+void TfStage::fillInput(Input const &input)
+{
+	yuv420ToInput(input.frame->data.data(), lores_info_);
+}
+
+void TfStage::inferenceThread()
+{
+	while (true)
 	{
-		uint8_t *tensor = interpreter_->typed_tensor<uint8_t>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = rgb_image[i];
+		int index;
+		{
+			std::unique_lock<std::mutex> lock(input_mutex_);
+			input_cond_var_.wait(lock, [this] { return abort_ || pending_ != -1; });
+			if (abort_)
+				break;
+			index = busy_ = pending_;
+			pending_ = -1;
+		}
+
+		try
+		{
+			runInference(inputs_[index]);
+		}
+		catch (...)
+		{
+			std::unique_lock<std::mutex> lock(input_mutex_);
+			error_ = std::current_exception();
+			busy_ = -1;
+			break;
+		}
+
+		std::unique_lock<std::mutex> lock(input_mutex_);
+		busy_ = -1;
 	}
-	else if (interpreter_->tensor(input)->type == kTfLiteFloat32)
+}
+
+void TfStage::yuv420ToInput(uint8_t const *yuv, StreamInfo const &info, unsigned int batch_index)
+{
+	// Crop the middle of the image and convert it straight into the input tensor, a
+	// row at a time. Float models get each row normalised on the way. Quantised models take
+	// the pixel values as they are (shifted down by 128 for int8) where that's close enough to
+	// what their quantisation asks for, or else the values initialise() put in a table.
+	unsigned int off_x = ((info.width - tf_w_) / 2) & ~1, off_y = ((info.height - tf_h_) / 2) & ~1;
+	uint8_t const *Y = yuv;
+	uint8_t const *U = Y + info.height * info.stride;
+	uint8_t const *V = U + (info.height / 2) * (info.stride / 2);
+	int input = interpreter_->inputs()[0];
+	bool is_float = interpreter_->tensor(input)->type == kTfLiteFloat32;
+	bool is_int8 = interpreter_->tensor(input)->type == kTfLiteInt8;
+	uint8_t *tensor_u8 = is_float ? nullptr
+						 : is_int8 ? reinterpret_cast<uint8_t *>(interpreter_->typed_input_tensor<int8_t>(0))
+								   : interpreter_->typed_input_tensor<uint8_t>(0);
+	float *tensor_f = is_float ? interpreter_->typed_input_tensor<float>(0) : nullptr;
+	size_t image_size = tf_w_ * tf_h_ * 3;
+	if (is_float)
+		tensor_f += batch_index * image_size;
+	else
+		tensor_u8 += batch_index * image_size;
+	float scale = 1.0 / config_->normalisation_scale;
+	float offset = -config_->normalisation_offset / config_->normalisation_scale;
+	rgb_row_.resize(tf_w_ * 3);
+
+	for (unsigned int y = 0; y < tf_h_; y++)
 	{
-		float *tensor = interpreter_->typed_tensor<float>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = (rgb_image[i] - config_->normalisation_offset) / config_->normalisation_scale;
+		unsigned int src_y = y + off_y;
+		uint8_t *dst = is_float ? rgb_row_.data() : tensor_u8 + y * tf_w_ * 3;
+		yuv420_to_rgb_row(Y + src_y * info.stride + off_x, U + (src_y / 2) * (info.stride / 2) + off_x / 2,
+						  V + (src_y / 2) * (info.stride / 2) + off_x / 2, dst, tf_w_, YUV_TO_RGB_JPEG);
+		if (is_float)
+			normalise_row(dst, tensor_f + y * tf_w_ * 3, tf_w_ * 3, scale, offset);
+		else if (!input_lut_.empty())
+			map_row(dst, tf_w_ * 3, input_lut_.data());
+		else if (is_int8)
+			flip_row(dst, tf_w_ * 3);
 	}
+}
+
+void TfStage::runInference(Input const &input_frame)
+{
+	auto start_time = std::chrono::steady_clock::now();
+	fillInput(input_frame);
 
 	if (interpreter_->Invoke() != kTfLiteOk)
 		throw std::runtime_error("TfStage: Failed to invoke TFLite");
 
+	auto end_time = std::chrono::steady_clock::now();
+	int64_t inference_time_us =
+		std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+	if (config_->verbose)
+		std::cerr << "TfStage: Inference time: " << inference_time_us << " us" << std::endl;
+
+	// The derived class's results and our timings all change together, so no frame sees a
+	// mixture of old and new.
 	std::unique_lock<std::mutex> lock(output_mutex_);
 	interpretOutputs();
+	auto latency = std::chrono::steady_clock::now() - input_frame.time;
+	inference_time_us_ = inference_time_us;
+	latency_us_ = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+	cadence_.Finished(end_time - start_time, latency);
+}
+
+TfStage::Quantisation TfStage::outputQuantisation(int index) const
+{
+	TfLiteTensor const *tensor = interpreter_->output_tensor(index);
+	Quantisation quantisation;
+	if (tensor->type == kTfLiteUInt8 || tensor->type == kTfLiteInt8)
+	{
+		quantisation.quantised = true;
+		quantisation.scale = tensor->params.scale;
+		quantisation.zero_point = tensor->params.zero_point;
+		// Models without quantisation parameters have uint8 outputs meaning 0 to 1.
+		if (quantisation.scale == 0)
+			quantisation.scale = 1 / 255.0, quantisation.zero_point = 0;
+	}
+	return quantisation;
+}
+
+float TfStage::outputValue(int index, int i) const
+{
+	float raw = 0;
+	withOutput(index, [&raw, i](auto const *data) { raw = data[i]; });
+	return outputQuantisation(index).Dequantise(raw);
 }
 
 void TfStage::Stop()
 {
-	if (future_)
-		future_->wait();
+	{
+		std::unique_lock<std::mutex> lock(input_mutex_);
+		abort_ = true;
+		input_cond_var_.notify_one();
+	}
+	if (inference_thread_.joinable())
+		inference_thread_.join();
 }
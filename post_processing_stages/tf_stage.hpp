@@ -7,8 +7,15 @@
 
 #pragma once
 
+#include <any>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 #include <libcamera/stream.h>
@@ -21,6 +28,7 @@
 #include "core/libcamera_app.hpp"
 #include "core/stream_info.hpp"
 
+#include "post_processing_stages/cadence.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 // The TfStage is a convenient base class from which post processing stages using
@@ -31,9 +39,9 @@
 struct TfConfig
 {
 	int number_of_threads = 3;
-	int refresh_rate = 5;
 	std::string model_file;
-	bool verbose = false;
+	// Can be reloaded while the inference thread is reading it.
+	std::atomic<bool> verbose { false };
 	float normalisation_offset = 127.5;
 	float normalisation_scale = 127.5;
 };
@@ -53,10 +61,18 @@ public:
 
 	void Configure() override;
 
+	void Start() override;
+
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 	void Stop() override;
 
+	// Thresholds and the like can change while running; a different model, labels file or
+	// anything else that needs setting up again means replacing the stage.
+	ReloadFn Reload(boost::property_tree::ptree const &params) override;
+
+	~TfStage();
+
 protected:
 	TfConfig *config() const { return config_.get(); }
 
@@ -66,11 +82,40 @@ protected:
 	// Read additional parameters required by the stage. Can also do some model checking.
 	virtual void readExtras(boost::property_tree::ptree const &params) {}
 
+	// Check any of the additional parameters that can change while running, and return a
+	// function to update them. That is called with the output lock held, so it mustn't race
+	// with interpretOutputs or applyResults. Return an empty function if the stage can't take
+	// the new parameters in place.
+	virtual ReloadFn reloadExtras(boost::property_tree::ptree const &params) { return {}; }
+
 	// Check the stream and image configuration. Here the stage should report any errors
 	// and/or fail.
 	virtual void checkConfiguration() {}
 
-	// This runs asynchronously from the main thread right after the model has run. The
+	// Most stages run the model on the lores image, and do nothing without one big enough.
+	// Stages that make their input some other way should return false.
+	virtual bool needsLores() const { return true; }
+
+	// What gets handed to the inference thread for each run. Usually this is just the lores
+	// image, which other stages may share, but stages can also make their own image, and use
+	// the context for anything else they need to send.
+	struct Input
+	{
+		DerivedImagePtr frame;
+		std::vector<uint8_t> image;
+		std::any context;
+		std::chrono::steady_clock::time_point time; // when the input was handed over
+	};
+
+	// Called for the frames we run on, to copy the input out of the request. The default
+	// copies the lores image. Return false to skip this frame.
+	virtual bool copyInput(CompletedRequestPtr &completed_request, Input &input);
+
+	// Runs on the inference thread to fill the input tensor. The default converts the middle
+	// of the lores image.
+	virtual void fillInput(Input const &input);
+
+	// This runs on the inference thread right after the model has run. The
 	// outputs should be processed into a form where applyResults can make use of them.
 	virtual void interpretOutputs() {}
 
@@ -79,7 +124,48 @@ protected:
 	// to the image, or even drawn onto the image itself.
 	virtual void applyResults(CompletedRequestPtr &completed_request) {}
 
+	// Output tensors may be float, or quantised as uint8 or int8. Rather than converting
+	// everything to float, stages can compare raw values directly (the quantisation never
+	// changes their order) and only dequantise the few values they keep.
+	struct Quantisation
+	{
+		bool quantised = false;
+		float scale = 1;
+		int zero_point = 0;
+		float Dequantise(float raw) const { return quantised ? scale * (raw - zero_point) : raw; }
+		// The smallest raw value whose real value is at least the given threshold.
+		float Threshold(float threshold) const
+		{
+			return quantised ? std::ceil(threshold / scale + zero_point - 1e-3f) : threshold;
+		}
+	};
+	Quantisation outputQuantisation(int index) const;
+	// Dequantised value of a single element of an output tensor.
+	float outputValue(int index, int i) const;
+	// Call fn with a pointer to the data of an output tensor, typed as float, uint8_t or int8_t.
+	template <typename F>
+	void withOutput(int index, F &&fn) const
+	{
+		TfLiteTensor *tensor = interpreter_->output_tensor(index);
+		if (tensor->type == kTfLiteFloat32)
+			fn(tensor->data.f);
+		else if (tensor->type == kTfLiteUInt8)
+			fn(tensor->data.uint8);
+		else if (tensor->type == kTfLiteInt8)
+			fn(tensor->data.int8);
+		else
+			throw std::runtime_error("TfStage: Output tensor data type not supported");
+	}
+
+	// Convert the middle tf_w_ x tf_h_ pixels of a YUV420 image into the input tensor. Models
+	// that take a batch of images get this one in the given position.
+	void yuv420ToInput(uint8_t const *yuv, StreamInfo const &info, unsigned int batch_index = 0);
+
 	std::unique_ptr<TfConfig> config_;
+	// Which frames we run the model on.
+	Cadence cadence_;
+	// The parameters we were last given, so that reloading can tell what changed.
+	boost::property_tree::ptree params_;
 
 	// The width and height that TFLite wants.
 	unsigned int tf_w_, tf_h_;
@@ -97,10 +183,28 @@ protected:
 
 private:
 	void initialise();
-	void runInference();
+	void inferenceThread();
+
+	void runInference(Input const &input_frame);
+
+	// Frames are handed to the inference thread through a pair of buffers. While the thread
+	// works on one, the other receives the most recent frame, replacing any that is still
+	// waiting, so the thread always picks up the latest frame when it finishes.
+
+	Input inputs_[2];
+	std::vector<uint8_t> rgb_row_; // a row of the input image, for float models
+	std::vector<uint8_t> input_lut_; // quantised input for each pixel value, if not the pixel itself
+	int pending_; // index of the input waiting to be run, or -1
+	int busy_; // index of the input being run, or -1
+	std::mutex submit_mutex_;
+	std::mutex input_mutex_;
+	std::condition_variable input_cond_var_;
+	bool abort_;
+	std::exception_ptr error_;
+	std::thread inference_thread_;
 
-	std::mutex future_mutex_;
-	std::unique_ptr<std::future<void>> future_;
-	std::vector<uint8_t> lores_copy_;
 	std::mutex output_mutex_;
+	// Timings for the current results, which are attached to every frame's metadata.
+	int64_t inference_time_us_;
+	int64_t latency_us_;
 };
@@ -0,0 +1,243 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * tracker.cpp - track detected objects between detections
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+#include "post_processing_stages/tracker.hpp"
+
+// Noise levels (standard deviations, as fractions of the image size) for the Kalman filters.
+// Objects may accelerate by around this much per frame:
+static constexpr double PROCESS_NOISE = 0.002;
+// Detections are typically accurate to about:
+static constexpr double DETECTION_NOISE = 0.01;
+// Block matching in the low resolution image is accurate to about:
+static constexpr double FLOW_NOISE = 0.01;
+// Size of the patch we look for in the low resolution image.
+static constexpr int MAX_PATCH_SIZE = 32;
+static constexpr int MIN_PATCH_SIZE = 8;
+
+void Tracker::Filter::Init(double position)
+{
+	x = position;
+	v = 0;
+	p00 = DETECTION_NOISE * DETECTION_NOISE;
+	p01 = 0;
+	p11 = 0.01 * 0.01; // we don't know the velocity yet
+}
+
+void Tracker::Filter::Predict(unsigned int frames, double noise)
+{
+	double dt = frames, q = noise * noise;
+	x += v * dt;
+	p00 += dt * (2 * p01 + dt * p11) + q * dt * dt * dt / 3;
+	p01 += dt * p11 + q * dt * dt / 2;
+	p11 += q * dt;
+}
+
+void Tracker::Filter::Update(double measurement, double noise)
+{
+	double s = p00 + noise * noise;
+	double k0 = p00 / s, k1 = p01 / s;
+	double y = measurement - x;
+	x += k0 * y;
+	v += k1 * y;
+	p11 -= k1 * p01;
+	p01 -= k0 * p01;
+	p00 -= k0 * p00;
+}
+
+Tracker::Tracker() : enabled_(false), next_id_(1), sequence_(0), started_(false)
+{
+}
+
+void Tracker::Read(boost::property_tree::ptree const &params)
+{
+	enabled_ = params.get<int>("tracking", 0);
+	iou_threshold_ = params.get<double>("track_iou_threshold", 0.3);
+	max_age_ = params.get<unsigned int>("track_max_age", 30);
+	min_hits_ = params.get<unsigned int>("track_min_hits", 1);
+	flow_ = params.get<int>("track_flow", 0);
+	search_range_ = params.get<int>("track_search_range", 4);
+}
+
+void Tracker::Configure(StreamInfo const &info, StreamInfo const &lores_info)
+{
+	info_ = info;
+	lores_info_ = lores_info;
+	tracks_.clear();
+	started_ = false;
+	prev_lores_.clear();
+}
+
+static double iou(libcamera::Rectangle const &a, libcamera::Rectangle const &b)
+{
+	libcamera::Rectangle common = a.boundedTo(b);
+	double overlap = (double)common.width * common.height;
+	double total = (double)a.width * a.height + (double)b.width * b.height - overlap;
+	return total > 0 ? overlap / total : 0;
+}
+
+static libcamera::Rectangle make_box(double cx, double cy, double w, double h, StreamInfo const &info)
+{
+	w = std::max(w, 0.0), h = std::max(h, 0.0);
+	int x0 = std::lround((cx - w / 2) * info.width), y0 = std::lround((cy - h / 2) * info.height);
+	int x1 = std::lround((cx + w / 2) * info.width), y1 = std::lround((cy + h / 2) * info.height);
+	x0 = std::clamp<int>(x0, 0, info.width), x1 = std::clamp<int>(x1, x0, info.width);
+	y0 = std::clamp<int>(y0, 0, info.height), y1 = std::clamp<int>(y1, y0, info.height);
+	return libcamera::Rectangle(x0, y0, x1 - x0, y1 - y0);
+}
+
+void Tracker::Update(std::vector<Object> const &detections)
+{
+	// Score every pairing of track and detection of the same category, and take the best
+	// ones greedily. There are only ever a handful, so this does as well as anything fancier.
+	struct Pair
+	{
+		double iou;
+		unsigned int track, detection;
+	};
+	std::vector<Pair> pairs;
+	for (unsigned int t = 0; t < tracks_.size(); t++)
+	{
+		Track const &track = tracks_[t];
+		libcamera::Rectangle box = make_box(track.cx.x, track.cy.x, track.w.x, track.h.x, info_);
+		for (unsigned int d = 0; d < detections.size(); d++)
+		{
+			if (detections[d].category != track.category)
+				continue;
+			double score = iou(box, detections[d].box);
+			if (score >= iou_threshold_)
+				pairs.push_back({ score, t, d });
+		}
+	}
+	std::sort(pairs.begin(), pairs.end(), [](Pair const &a, Pair const &b) { return a.iou > b.iou; });
+
+	std::vector<bool> track_done(tracks_.size()), detection_done(detections.size());
+	for (auto const &pair : pairs)
+	{
+		if (track_done[pair.track] || detection_done[pair.detection])
+			continue;
+		track_done[pair.track] = detection_done[pair.detection] = true;
+
+		Track &track = tracks_[pair.track];
+		libcamera::Rectangle const &box = detections[pair.detection].box;
+		track.cx.Update((box.x + box.width / 2.0) / info_.width, DETECTION_NOISE);
+		track.cy.Update((box.y + box.height / 2.0) / info_.height, DETECTION_NOISE);
+		track.w.Update((double)box.width / info_.width, DETECTION_NOISE);
+		track.h.Update((double)box.height / info_.height, DETECTION_NOISE);
+		track.confidence = detections[pair.detection].confidence;
+		track.hits++;
+		track.last_seen = sequence_;
+	}
+
+	// Anything left over starts a new track.
+	for (unsigned int d = 0; d < detections.size(); d++)
+	{
+		if (detection_done[d])
+			continue;
+		libcamera::Rectangle const &box = detections[d].box;
+		Track track;
+		track.id = next_id_++;
+		track.category = detections[d].category;
+		track.confidence = detections[d].confidence;
+		track.cx.Init((box.x + box.width / 2.0) / info_.width);
+		track.cy.Init((box.y + box.height / 2.0) / info_.height);
+		track.w.Init((double)box.width / info_.width);
+		track.h.Init((double)box.height / info_.height);
+		track.hits = 1;
+		track.last_seen = sequence_;
+		tracks_.push_back(track);
+	}
+}
+
+// Find where the middle of the track's box went between the previous low resolution image and
+// this one, by looking for the best match (least sum of absolute differences) nearby.
+
+bool Tracker::followFlow(Track &track, double cx, double cy, uint8_t const *lores)
+{
+	int lores_w = lores_info_.width, lores_h = lores_info_.height, stride = lores_info_.stride;
+	int patch_w = std::clamp<int>(track.w.x * lores_w / 2, MIN_PATCH_SIZE, MAX_PATCH_SIZE);
+	int patch_h = std::clamp<int>(track.h.x * lores_h / 2, MIN_PATCH_SIZE, MAX_PATCH_SIZE);
+	int x0 = std::lround(cx * lores_w) - patch_w / 2, y0 = std::lround(cy * lores_h) - patch_h / 2;
+	int r = search_range_;
+	if (x0 - r < 0 || y0 - r < 0 || x0 + patch_w + r > lores_w || y0 + patch_h + r > lores_h)
+		return false;
+
+	unsigned int best = std::numeric_limits<unsigned int>::max(), worst = 0;
+	int best_dx = 0, best_dy = 0;
+	for (int dy = -r; dy <= r; dy++)
+	{
+		for (int dx = -r; dx <= r; dx++)
+		{
+			unsigned int sad = 0;
+			for (int y = 0; y < patch_h; y++)
+			{
+				uint8_t const *prev = &prev_lores_[(y0 + y) * stride + x0];
+				uint8_t const *cur = lores + (y0 + y + dy) * stride + x0 + dx;
+				for (int x = 0; x < patch_w; x++)
+					sad += std::abs(prev[x] - cur[x]);
+			}
+			if (sad < best)
+				best = sad, best_dx = dx, best_dy = dy;
+			worst = std::max(worst, sad);
+		}
+	}
+
+	// Featureless patches match equally well everywhere, so tell us nothing.
+	if (worst - best < 2u * patch_w * patch_h)
+		return false;
+
+	track.cx.Update(cx + (double)best_dx / lores_w, FLOW_NOISE);
+	track.cy.Update(cy + (double)best_dy / lores_h, FLOW_NOISE);
+	return true;
+}
+
+void Tracker::Advance(unsigned int sequence, uint8_t const *lores)
+{
+	// Frames may arrive slightly out of order, in which case there's nothing to do.
+	if (started_ && (int)(sequence - sequence_) <= 0)
+		return;
+	unsigned int frames = started_ ? sequence - sequence_ : 0;
+	sequence_ = sequence;
+	started_ = true;
+
+	tracks_.erase(std::remove_if(tracks_.begin(), tracks_.end(),
+								 [this](Track const &t) { return sequence_ - t.last_seen > max_age_; }),
+				  tracks_.end());
+
+	for (auto &track : tracks_)
+	{
+		// Where the track was in the previous image, which is where we look for it from.
+		double cx = track.cx.x, cy = track.cy.x;
+		track.cx.Predict(frames, PROCESS_NOISE);
+		track.cy.Predict(frames, PROCESS_NOISE);
+		track.w.Predict(frames, PROCESS_NOISE);
+		track.h.Predict(frames, PROCESS_NOISE);
+		if (flow_ && lores && !prev_lores_.empty() && frames == 1)
+			followFlow(track, cx, cy, lores);
+	}
+
+	if (flow_ && lores)
+		prev_lores_.assign(lores, lores + lores_info_.stride * lores_info_.height);
+}
+
+std::vector<Tracker::Object> Tracker::Objects() const
+{
+	std::vector<Object> objects;
+	for (auto const &track : tracks_)
+	{
+		if (track.hits >= min_hits_)
+		{
+			libcamera::Rectangle box = make_box(track.cx.x, track.cy.x, track.w.x, track.h.x, info_);
+			objects.push_back({ track.id, track.category, track.confidence, box });
+		}
+	}
+	return objects;
+}
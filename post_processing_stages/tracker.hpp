@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * tracker.hpp - track detected objects between detections
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <libcamera/geometry.h>
+
+#include "core/stream_info.hpp"
+
+// Detectors (such as the face and object detectors) are too expensive to run on every
+// frame. The Tracker keeps the boxes they find moving smoothly in between. Each box is
+// a track with a stable id, and a constant velocity Kalman filter predicts where it will
+// be on each frame. New detections are matched to the tracks by how much they overlap
+// (rather like SORT). Optionally, tracks can also be followed through the low resolution
+// image by block matching, which corrects the predictions when things change direction.
+
+class Tracker
+{
+public:
+	struct Object
+	{
+		unsigned int id; // assigned by the tracker
+		int category;
+		float confidence;
+		libcamera::Rectangle box;
+	};
+
+	Tracker();
+	// Read the tracking parameters, which are all prefixed with "track".
+	void Read(boost::property_tree::ptree const &params);
+	bool Enabled() const { return enabled_; }
+	// Give the size of the image the boxes are in, and of the low resolution image.
+	void Configure(StreamInfo const &info, StreamInfo const &lores_info);
+	// Match a new set of detections to the tracks.
+	void Update(std::vector<Object> const &detections);
+	// Move the tracks on to the frame with this sequence number. If we have the frame's low
+	// resolution image (the Y plane is all we use), the tracks may follow it.
+	void Advance(unsigned int sequence, uint8_t const *lores);
+	// The current tracks.
+	std::vector<Object> Objects() const;
+
+private:
+	// Constant velocity Kalman filter for one coordinate (measured as a fraction of the image
+	// size) and its velocity per frame.
+	struct Filter
+	{
+		void Init(double position);
+		void Predict(unsigned int frames, double noise);
+		void Update(double measurement, double noise);
+		double x, v;
+		double p00, p01, p11; // covariance
+	};
+	struct Track
+	{
+		unsigned int id;
+		int category;
+		float confidence;
+		Filter cx, cy, w, h;
+		unsigned int hits; // number of detections
+		unsigned int last_seen; // sequence number when last detected
+	};
+
+	bool followFlow(Track &track, double cx, double cy, uint8_t const *lores);
+
+	bool enabled_;
+	double iou_threshold_;
+	unsigned int max_age_;
+	unsigned int min_hits_;
+	bool flow_;
+	int search_range_;
+	StreamInfo info_;
+	StreamInfo lores_info_;
+	std::vector<Track> tracks_;
+	unsigned int next_id_;
+	unsigned int sequence_;
+	bool started_;
+	std::vector<uint8_t> prev_lores_;
+};
@@ -20,6 +20,8 @@
 #include <QPainter>
 #include <QWidget>
 
+#include "image/image_kernels.hpp"
+
 #include "preview.hpp"
 
 class MyMainWindow : public QMainWindow
@@ -81,33 +83,26 @@ public:
 	void SetInfoText(const std::string &text) override { main_window_->setWindowTitle(QString::fromStdString(text)); }
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override
 	{
-		// Cache the x sampling locations for speed. This is a quick nearest neighbour resize.
-		if (last_image_width_ != info.width)
-		{
-			last_image_width_ = info.width;
-			x_locations_.resize(window_width_);
-			for (unsigned int i = 0; i < window_width_; i++)
-				x_locations_[i] = (i * (info.width - 1) + (window_width_ - 1) / 2) / (window_width_ - 1);
-		}
-
-		uint8_t *Y_start = span.data();
-		uint8_t *U_start = Y_start + info.stride * info.height;
-		int uv_size = (info.stride / 2) * (info.height / 2);
-		uint8_t *dest = pane_->image.bits();
+		// Shrink the image to the window size first (a quick nearest neighbour resize), and
+		// convert just the pixels we show.
+		unsigned int w = window_width_, h = window_height_;
+		small_.resize(w * h * 3 / 2);
+		uint8_t const *Y = span.data();
+		uint8_t const *U = Y + info.stride * info.height;
+		uint8_t const *V = U + (info.stride / 2) * (info.height / 2);
+		uint8_t *small_U = small_.data() + w * h, *small_V = small_U + (w / 2) * (h / 2);
+		resize_plane_nearest(Y, info.stride, info.width, info.height, small_.data(), w, w, h);
+		resize_plane_nearest(U, info.stride / 2, info.width / 2, info.height / 2, small_U, w / 2, w / 2, h / 2);
+		resize_plane_nearest(V, info.stride / 2, info.width / 2, info.height / 2, small_V, w / 2, w / 2, h / 2);
 
 		// Choose the right matrix to convert YUV back to RGB.
-		static const float YUV2RGB[3][9] = {
-			{ 1.0,   0.0, 1.402, 1.0,   -0.344, -0.714, 1.0,   1.772, 0.0 }, // JPEG
-			{ 1.164, 0.0, 1.596, 1.164, -0.392, -0.813, 1.164, 2.017, 0.0 }, // SMPTE170M
-			{ 1.164, 0.0, 1.793, 1.164, -0.213, -0.533, 1.164, 2.112, 0.0 }, // Rec709
-		};
-		const float *M = YUV2RGB[0];
+		YuvToRgbMatrix const *matrix = &YUV_TO_RGB_JPEG;
 		if (info.colour_space == libcamera::ColorSpace::Jpeg)
-			M = YUV2RGB[0];
+			matrix = &YUV_TO_RGB_JPEG;
 		else if (info.colour_space == libcamera::ColorSpace::Smpte170m)
-			M = YUV2RGB[1];
+			matrix = &YUV_TO_RGB_SMPTE170M;
 		else if (info.colour_space == libcamera::ColorSpace::Rec709)
-			M = YUV2RGB[2];
+			matrix = &YUV_TO_RGB_REC709;
 		else
 			std::cerr << "QtPreview: unexpected colour space " << libcamera::ColorSpace::toString(info.colour_space)
 					  << std::endl;
@@ -116,42 +111,9 @@ public:
 		// is only that there might be some tearing, so I don't think we worry. We could speed
 		// it up by getting the ISP to supply RGB, but I'm not sure I want to handle that extra
 		// possibility in our main application code, so we'll put up with the slow conversion.
-		for (unsigned int y = 0; y < window_height_; y++)
-		{
-			int row = (y * (info.height - 1) + (window_height_ - 1) / 2) / (window_height_ - 1);
-			uint8_t *Y_row = Y_start + row * info.stride;
-			uint8_t *U_row = U_start + (row / 2) * (info.stride / 2);
-			uint8_t *V_row = U_row + uv_size;
-			for (unsigned int x = 0; x < window_width_;)
-			{
-				int y_off0 = x_locations_[x++];
-				int y_off1 = x_locations_[x++];
-				int uv_off0 = y_off0 >> 1;
-				int uv_off1 = y_off0 >> 1;
-				int Y0 = Y_row[y_off0];
-				int Y1 = Y_row[y_off1];
-				int U0 = U_row[uv_off0];
-				int V0 = V_row[uv_off0];
-				int U1 = U_row[uv_off1];
-				int V1 = V_row[uv_off1];
-				U0 -= 128;
-				V0 -= 128;
-				U1 -= 128;
-				V1 -= 128;
-				int R0 = M[0] * Y0 + M[2] * V0;
-				int G0 = M[3] * Y0 + M[4] * U0 + M[5] * V0;
-				int B0 = M[6] * Y0 + M[7] * U0;
-				int R1 = M[0] * Y1 + M[2] * V1;
-				int G1 = M[3] * Y1 + M[4] * U1 + M[5] * V1;
-				int B1 = M[6] * Y1 + M[7] * U1;
-				*(dest++) = std::clamp(R0, 0, 255);
-				*(dest++) = std::clamp(G0, 0, 255);
-				*(dest++) = std::clamp(B0, 0, 255);
-				*(dest++) = std::clamp(R1, 0, 255);
-				*(dest++) = std::clamp(G1, 0, 255);
-				*(dest++) = std::clamp(B1, 0, 255);
-			}
-		}
+		for (unsigned int y = 0; y < h; y++)
+			yuv420_to_rgb_row(small_.data() + y * w, small_U + (y / 2) * (w / 2), small_V + (y / 2) * (w / 2),
+							  pane_->image.scanLine(y), w, *matrix);
 
 		pane_->update();
 
@@ -191,8 +153,7 @@ private:
 	MyMainWindow *main_window_ = nullptr;
 	MyWidget *pane_ = nullptr;
 	std::thread thread_;
-	std::vector<uint16_t> x_locations_;
-	unsigned int last_image_width_ = 0;
+	std::vector<uint8_t> small_; // the image shrunk to the window size
 	unsigned int window_width_, window_height_;
 	std::mutex mutex_;
 	std::condition_variable cond_var_;